@@ -26,8 +26,11 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <cmdline.h>
+#include <csi_graph.hpp>
+#include <csi_math.hpp>
 #include <csi_reader.hpp>
 #include <csi_reader_func.hpp>
+#include <csi_stats.hpp>
 #include <filesystem>
 #include <iostream>
 #include <string>
@@ -46,8 +49,19 @@ int main(int argc, char *argv[]) {
                       false, "ac");
   ps.add("new-header", '\0', "decode as new header version");
   ps.add("non-zero", '\0', "non-zero values in guard band and pilot subcarrier");
+  ps.add<std::string>("graph", '\0',
+                      "processing graph run on each frame (e.g. \'beacon\')",
+                      false, "");
+  ps.add("fast-math", '\0',
+         "approximate amplitude, phase and dB (see csi_math.hpp for errors)");
+  ps.add("stats", '\0', "print per-stage latency and throughput statistics");
+  ps.add<int>("stats-interval", '\0', "interval of statistics report (second)",
+              false, 1);
   ps.parse_check(argc, argv);
 
+  // 振幅・位相の近似計算
+  csirdr::fast_math_enabled = ps.exist("fast-math");
+
   // 相対パスの処理
   std::filesystem::path pcap_path =
       std::filesystem::absolute(ps.get<std::string>("file"));
@@ -64,12 +78,37 @@ int main(int argc, char *argv[]) {
                         ps.exist("new-header"), ps.get<int>("nss"),
                         ps.get<int>("core"), ps.get<std::string>("wlan-std"));
 
+  // 処理グラフ（デコードと同じスレッドで実行）
+  csirdr::Csi_graph graph(0);
+  if (ps.get<std::string>("graph") != "") {
+    if (!graph.build(ps.get<std::string>("graph"))) {
+      return 1;
+    }
+    cr.set_graph(&graph);
+  }
+
+  // 処理段ごとの計測
+  csirdr::Csi_stats stats;
+  if (ps.exist("stats")) {
+    stats.start(ps.get<int>("stats-interval"));
+    csirdr::Csi_stats::set_thread_name("decode");
+  }
+
   if (ps.exist("non-zero")) {
     cr.decode(false);
   } else {
     cr.decode();
   }
 
+  if (graph.get_n_stages() > 0) {
+    graph.stop();
+    graph.print_summary(std::cout);
+  }
+
+  if (ps.exist("stats")) {
+    stats.stop();
+  }
+
   // 終了
   std::cout << "\n\n\nDONE" << std::endl;
 
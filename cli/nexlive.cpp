@@ -28,39 +28,291 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <cmdline.h>
 #include <filesystem>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <string>
+#include <vector>
 
 #include <csi_capture.hpp>
+#include <csi_graph.hpp>
+#include <csi_math.hpp>
 #include <csi_reader_func.hpp>
 #include <csi_realtime_graph.hpp>
+#include <csi_recorder.hpp>
+#include <csi_shm.hpp>
+#include <csi_stream.hpp>
+#include <csi_stats.hpp>
 
 int main(int argc, char *argv[]) {
   // コマンドライン引数
   cmdline::parser ps;
   ps.add<int>("time", 't', "time (second)", true);
   ps.add<std::string>("macadd", 'm', "target MAC address", false, "");
-  ps.add<std::string>("data", '\0', "graph data [\'abs\', \'arg\']", false,
-                      "abs");
+  ps.add<std::string>("data", '\0',
+                      "graph data [\'abs\', \'arg\', \'db\']", false, "abs");
   ps.add<int>("num-sub", 'n', "Number of subcarrier for graph plot", false,
               256);
   ps.add<int>("height", 'h', "Max value of graph's y axis", false, 3000);
   ps.add<int>("skip", '\0', "number of CSIs to skip", false, 0);
+  ps.add("plot-text", '\0',
+         "send plot data to gnuplot as text (default: binary)");
+  ps.add<double>("plot-fps", '\0', "plot frame rate (0: plot every frame)",
+                 false, PLOT_FPS);
+  ps.add<double>("waterfall", '\0',
+                 "plot a time x subcarrier waterfall of the last N seconds",
+                 false, 0);
+  ps.add<std::string>("layout", '\0',
+                      "plot of multiple antennas [\'panel\', \'overlay\', "
+                      "\'interleave\']",
+                      false, "panel");
+  ps.add<std::string>("plot-mode", '\0',
+                      "frames plotted at each tick [\'latest\', \'mean\']",
+                      false, "latest");
+  ps.add<std::string>("graph", '\0',
+                      "processing graph (e.g. \'mac:1234>beacon>plot\')",
+                      false, "");
+  ps.add<int>("workers", '\0', "number of graph worker threads", false,
+              GRAPH_WORKERS);
+  ps.add<std::string>("overload", '\0',
+                      "policy of full stage queues [\'drop-newest\', "
+                      "\'drop-oldest\', \'block\', \'adaptive\']",
+                      false, "drop-newest");
+  ps.add<int>("max-latency", '\0',
+              "target queue latency of adaptive policy (ms)", false,
+              GRAPH_MAX_LATENCY_MS);
+  ps.add<int>("nss", 'N', "number with spatial streams to capture", false, 1);
+  ps.add<int>("core", 'C', "number with cores where to active capture", false,
+              1);
   ps.add<std::string>("wlan-std", 's', "wlan standard [\'ac\', \'ax\']", false,
                       "ac");
+  ps.add<std::string>("device", 'd',
+                      "csi capture device [\'asus\', \'raspi\']", false,
+                      "raspi");
+  ps.add<std::string>("interface", 'i',
+                      "capture interfaces (comma separated)", false, "wlan0");
+  ps.add<std::string>("cpus", '\0',
+                      "cpus of capture threads (comma separated, -1: no pin)",
+                      false, "");
+  ps.add<int>("merge-window", '\0',
+              "reordering window of multiple interfaces (ms)", false,
+              MERGE_WINDOW_MS);
+  ps.add<std::string>("backend", '\0', "capture backend [\'pcap\', \'mmap\']",
+                      false, "pcap");
+  ps.add<int>("fanout", '\0', "PACKET_FANOUT group id of mmap backend", false,
+              -1);
+  ps.add("hw-timestamp", '\0',
+         "use adapter timestamps (SO_TIMESTAMPING, mmap backend)");
+  ps.add<int>("port", 'p', "UDP port of Nexmon CSI packets", false,
+              NEXMON_CSI_PORT);
+  ps.add<int>("ring-size", '\0', "number of packets buffered for processing",
+              false, DEFAULT_RING_SIZE);
+  ps.add<std::string>("record", '\0',
+                      "record raw packets and frames to <prefix>.pcap/.csi",
+                      false, "");
+  ps.add<int>("rotate-size", '\0', "rotate record files by size (MB, 0: off)",
+              false, 0);
+  ps.add<int>("rotate-time", '\0',
+              "rotate record files by time (second, 0: off)", false, 0);
+  ps.add<std::string>("stream", '\0',
+                      "publish frames on [\'tcp:port\', \'udp:port\', "
+                      "\'unix:path\']",
+                      false, "");
+  ps.add<std::string>("shm", '\0',
+                      "publish frames to a shared-memory ring (e.g. "
+                      "\'/nexmon_csi\')",
+                      false, "");
+  ps.add<int>("shm-slots", '\0', "number of frames in the shared-memory ring",
+              false, SHM_SLOTS);
+  ps.add<double>("status-hz", '\0', "refresh rate of status line (0: off)",
+                 false, DEFAULT_STATUS_HZ);
+  ps.add("fast-math", '\0',
+         "approximate amplitude, phase and dB (see csi_math.hpp for errors)");
+  ps.add("stats", '\0', "print per-stage latency and throughput statistics");
+  ps.add<int>("stats-interval", '\0', "interval of statistics report (second)",
+              false, 1);
   ps.parse_check(argc, argv);
 
+  // 振幅・位相の近似計算（スレッドの開始前に設定）
+  csirdr::fast_math_enabled = ps.exist("fast-math");
+
+  // 処理段ごとの計測
+  csirdr::Csi_stats stats;
+  if (ps.exist("stats")) {
+    stats.start(ps.get<int>("stats-interval"));
+  }
+
   // 対象MACアドレス
   std::string target_mac = ps.get<std::string>("macadd");
   std::transform(target_mac.begin(), target_mac.end(), target_mac.begin(),
                  tolower);
 
-  csirdr::Csi_plot cap(target_mac, 1, 1, true, ps.get<std::string>("wlan-std"),
-                       ps.get<int>("skip"));
+  // CSIの行列サイズ
+  const int n_rx = ps.get<int>("core"), n_tx = ps.get<int>("nss");
+  if (n_rx < 1 or n_rx > 4 or n_tx < 1 or n_tx > 4) {
+    std::cerr << "--core and --nss must be 1 to 4." << std::endl;
+    return 1;
+  }
+
+  // キャプチャスレッドを固定するコア（キャプチャの構築前に検査する）
+  std::vector<int> cpus;
+  std::stringstream ss(ps.get<std::string>("cpus"));
+  std::string cpu;
+  while (std::getline(ss, cpu, ',')) {
+    if (cpu == "") {
+      continue;
+    }
+    int id;
+    if (!csirdr::parse_int(cpu, id) or id < 0) {
+      std::cerr << "Invalid CPU in --cpus: " << cpu << std::endl;
+      return 1;
+    }
+    cpus.push_back(id);
+  }
+
+  // キャプチャのバックエンド（fanoutとアダプタの時刻はmmapのみ）
+  const std::string backend = ps.get<std::string>("backend");
+  if (backend != "pcap" and backend != "mmap") {
+    std::cerr << "Unknown backend: " << backend << " (pcap or mmap)"
+              << std::endl;
+    return 1;
+  }
+  if (backend != "mmap" and (ps.exist("fanout") or ps.exist("hw-timestamp"))) {
+    std::cerr << "--fanout and --hw-timestamp require --backend mmap."
+              << std::endl;
+    return 1;
+  }
+
+  csirdr::Csi_capture cap(ps.get<std::string>("interface"), target_mac, n_rx,
+                          n_tx, true, ps.get<std::string>("wlan-std"),
+                          ps.get<int>("ring-size"));
+
+  // 処理グラフ
+  // 指定がなければ従来の表示（MAC，間引き，ビーコン除去，グラフ）
+  csirdr::Csi_graph graph(ps.get<int>("workers"));
+  if (!graph.set_overload_policy(ps.get<std::string>("overload"),
+                                 ps.get<int>("max-latency"))) {
+    return 1;
+  }
+  graph.register_stage("plot", [&](std::string arg) {
+    auto plot = std::make_unique<csirdr::Csi_plot>();
+    plot->set_graph_opt(ps.get<int>("height"), ps.get<int>("num-sub"),
+                        arg == "" ? ps.get<std::string>("data") : arg);
+    plot->set_transfer(ps.exist("plot-text") ? "text" : "binary");
+    if (!plot->set_layout(ps.get<std::string>("layout"), n_rx, n_tx)) {
+      return std::unique_ptr<csirdr::Csi_stage>();
+    }
+    double fps = ps.get<double>("plot-fps");
+    if (ps.get<double>("waterfall") > 0) {
+      // 1行を描画の間隔にするので，フレームごとの描画にはしない
+      fps = fps > 0 ? fps : PLOT_FPS;
+      plot->set_waterfall(ps.get<double>("waterfall"), fps);
+    }
+    plot->set_fps(fps, ps.get<std::string>("plot-mode"));
+    std::unique_ptr<csirdr::Csi_stage> stage = std::move(plot);
+    return stage;
+  });
+
+  // 記録（生のパケットはキャプチャ，フレームは処理グラフの段で書き込む）
+  std::unique_ptr<csirdr::Csi_recorder> recorder;
+  if (ps.get<std::string>("record") != "") {
+    recorder = std::make_unique<csirdr::Csi_recorder>(
+        ps.get<std::string>("record"),
+        (uint64_t)ps.get<int>("rotate-size") << 20, ps.get<int>("rotate-time"));
+    recorder->set_port(ps.get<int>("port"));
+    graph.register_stage("record", [&](std::string) {
+      std::unique_ptr<csirdr::Csi_stage> stage =
+          std::make_unique<csirdr::Record_stage>(recorder.get());
+      return stage;
+    });
+  }
 
-  cap.set_graph_opt(ps.get<int>("height"), ps.get<int>("num-sub"),
-                    ps.get<std::string>("data"));
+  // ネットワーク配信（"stream:tcp:5600" など）
+  graph.register_stage("stream", [](std::string arg) {
+    std::unique_ptr<csirdr::Csi_stage> stage;
+    auto streamer = std::make_unique<csirdr::Csi_streamer>(arg);
+    if (streamer->start()) {
+      stage = std::make_unique<csirdr::Stream_stage>(std::move(streamer));
+    }
+    return stage;
+  });
 
+  // 共有メモリのリング（"shm:/nexmon_csi:1024" など）
+  graph.register_stage("shm", [&](std::string arg) {
+    std::unique_ptr<csirdr::Csi_stage> stage;
+    int n_slots = ps.get<int>("shm-slots");
+    size_t pos = arg.find(':');
+    if (pos != std::string::npos) {
+      if (!csirdr::parse_int(arg.substr(pos + 1), n_slots)) {
+        return stage;
+      }
+      arg = arg.substr(0, pos);
+    }
+    if (arg == "" or n_slots <= 0) {
+      return stage;
+    }
+    auto ring =
+        std::make_unique<csirdr::Csi_shm_ring>(arg, n_rx * n_tx, n_slots);
+    if (ring->open()) {
+      stage = std::make_unique<csirdr::Shm_stage>(std::move(ring));
+    }
+    return stage;
+  });
+
+  std::string spec = ps.get<std::string>("graph");
+  if (spec == "") {
+    if (target_mac != "") {
+      spec += "mac:" + target_mac + ">";
+    }
+    if (ps.get<int>("skip") > 0) {
+      spec += "skip:" + std::to_string(ps.get<int>("skip")) + ">";
+    }
+    spec += "beacon>plot";
+  }
+  if (recorder and spec.find("record") == std::string::npos) {
+    spec += ";record";
+  }
+  if (ps.get<std::string>("stream") != "") {
+    spec += ";stream:" + ps.get<std::string>("stream");
+  }
+  if (ps.get<std::string>("shm") != "") {
+    spec += ";shm:" + ps.get<std::string>("shm");
+  }
+  if (!graph.build(spec)) {
+    return 1;
+  }
+  cap.set_graph(&graph);
+  graph.set_latency_stats(true);
+
+  cap.set_backend(backend, ps.get<int>("fanout"));
+  if (!cap.set_device(ps.get<std::string>("device"))) {
+    return 1;
+  }
+  cap.set_port(ps.get<int>("port"));
+  cap.set_merge_window(ps.get<int>("merge-window"));
+  cap.set_hw_timestamp(ps.exist("hw-timestamp"));
+
+  cap.set_cpus(cpus);
+  cap.set_status_hz(ps.get<double>("status-hz"));
+
+  if (recorder) {
+    if (!recorder->start()) {
+      return 1;
+    }
+    cap.set_recorder(recorder.get());
+  }
+
+  graph.start();
   cap.capture_packet(ps.get<int>("time"));
+  graph.stop();
+  graph.print_summary(std::cout);
+  if (recorder) {
+    recorder->stop();
+    recorder->print_summary(std::cout);
+  }
+
+  if (ps.exist("stats")) {
+    stats.stop();
+  }
 
   std::cout << "\n\n\nDONE" << std::endl;
 
@@ -0,0 +1,162 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <vector>
+
+#include "csi_assembly.hpp"
+#include "csi_reader_func.hpp"
+
+namespace csirdr {
+
+// キーの攪拌（MACアドレスの下位ビットの偏りを散らす）
+static inline uint64_t hash_key(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+}
+
+Csi_assembly::Csi_assembly(Csi_frame_pool &pool, int n_rx, int n_tx,
+                           int capacity)
+    : pool(pool) {
+  this->n_rx = n_rx;
+  this->n_tx = n_tx;
+
+  size_t cap = 1;
+  while (cap < (size_t)capacity) {
+    cap <<= 1;
+  }
+  this->mask = cap - 1;
+
+  this->table.resize(cap);
+  for (auto &slot : this->table) {
+    slot.used = false;
+  }
+}
+
+tx_slot *Csi_assembly::find(uint64_t key) {
+  size_t i = hash_key(key) & this->mask;
+  for (size_t n = 0; n <= this->mask; n++, i = (i + 1) & this->mask) {
+    tx_slot &slot = this->table[i];
+    if (slot.used and slot.key == key) {
+      return &slot;
+    }
+    if (!slot.used) {
+      // 削除では後ろの要素を詰めるので，空き要素があればキーは表にない
+      slot.used = true;
+      slot.key = key;
+      this->n_used++;
+      return &slot;
+    }
+  }
+  return nullptr;
+}
+
+void Csi_assembly::erase(size_t i) {
+  this->table[i].frame.release();
+  this->table[i].used = false;
+  this->n_used--;
+
+  // 空きの後ろの要素を，本来の位置が空きより後ろでなければ空きに移す
+  size_t hole = i;
+  for (size_t j = (i + 1) & this->mask; this->table[j].used;
+       j = (j + 1) & this->mask) {
+    size_t home = hash_key(this->table[j].key) & this->mask;
+    if (((j - home) & this->mask) < ((j - hole) & this->mask)) {
+      continue;
+    }
+    this->table[hole] = std::move(this->table[j]);
+    this->table[j].used = false;
+    hole = j;
+  }
+}
+
+void Csi_assembly::evict_idle(int64_t now_ns) {
+  const int64_t idle_ns = (int64_t)ASSEMBLY_IDLE_SEC * 1000000000;
+  for (size_t i = 0; i <= this->mask; i++) {
+    // 詰めた要素が同じ位置に来るので，削除したら同じ位置を調べ直す
+    while (this->table[i].used and
+           now_ns - this->table[i].last_seen_ns > idle_ns) {
+      this->erase(i);
+      this->n_evicted++;
+    }
+  }
+}
+
+tx_slot *Csi_assembly::add(const csi_header &header, int iface,
+                           int64_t timestamp_ns, int &element) {
+  int core = header.core_stream_num & 0x7;
+  int stream = (header.core_stream_num >> 3) & 0x7;
+  if (core >= this->n_rx or stream >= this->n_tx) {
+    return nullptr;
+  }
+  element = stream * this->n_rx + core;
+
+  // 一定の間隔でパケットのない送信機を削除する
+  // 時刻が戻った（ファイルの切り替えなど）ときも探し直す
+  if (timestamp_ns >= this->next_sweep_ns or
+      timestamp_ns < this->next_sweep_ns -
+                         (int64_t)ASSEMBLY_SWEEP_SEC * 1000000000) {
+    this->evict_idle(timestamp_ns);
+    this->next_sweep_ns =
+        timestamp_ns + (int64_t)ASSEMBLY_SWEEP_SEC * 1000000000;
+  }
+
+  uint64_t key =
+      (header.tx_mac_add & 0xFFFFFFFFFFFFULL) | ((uint64_t)iface << 48);
+  tx_slot *slot = this->find(key);
+  if (slot == nullptr) {
+    this->n_table_full++;
+    return nullptr;
+  }
+  slot->last_seen_ns = timestamp_ns;
+
+  // 新しいシーケンス番号なら組み立てをやり直す
+  // 組み立て中のフレームがあれば使い回す
+  uint16_t seq = header.seq_num / 16;
+  Csi_frame *frame = slot->frame.get_mutable();
+  if (frame == nullptr) {
+    slot->frame = this->pool.acquire();
+    frame = slot->frame.get_mutable();
+    if (frame == nullptr) {
+      return nullptr;
+    }
+  } else if (frame->mask != 0 and frame->seq != seq) {
+    frame->reset();
+  }
+  if (frame->mask == 0) {
+    frame->seq = seq;
+    frame->timestamp_ns = timestamp_ns;
+    frame->iface = iface;
+  }
+  frame->header = header;
+
+  return slot;
+}
+
+} // namespace csirdr
@@ -0,0 +1,107 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+#include "csi_frame.hpp"
+#include "csi_reader_func.hpp"
+
+#ifndef CSI_ASSEMBLY
+#define CSI_ASSEMBLY
+
+#define ASSEMBLY_TABLE_SIZE 128 // 送信機の最大数（2のべき乗）
+#define ASSEMBLY_IDLE_SEC 10     // この間パケットのない送信機は表から削除
+#define ASSEMBLY_SWEEP_SEC 1     // 削除する送信機を探す間隔
+
+namespace csirdr {
+
+/*
+ * 送信機ごとの表の要素
+ * 組み立て中のフレームはプールから取得したものを使う
+ */
+typedef struct {
+  bool used;
+  uint64_t key;        // MAC | iface << 48
+  int64_t last_seen_ns; // 最後のパケットの受信時刻
+  Csi_frame_ref frame; // 組み立て中のフレーム（なければ空）
+} tx_slot;
+
+/*
+ * 送信機ごとのフレーム組み立て用の表
+ * MACアドレスをキーとするオープンアドレス法（線形探索）のハッシュ表
+ * 表はコンストラクタで確保し，フレームはプールから取得する
+ * ASSEMBLY_IDLE_SEC秒パケットのない送信機は，組み立て中のフレームを
+ * プールに返して表から削除する（後ろの要素を詰める削除で探索列を保つ）
+ * 処理スレッドのみから呼び出す
+ */
+class Csi_assembly {
+private:
+  Csi_frame_pool &pool;
+  int n_rx; // コア数
+  int n_tx; // ストリーム数
+  size_t mask; // 表の大きさ - 1
+
+  std::vector<tx_slot> table;
+  int n_used = 0;
+  uint64_t n_table_full = 0; // 表が満杯で破棄したパケット数
+  uint64_t n_evicted = 0;    // 削除した送信機の数
+  int64_t next_sweep_ns = 0; // 次に削除する送信機を探す時刻
+
+  // キーの位置を探索，なければ空き要素を確保，満杯ならnullptr
+  tx_slot *find(uint64_t key);
+
+  // 要素の削除（探索列が途切れないよう後ろの要素を詰める）
+  void erase(size_t i);
+
+  // now_nsの時点でパケットのない送信機の削除
+  void evict_idle(int64_t now_ns);
+
+public:
+  Csi_assembly(Csi_frame_pool &pool, int n_rx, int n_tx,
+               int capacity = ASSEMBLY_TABLE_SIZE);
+
+  /*
+   * パケットの送信機の組み立て中のフレームを取得
+   * シーケンス番号が変わったら組み立て中のフレームを破棄して新しく始める
+   * input: const csi_header &header, int iface, int64_t timestamp_ns
+   * output: int &element (パケットのCSIを書き込む要素の番号)
+   * return: 送信機の要素
+   *         （表やプールが満杯，範囲外のコア・ストリームならnullptr）
+   */
+  tx_slot *add(const csi_header &header, int iface, int64_t timestamp_ns,
+               int &element);
+
+  int get_n_used() { return this->n_used; }
+  uint64_t get_n_table_full() { return this->n_table_full; }
+  uint64_t get_n_evicted() { return this->n_evicted; }
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
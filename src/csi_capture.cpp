@@ -25,6 +25,9 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
@@ -32,6 +35,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <sstream>
 #include <stdlib.h>
 #include <string>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
 #include <vector>
 
 #include <Packet.h>
@@ -41,21 +47,48 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <UdpLayer.h>
 
 #include "csi_capture.hpp"
+#include "csi_packet_mmap.hpp"
 #include "csi_reader_func.hpp"
+#include "csi_source.hpp"
+#include "csi_stats.hpp"
 
 namespace csirdr {
-Csi_capture::Csi_capture() {
+std::string make_bpf_filter(int port, std::string target_mac) {
+  std::stringstream ss;
+  ss << "udp dst port " << port;
+
+  // MACアドレス末尾2バイトの照合
+  // udp[]はUDPヘッダの先頭からのオフセットなのでIPヘッダ長に依存しない
+  if (target_mac == "") {
+    return ss.str();
+  }
+  if (target_mac.size() != 4 or
+      target_mac.find_first_not_of("0123456789abcdef") != std::string::npos) {
+    std::cerr << "MAC address filter is not applied in kernel: " << target_mac
+              << std::endl;
+    return ss.str();
+  }
+  ss << " and udp[" << UDP_HEADER_LEN + CSI_MAC_OFFSET + 4 << ":2] = 0x"
+     << target_mac;
+
+  return ss.str();
+}
+
+Csi_capture::Csi_capture() : pool(1), assembly(pool, 1, 1), loss(1, 1) {
   this->interface = "wlan0";
   this->target_mac = "";
   this->n_rx = 1;
   this->n_tx = 1;
   this->new_header = true;
   this->wlan_std = "ac";
+  this->ring_size = DEFAULT_RING_SIZE;
 }
 
 Csi_capture::Csi_capture(std::string interface, std::string target_mac, int nrx,
-                         int ntx, bool new_header, std::string wlan_std) {
-  // インターフェイス
+                         int ntx, bool new_header, std::string wlan_std,
+                         int ring_size)
+    : pool(nrx * ntx), assembly(pool, nrx, ntx), loss(nrx, ntx) {
+  // インターフェイス（カンマ区切りで複数指定）
   this->interface = interface;
 
   // ヘッダバージョン
@@ -72,153 +105,277 @@ Csi_capture::Csi_capture(std::string interface, std::string target_mac, int nrx,
   this->n_tx = ntx;
   this->n_csi_elements = nrx * ntx;
 
-  // インターフェイス
-  this->dev = pcpp::PcapLiveDeviceList::getInstance().getPcapLiveDeviceByName(
-      this->interface);
-  if (this->dev == NULL) {
-    std::cerr << "Cannot find interface: " << this->interface << std::endl;
-  }
-
-  // デバイスのオープン
-  if (!this->dev->open()) {
-    std::cerr << "Cannot open devie: " << this->interface << std::endl;
-  }
-
-  std::cout << "=========================================" << std::endl;
-  std::cout << "Interface info:" << std::endl
-            << "   Interface name:        " << this->dev->getName()
-            << std::endl // get interface name
-            << "   Interface description: " << this->dev->getDesc()
-            << std::endl // get interface description
-            << "   MAC address:           " << this->dev->getMacAddress()
-            << std::endl // get interface MAC address
-            << "   Default gateway:       " << this->dev->getDefaultGateway()
-            << std::endl // get default gateway
-            << "   Interface MTU:         " << this->dev->getMtu()
-            << std::endl; // get interface MTU
-  std::cout << "=========================================" << std::endl;
+  // インターフェイスごとのリングの要素数
+  this->ring_size = ring_size;
 }
 
 Csi_capture::~Csi_capture() {
-  // デバイスのクローズ
-  this->dev->close();
+  if (this->process_thread.joinable()) {
+    this->processing = false;
+    this->process_thread.join();
+  }
+
+  // デバイスのクローズはCsi_sourceのディストラクタで実行
 }
 
 void Csi_capture::capture_packet(uint32_t time_sec) {
-  // キャプチャ開始
-  this->dev->pcpp::PcapLiveDevice::startCapture(this->on_packet_arrives, this);
-
-  // 測定時間のsleep
-  // この時間の処理は，キャプチャー時のコールバック関数で実装する
-  pcpp::multiPlatformSleep(time_sec);
+  // カーネルでのフィルタ
+  // 対象外のパケットはユーザ空間にコピーされない
+  std::string filter = make_bpf_filter(this->port, this->target_mac);
+  std::cout << "BPF filter: " << filter << std::endl;
+
+  // インターフェイスの一覧
+  std::vector<std::string> ifaces;
+  std::stringstream ss(this->interface);
+  std::string name;
+  while (std::getline(ss, name, ',')) {
+    if (name != "") {
+      ifaces.push_back(name);
+    }
+  }
 
-  // キャプチャ終了
-  this->dev->pcpp::PcapLiveDevice::stopCapture();
-}
+  // インターフェイスごとにキャプチャを準備
+  // 複数の場合，コアの指定がなければ i+1 番のコアに固定（0番は処理スレッド用）
+  long n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+  std::cout << "=========================================" << std::endl;
+  this->sources.clear();
+  for (int i = 0; i < (int)ifaces.size(); i++) {
+    int cpu = -1;
+    if (i < (int)this->cpus.size()) {
+      cpu = this->cpus[i];
+    } else if (ifaces.size() > 1 and n_cpu > 1) {
+      cpu = (i + 1) % n_cpu;
+    }
+    this->sources.push_back(std::make_unique<Csi_source>(
+        i, ifaces[i], this->backend, this->ring_size, this->fanout_group, cpu));
+    this->sources.back()->set_hw_timestamp(this->hw_timestamp);
+    this->sources.back()->print_info(std::cout);
+  }
+  std::cout << "=========================================" << std::endl;
 
-void Csi_capture::on_packet_arrives(pcpp::RawPacket *raw_packet,
-                                    pcpp::PcapLiveDevice *dev, void *cookie) {
-  pcpp::Packet parsed_packet(raw_packet);
-  if (!parsed_packet.isPacketOfType(pcpp::UDP))
+  for (auto &src : this->sources) {
+    if (!src->open(filter)) {
+      return;
+    }
+  }
+  if (this->sources.size() == 0) {
+    std::cerr << "No capture interface" << std::endl;
     return;
+  }
 
-  Csi_capture *cap = (Csi_capture *)cookie;
-
-  // デコードしてクラスのメンバ変数にCSIを一時保存
-  cap->load_packet(parsed_packet);
+  // 状態表示の開始
+  Csi_status status(this, this->status_hz);
+  status.start();
+
+  // キャプチャ
+  if (this->sources.size() == 1 and this->backend == "mmap") {
+    // 単一インターフェイスのmmapはキャプチャと処理を同じスレッドで実行
+    this->processing = true;
+    this->process_thread = std::thread(&Csi_capture::process_loop_mmap, this,
+                                       this->sources[0].get());
+    pcpp::multiPlatformSleep(time_sec);
+    this->processing = false;
+    this->process_thread.join();
+  } else {
+    this->processing = true;
+    this->process_thread = std::thread(&Csi_capture::process_loop, this);
+    for (auto &src : this->sources) {
+      src->start(time_sec);
+    }
 
-  // MACアドレスの表示
-  std::cout << "\rtarget MAC address: " << cap->get_target_mac_add()
-            << ", this CSI MAC address: " << cap->get_temp_mac_add();
+    // 測定時間のsleep
+    pcpp::multiPlatformSleep(time_sec);
 
-  // アプリケーション
-  cap->csi_app();
-}
+    // キャプチャ終了
+    for (auto &src : this->sources) {
+      src->stop();
+    }
 
-void Csi_capture::load_packet(pcpp::Packet parsed_packet) {
-  pcpp::UdpLayer *udp_layer = parsed_packet.getLayerOfType<pcpp::UdpLayer>();
-  uint8_t *payload = udp_layer->getLayerPayload();
-  int data_len = udp_layer->getDataLen();
+    // リングに残ったパケットを処理してから処理スレッドを終了
+    this->processing = false;
+    this->process_thread.join();
+  }
+  this->update_statistics();
 
-  // ヘッダーの保存
-  this->temp_header = csirdr::get_csi_header(payload, this->new_header);
+  status.stop();
 
-  // CSIをデコードして保存
-  // Csi_captureはraspi専用
-  this->temp_csi.push_back(
-      csirdr::get_csi_from_packet_raspi(payload, data_len, this->wlan_std));
+  // 損失の集計を出力
+  this->loss.flush();
+  this->loss.print_summary(std::cout);
+  std::cout << "Interfaces:" << std::endl;
+  for (auto &src : this->sources) {
+    src->print_summary(std::cout);
+  }
+  std::cout << "Assembly: " << this->assembly.get_n_used()
+            << " transmitters (" << this->assembly.get_n_evicted()
+            << " evicted as idle), " << this->assembly.get_n_table_full()
+            << " packets dropped (table full), "
+            << this->pool.get_n_exhausted() << " (frame pool empty)"
+            << std::endl;
 }
 
-bool Csi_capture::is_full_temp_csi() {
-  return ((int)this->temp_csi.size()) == this->n_csi_elements;
+void Csi_capture::update_statistics() {
+  uint64_t recv = 0, drop = 0, ifdrop = 0;
+  for (auto &src : this->sources) {
+    src->update_statistics();
+    recv += src->get_kernel_recv();
+    drop += src->get_kernel_drop();
+    ifdrop += src->get_kernel_ifdrop();
+  }
+  this->loss.set_pcap_stats(recv, drop, ifdrop);
 }
 
-void Csi_capture::clear_temp_csi() {
-  // 一時保存されているCSIデータの削除
-  // 消去の仕方が悪いかもしれない
-  this->temp_csi.clear();
-}
+void Csi_capture::process_loop() {
+  if (stats_enabled) {
+    Csi_stats::set_thread_name("process");
+  }
 
-std::vector<csirdr::csi_vec> Csi_capture::get_temp_csi() {
-  // あえてゲッタを作るのは，ここでなんらかの処理を入れるかもしれないから
-  return this->temp_csi;
-}
+  const int64_t window_ns = (int64_t)this->merge_window_ms * 1000000;
+  auto t_stats = std::chrono::steady_clock::now();
+
+  while (true) {
+    // 終了指示はリングを空にしてから反映
+    bool running = this->processing.load(std::memory_order_acquire);
+
+    // まとめて取り出して処理
+    int n = 0;
+    while (n < PROCESS_BATCH_SIZE) {
+      // 各リングの先頭のうち受信時刻が最も古いものを選択
+      // リングの中は受信順なので，これで全体が時刻順になる
+      Csi_source *src = nullptr;
+      csi_packet *pkt = nullptr;
+      bool has_empty = false;
+      for (auto &s : this->sources) {
+        csi_packet *p = s->get_ring().front();
+        if (p == nullptr) {
+          has_empty = true;
+        } else if (pkt == nullptr or p->timestamp_ns < pkt->timestamp_ns) {
+          src = s.get();
+          pkt = p;
+        }
+      }
+      if (pkt == nullptr) {
+        break;
+      }
 
-std::vector<float> Csi_capture::get_temp_csi_series(std::string mode) {
-  int n_sub = (int)this->temp_csi[0].size();
-  int n_csi_elements = (int)this->temp_csi.size();
-  int n_rx = this->n_rx;
-  int n_tx = this->n_tx;
-  int e_idx;
-  std::vector<float> csi_series(n_sub * n_csi_elements, 0.0);
-
-  for (int sub = 0; sub < n_sub; sub++) {
-    for (int e = 0; e < n_csi_elements; e++) {
-      e_idx = (e % n_rx) * n_rx + (e / n_tx); // 要素番号計算
-      if (mode == "amplitude") {
-        csi_series[e + n_csi_elements * sub] =
-            std::abs(this->temp_csi[e_idx][sub]);
-      } else if (mode == "phase") {
-        csi_series[e + n_csi_elements * sub] =
-            std::arg(this->temp_csi[e_idx][sub]);
+      // 空のリングがあれば，そのインターフェイスからより古いパケットが
+      // 遅れて届く可能性があるので，受信から一定時間が経つまで待つ
+      if (running and has_empty and this->sources.size() > 1) {
+        if (realtime_ns() - pkt->timestamp_ns < window_ns) {
+          break;
+        }
       }
+
+      this->load_packet(pkt->payload, pkt->data_len, src->get_index(),
+                        pkt->timestamp_ns);
+      src->get_ring().pop();
+      n++;
     }
-  }
 
-  return csi_series;
+    // カーネルの統計（1秒ごと）
+    auto now = std::chrono::steady_clock::now();
+    if (now - t_stats >= std::chrono::seconds(1)) {
+      this->update_statistics();
+      t_stats = now;
+    }
+
+    if (n == 0) {
+      if (!running) {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(PROCESS_IDLE_USEC));
+    }
+  }
 }
 
-std::string Csi_capture::get_temp_mac_add() {
-  std::stringstream ss;
-  ss << std::hex << std::setw(4) << std::setfill('0')
-     << (this->temp_header.tx_mac_add & 0x0000FFFF);
+void Csi_capture::process_loop_mmap(Csi_source *src) {
+  if (stats_enabled) {
+    Csi_stats::set_thread_name("mmap");
+  }
 
-  return ss.str();
-}
+  Csi_packet_mmap *mm = src->get_mmap();
 
-bool Csi_capture::is_target_mac() {
-  if (this->target_mac == "") {
-    return true;
+  // ブロック中のパケットの参照（最大数で確保して使い回す）
+  std::vector<csi_packet_view> views;
+  views.reserve(MMAP_BLOCK_SIZE /
+                (CSI_HEADER_OFFSET + 64 * BYTE_OF_CSI_DATA_UNIT));
+
+  auto t_stats = std::chrono::steady_clock::now();
+  while (this->processing.load(std::memory_order_acquire)) {
+    // ブロック単位でデコーダに渡す
+    // ペイロードはリング上のものを直接読むのでコピーしない
+    if (mm->next_block(MMAP_BLOCK_TIMEOUT_MS, views)) {
+      for (auto &v : views) {
+        this->load_packet(v.payload, v.data_len, 0, v.timestamp_ns);
+      }
+      src->add_packets(views.size());
+      mm->release_block();
+    }
+
+    // カーネルの統計（1秒ごと）
+    auto now = std::chrono::steady_clock::now();
+    if (now - t_stats >= std::chrono::seconds(1)) {
+      this->update_statistics();
+      t_stats = now;
+    }
   }
-  return this->get_temp_mac_add() == this->target_mac;
 }
 
-bool Csi_capture::is_from_beacon() {
-  if (this->temp_csi.size() == 0) {
-    return false;
+void Csi_capture::load_packet(uint8_t *payload, int data_len, int iface,
+                              int64_t timestamp_ns) {
+  // 生のパケットの記録（バッファへのコピーのみ）
+  if (this->recorder != nullptr) {
+    this->recorder->write_packet(payload, data_len, timestamp_ns);
   }
 
-  int cnt = 0;
-  int n_sub = this->temp_csi[0].size();
-  int th = 150;
+  // ヘッダーの保存
+  {
+    Stage_timer timer(STAGE_HEADER_PARSE);
+    this->temp_header = csirdr::get_csi_header(payload, this->new_header);
+  }
+  this->temp_iface = iface;
+  this->loss.on_packet(this->temp_header, iface);
+  this->mac_counter.add(this->temp_header.tx_mac_add);
+
+  // 送信機の組み立て中のフレーム
+  Stage_timer timer_assembly(STAGE_FRAME_ASSEMBLY);
+  int element;
+  tx_slot *slot =
+      this->assembly.add(this->temp_header, iface, timestamp_ns, element);
+  if (slot == nullptr) {
+    return;
+  }
+  timer_assembly.stop();
+
+  // CSIをフレームの領域に直接デコード
+  // デコード関数はset_device()で選択済み
+  Csi_frame *frame = slot->frame.get_mutable();
+  int n_sub = this->decode(payload, data_len, this->wlan_std,
+                           frame->get_csi_buffer(element), true);
+  frame->set_element(element, n_sub);
+
+  // そろったらアプリケーションに渡す
+  if (frame->is_complete()) {
+    Csi_frame_ref ref = std::move(slot->frame);
+    Stage_timer timer(STAGE_APP);
+    this->csi_app(ref);
+  }
+}
 
-  for (int i = 0; i < n_sub; i++) {
-    if (std::abs(std::complex<float>(temp_csi[0][i].real(),
-                                     temp_csi[0][i].imag())) < th) {
-      cnt++;
-    }
+bool Csi_capture::set_device(std::string device) {
+  csi_decode_func decode = get_csi_decoder(device);
+  if (decode == nullptr) {
+    return false;
   }
+  this->device = device;
+  this->decode = decode;
+  return true;
+}
 
-  return cnt > (n_sub / 2);
+void Csi_capture::csi_app(const Csi_frame_ref &frame) {
+  if (this->graph != nullptr) {
+    this->graph->push(frame);
+  }
 }
+
 } // namespace csirdr
@@ -25,33 +25,62 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <atomic>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <stdlib.h>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <Packet.h>
 #include <PcapLiveDeviceList.h>
 
+#include "csi_assembly.hpp"
+#include "csi_frame.hpp"
+#include "csi_graph.hpp"
+#include "csi_loss.hpp"
 #include "csi_reader_func.hpp"
+#include "csi_recorder.hpp"
+#include "csi_ring.hpp"
+#include "csi_source.hpp"
+#include "csi_status.hpp"
 
 #ifndef CSI_CAPTURE
 #define CSI_CAPTURE
 
+#define DEFAULT_RING_SIZE 4096 // リングバッファの要素数
+#define PROCESS_BATCH_SIZE 64  // 処理スレッドが一度に取り出すパケット数
+#define PROCESS_IDLE_USEC 100  // リングが空のときの処理スレッドの待ち時間
+#define NEXMON_CSI_PORT 5500   // Nexmon CSIのUDPポート
+#define CSI_MAC_OFFSET 4       // UDPペイロード中の送信元MACアドレスの位置
+#define UDP_HEADER_LEN 8
+#define MERGE_WINDOW_MS 20 // 複数インターフェイスの時刻順の並べ替えで待つ時間
+
 namespace csirdr {
+
+/*
+ * キャプチャ設定からBPFフィルタの文字列を生成する関数
+ * NexmonのUDPポートに加えて，target_mac（MACアドレス末尾4桁）が
+ * 指定されていればペイロード中の送信元MACアドレスを照合する
+ * input: int port, std::string target_mac
+ * return: pcap_compile()に渡すフィルタ文字列
+ */
+std::string make_bpf_filter(int port, std::string target_mac);
+
 class Csi_capture {
 protected:
-  pcpp::PcapLiveDevice *dev; // アンテナデバイス
-
   bool new_header;      // ヘッダのバージョン
   std::string wlan_std; // 標準規格
 
   // パスやデバイス名など
-  std::string device;     // CSI取得のデバイス
-  std::string interface;  // インターフェイス名
+  std::string device = "raspi"; // CSI取得のデバイス
+  csirdr::csi_decode_func decode = csirdr::decode_csi_raspi;
+  std::string interface;  // インターフェイス名（カンマ区切りで複数指定）
   std::string target_mac; // 対象機器のMACアドレスの末尾4ケタ
+  int port = NEXMON_CSI_PORT; // CSIのUDPポート
 
   /*
    * CSIの行列サイズ
@@ -61,14 +90,73 @@ protected:
   int n_csi_elements; // CSI行列の要素数
 
   /*
-   * 取得CSIの一時保存
+   * 送信機ごとのフレームの組み立て
+   * 複数の送信機のパケットが混ざっても別々に組み立てる
+   * フレームはプールから取得し，アプリケーションが参照を手放すと戻る
+   */
+  csirdr::Csi_frame_pool pool;
+  csirdr::Csi_assembly assembly;
+
+  /*
+   * そろったフレームを渡す処理グラフ
+   */
+  csirdr::Csi_graph *graph = nullptr;
+
+  /*
+   * 生のパケットの記録（nullptrなら記録しない）
    */
-  std::vector<csirdr::csi_vec> temp_csi;
+  csirdr::Csi_recorder *recorder = nullptr;
 
   /*
-   * 取得ヘッダの一時保存
+   * 直前のパケットのヘッダの一時保存
    */
   csirdr::csi_header temp_header;
+  int temp_iface = 0; // 取得したインターフェイスの番号
+
+  /*
+   * シーケンス番号の欠番やドロップの集計
+   */
+  csirdr::Csi_loss loss;
+
+  /*
+   * インターフェイスごとのキャプチャ
+   * それぞれ専用のスレッドで受信し，リングバッファに書き込む
+   */
+  std::vector<std::unique_ptr<csirdr::Csi_source>> sources;
+  int ring_size;          // インターフェイスごとのリングの要素数
+  std::vector<int> cpus;  // キャプチャスレッドを固定するコア
+  int merge_window_ms = MERGE_WINDOW_MS;
+  bool hw_timestamp = false; // アダプタのタイムスタンプ（mmapのみ）
+
+  /*
+   * 処理スレッド
+   * 各リングの先頭から受信時刻の最も古いパケットを順に取り出し，
+   * デコードとアプリケーションを実行
+   */
+  std::thread process_thread;
+  std::atomic<bool> processing{false};
+  void process_loop();
+
+  /*
+   * キャプチャのバックエンド
+   * "pcap": libpcap（コールバックからリングにコピー）
+   * "mmap": AF_PACKET TPACKET_V3
+   *         単一インターフェイスならブロックを直接デコード
+   */
+  std::string backend = "pcap";
+  int fanout_group = -1; // mmapのPACKET_FANOUTのグループID（負なら使用しない）
+  void process_loop_mmap(csirdr::Csi_source *src);
+
+  /*
+   * 全インターフェイスのカーネルの統計の更新
+   */
+  void update_statistics();
+
+  /*
+   * 状態表示
+   */
+  csirdr::Mac_counter mac_counter; // 送信機ごとのパケット数
+  double status_hz = DEFAULT_STATUS_HZ;
 
 public:
   /*
@@ -77,85 +165,123 @@ public:
    */
   Csi_capture();
   Csi_capture(std::string interface, std::string target_mac, int nrx, int ntx,
-              bool new_header, std::string wlan_std);
+              bool new_header, std::string wlan_std,
+              int ring_size = DEFAULT_RING_SIZE);
 
   ~Csi_capture(); // ディストラクタ
 
   /*
    * パケットキャプチャ関数
-   * キャプチャ，デコード，出力は一緒に実行
+   * キャプチャはlibpcapのスレッド，デコードと出力は処理スレッドで実行
    */
   void capture_packet(uint32_t time = 10);
 
   /*
-   * parsed packetからCSIを算出する関数
+   * UDPペイロードからCSIを算出する関数
+   * 送信機のフレームの全コア・ストリームがそろったらcsi_app()を呼び出す
    */
-  void load_packet(pcpp::Packet parsed_packet);
+  void load_packet(uint8_t *payload, int data_len, int iface,
+                   int64_t timestamp_ns);
 
   /*
    * アプリケーションを提供する関数
-   * 純粋仮想関数なので，継承したら必ずオーバーライド
+   * 既定では処理グラフにフレームを渡す
+   * フレームは参照を保持している間だけ有効
+   * （コピーして保持すれば呼び出し後も読める）
    */
-  virtual void csi_app() = 0;
+  virtual void csi_app(const csirdr::Csi_frame_ref &frame);
 
   /*
-   * 一時保存したCSIの要素数が最大なのか確認
+   * 処理グラフの設定
+   * グラフはキャプチャより長く存在させる
    */
-  bool is_full_temp_csi();
+  void set_graph(csirdr::Csi_graph *graph) { this->graph = graph; }
 
   /*
-   * 一時保存したCSIのMACアドレスがターゲットと一致するのか判定
+   * 生のパケットの記録の設定
+   * レコーダはキャプチャより長く存在させる
    */
-  bool is_target_mac();
+  void set_recorder(csirdr::Csi_recorder *recorder) {
+    this->recorder = recorder;
+  }
 
   /*
-   * 一時保存CSIがビーコンフレームによるものか判定
+   * ターゲットMACアドレス（末尾4桁）を出力
    */
-  bool is_from_beacon();
+  std::string get_target_mac_add() { return this->target_mac; };
 
   /*
-   * 一時保存したCSIデータのクリア
+   * 損失の集計を出力
    */
-  void clear_temp_csi();
+  csirdr::Csi_loss &get_loss() { return this->loss; }
 
   /*
-   * 一時保存したCSIデータの出力
+   * 送信機ごとのパケット数の出力
    */
-  std::vector<csirdr::csi_vec> get_temp_csi();
+  const csirdr::Mac_counter &get_mac_counter() { return this->mac_counter; }
 
   /*
-   * 一時保存したCSIデータを1次元ベクトルとして出力
+   * キャプチャのバックエンドの設定（"pcap" または "mmap"）
    */
-  std::vector<float> get_temp_csi_series(std::string mode);
+  void set_backend(std::string backend, int fanout_group = -1) {
+    this->backend = backend;
+    this->fanout_group = fanout_group;
+  }
 
   /*
-   * 一時保存したヘッダのMACアドレスを出力
+   * CSI取得のデバイスの設定（"raspi" または "asus"）
+   * デコード関数はここで1回だけ選択する
+   * return: 未知のデバイスならfalse
    */
-  std::string get_temp_mac_add();
+  bool set_device(std::string device);
 
   /*
-   * ターゲットMACアドレス（末尾4桁）を出力
+   * CSIのUDPポートの設定（カーネルのフィルタに使用）
    */
-  std::string get_target_mac_add() { return this->target_mac; };
+  void set_port(int port) { this->port = port; }
+
+  /*
+   * 状態表示の更新頻度（Hz）の設定，0なら表示しない
+   */
+  void set_status_hz(double hz) { this->status_hz = hz; }
+
+  /*
+   * キャプチャスレッドを固定するコアの設定
+   * インターフェイスの順に対応，負の値なら固定しない
+   */
+  void set_cpus(std::vector<int> cpus) { this->cpus = cpus; }
+
+  /*
+   * アダプタのタイムスタンプ（SO_TIMESTAMPING）の使用，mmapのみ
+   */
+  void set_hw_timestamp(bool on) { this->hw_timestamp = on; }
 
   /*
-   * CSIが格納されたパケットが取得されたときに呼び出される関数
-   * アプリケーション関数はここで呼び出す
-   * 継承したら，同じ名前の関数で書き直す
+   * 複数インターフェイスの時刻順の並べ替えで待つ時間（ミリ秒）
    */
-  static void on_packet_arrives(pcpp::RawPacket *raw_packet,
-                                pcpp::PcapLiveDevice *dev, void *cookie);
+  void set_merge_window(int ms) { this->merge_window_ms = ms; }
 
   /*
-   * 一時保存CSIの要素数
+   * インターフェイスごとのキャプチャの出力（統計の取得用）
    */
-  inline int get_n_elements() {
-    if (this->temp_csi.size() == 0) {
-      return 0;
-    } else {
-      return this->temp_csi.size() * this->temp_csi[0].size();
-    }
+  const std::vector<std::unique_ptr<csirdr::Csi_source>> &get_sources() {
+    return this->sources;
   }
+
+  /*
+   * 組み立て中の送信機の数
+   */
+  int get_n_transmitters() { return this->assembly.get_n_used(); }
+
+  /*
+   * 直前のパケットを取得したインターフェイスの番号
+   */
+  int get_temp_iface() { return this->temp_iface; }
+
+  /*
+   * フレームのプールの出力（使用数の取得用）
+   */
+  csirdr::Csi_frame_pool &get_pool() { return this->pool; }
 };
 
 } // namespace csirdr
@@ -0,0 +1,183 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <iostream>
+#include <memory>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "csi_doppler.hpp"
+#include "csi_fft.hpp"
+#include "csi_frame.hpp"
+
+namespace csirdr {
+
+Doppler_stage::Doppler_stage(int window, int hop, int sub_first, int sub_last)
+    : fft(window) {
+  this->window = window;
+  this->hop = std::max(hop, 1);
+  this->sub_first = std::max(sub_first, 0);
+  this->sub_last = sub_last;
+
+  // 周期的なHann窓
+  this->hann.resize(window);
+  double sum = 0;
+  for (int i = 0; i < window; i++) {
+    this->hann[i] = (float)(0.5 - 0.5 * std::cos(2 * M_PI * i / window));
+    sum += this->hann[i];
+  }
+  this->scale = (float)(1.0 / sum);
+  this->work.resize(window);
+  this->power.resize(window);
+}
+
+void Doppler_stage::reset(doppler_state &st, int n_elements, int n_sub) {
+  st.n_elements = n_elements;
+  st.n_sub = n_sub;
+  int last = this->sub_last < 0 ? n_sub - 1
+                                 : std::min(this->sub_last, n_sub - 1);
+  st.first = this->sub_first;
+  st.n_selected = std::max(last - st.first + 1, 0);
+  if (st.n_selected == 0 and n_sub > 0) {
+    std::cerr << "doppler: subcarrier " << this->sub_first
+              << " is out of range (" << n_sub << " subcarriers)" << std::endl;
+  }
+  st.count = 0;
+  st.head = 0;
+  st.since = 0;
+  st.history.assign((size_t)n_elements * st.n_selected * this->window, 0);
+}
+
+void Doppler_stage::transform(const doppler_state &st, Csi_frame &dst) {
+  int w = this->window;
+  std::complex<float> *buf = this->work.data();
+  for (int e = 0; e < st.n_elements; e++) {
+    std::fill(this->power.begin(), this->power.end(), 0);
+    for (int j = 0; j < st.n_selected; j++) {
+      // 古い順に並べて窓の平均を引き，窓関数を掛ける
+      const std::complex<float> *ring =
+          st.history.data() + (size_t)(e * st.n_selected + j) * w;
+      std::copy(ring + st.head, ring + w, buf);
+      std::copy(ring, ring + st.head, buf + (w - st.head));
+      float mr = 0, mi = 0;
+      for (int i = 0; i < w; i++) {
+        mr += buf[i].real();
+        mi += buf[i].imag();
+      }
+      mr /= w;
+      mi /= w;
+      for (int i = 0; i < w; i++) {
+        buf[i] = std::complex<float>((buf[i].real() - mr) * this->hann[i],
+                                     (buf[i].imag() - mi) * this->hann[i]);
+      }
+
+      this->fft.forward(buf);
+      for (int k = 0; k < w; k++) {
+        this->power[k] += buf[k].real() * buf[k].real() +
+                          buf[k].imag() * buf[k].imag();
+      }
+    }
+
+    // ドップラー周波数0が中央になるように並べ替える
+    std::complex<float> *out = dst.get_csi_buffer(e);
+    float inv = 1.0f / std::max(st.n_selected, 1);
+    for (int k = 0; k < w; k++) {
+      out[(k + w / 2) % w] =
+          std::complex<float>(std::sqrt(this->power[k] * inv) * this->scale, 0);
+    }
+    dst.set_element(e, w);
+  }
+}
+
+bool Doppler_stage::process(Csi_frame_ref &frame) {
+  if (!this->pool) {
+    this->pool = std::make_unique<Csi_frame_pool>(frame->get_n_elements());
+  }
+  doppler_state &st = this->states.get(*frame);
+  if (frame->get_n_elements() != st.n_elements or
+      frame->get_n_sub() != st.n_sub) {
+    this->reset(st, frame->get_n_elements(), frame->get_n_sub());
+  }
+  if (st.n_selected == 0) {
+    return false;
+  }
+
+  // 選んだサブキャリアをリングに書き込む
+  for (int e = 0; e < st.n_elements; e++) {
+    const std::complex<float> *csi = frame->get_csi(e) + st.first;
+    std::complex<float> *ring =
+        st.history.data() + (size_t)e * st.n_selected * this->window;
+    for (int j = 0; j < st.n_selected; j++) {
+      ring[(size_t)j * this->window + st.head] = csi[j];
+    }
+  }
+  st.head = (st.head + 1) % this->window;
+  st.count = std::min(st.count + 1, this->window);
+  st.since++;
+  if (st.count < this->window or st.since < this->hop) {
+    return false;
+  }
+  st.since = 0;
+
+  Csi_frame_ref out = this->pool->acquire();
+  Csi_frame *dst = out.get_mutable();
+  if (dst == nullptr) {
+    this->n_exhausted++;
+    return false;
+  }
+  dst->header = frame->header;
+  dst->iface = frame->iface;
+  dst->seq = frame->seq;
+  dst->timestamp_ns = frame->timestamp_ns;
+  this->transform(st, *dst);
+  this->n_spectra++;
+
+  // 後段にはスペクトルのフレームを渡す
+  frame = std::move(out);
+  return true;
+}
+
+void Doppler_stage::flush() {
+  std::cout << "Doppler (window " << this->window << ", hop " << this->hop
+            << "): " << this->n_spectra << " spectra, "
+            << this->states.size() << " transmitters" << std::endl;
+  if (this->states.get_n_evicted() > 0) {
+    std::cerr << "doppler: " << this->states.get_n_evicted()
+              << " transmitter windows discarded (more than " << TX_STATE_MAX
+              << " transmitters)" << std::endl;
+  }
+  if (this->n_exhausted > 0) {
+    std::cerr << "doppler: " << this->n_exhausted
+              << " spectra dropped (pool exhausted)" << std::endl;
+  }
+}
+
+} // namespace csirdr
@@ -0,0 +1,113 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <complex>
+#include <memory>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "csi_fft.hpp"
+#include "csi_frame.hpp"
+#include "csi_graph.hpp"
+#include "csi_tx_state.hpp"
+
+#ifndef CSI_DOPPLER
+#define CSI_DOPPLER
+
+#define DOPPLER_WINDOW 64 // 窓のフレーム数の既定値（2のべき乗）
+#define DOPPLER_HOP 16    // 出力の間隔（フレーム数）の既定値
+
+namespace csirdr {
+
+/*
+ * 1つの送信機の窓
+ */
+typedef struct {
+  int n_elements = 0;
+  int n_sub = 0;
+  int first = 0; // 選んだサブキャリアの範囲（フレームに合わせて切り詰め）
+  int n_selected = 0;
+  int count = 0; // 窓の値の数（window個まで）
+  int head = 0;  // リングで次に書き込む位置（最も古い値）
+  int since = 0; // 前回の出力からのフレーム数
+  std::vector<std::complex<float>> history; // (要素 * 選択数 + 番号) * window
+} doppler_state;
+
+/*
+ * 時間方向の短時間フーリエ変換（ドップラースペクトル）
+ * 要素ごとに選んだサブキャリアのCSIを直近window個ずつ窓関数（Hann）を
+ * 掛けてFFTし，サブキャリアについてパワーを平均する
+ * 窓の平均（静止した経路の成分）は変換前に引く
+ * 窓はサブキャリアごとのリングに保持し，hopフレームごとに重なった窓を
+ * そのまま変換する
+ * 窓とホップの数え方は送信機（MACアドレスと受信インターフェイス）ごと
+ * 出力はhopフレームに1つのフレームで，要素ごとにwindow個の振幅スペクトル
+ * （ドップラー周波数0が中央，ビンkは(k - window/2) / window × パケットレート）
+ * を実部に持つ，それ以外のフレームは後段に渡さない
+ * 段の指定: "doppler[:窓[:ホップ[:サブキャリア]]]"
+ * サブキャリアは番号 k または範囲 a-b（既定はすべて）
+ */
+class Doppler_stage : public Csi_stage {
+private:
+  int window;
+  int hop;
+  int sub_first;
+  int sub_last; // 負ならフレームの最後のサブキャリアまで
+
+  std::unique_ptr<Csi_frame_pool> pool; // 最初のフレームの要素数で確保
+  Csi_fft fft;
+  std::vector<float> hann;
+  float scale; // 窓関数の和で割って振幅を合わせる
+
+  Tx_state_map<doppler_state> states;
+  std::vector<std::complex<float>> work;
+  std::vector<float> power;
+
+  uint64_t n_spectra = 0;
+  uint64_t n_exhausted = 0; // プールが空で破棄したスペクトル数
+
+  void reset(doppler_state &st, int n_elements, int n_sub);
+
+  // 窓のスペクトルの計算と出力フレームへの書き込み
+  void transform(const doppler_state &st, Csi_frame &dst);
+
+public:
+  Doppler_stage(int window = DOPPLER_WINDOW, int hop = DOPPLER_HOP,
+                int sub_first = 0, int sub_last = -1);
+  std::string get_name() override { return "doppler"; }
+  bool process(Csi_frame_ref &frame) override;
+
+  /*
+   * 出力したスペクトル数の出力
+   */
+  void flush() override;
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
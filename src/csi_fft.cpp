@@ -0,0 +1,120 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <stdlib.h>
+#include <vector>
+
+#include "csi_fft.hpp"
+
+namespace csirdr {
+
+#ifdef HAVE_FFTW3F
+
+Csi_fft::Csi_fft(int n) {
+  this->n = n;
+  this->buf = fftwf_alloc_complex(n);
+  this->plan = fftwf_plan_dft_1d(n, this->buf, this->buf, FFTW_FORWARD,
+                                 FFTW_MEASURE);
+}
+
+Csi_fft::~Csi_fft() {
+  fftwf_destroy_plan(this->plan);
+  fftwf_free(this->buf);
+}
+
+void Csi_fft::forward(std::complex<float> *data) {
+  // 計画の配列の整列に合わせるため作業領域を経由する
+  auto *buf = reinterpret_cast<std::complex<float> *>(this->buf);
+  std::copy(data, data + this->n, buf);
+  fftwf_execute(this->plan);
+  std::copy(buf, buf + this->n, data);
+}
+
+#else
+
+Csi_fft::Csi_fft(int n) {
+  this->n = n;
+  int bits = 0;
+  while ((1 << bits) < n) {
+    bits++;
+  }
+  this->bitrev.resize(n);
+  for (int i = 0; i < n; i++) {
+    int r = 0;
+    for (int b = 0; b < bits; b++) {
+      r |= ((i >> b) & 1) << (bits - 1 - b);
+    }
+    this->bitrev[i] = r;
+  }
+  this->twiddle.resize(std::max(n / 2, 1));
+  for (int k = 0; k < n / 2; k++) {
+    double w = -2 * M_PI * k / n;
+    this->twiddle[k] = std::complex<float>(std::cos(w), std::sin(w));
+  }
+}
+
+Csi_fft::~Csi_fft() {}
+
+void Csi_fft::forward(std::complex<float> *data) {
+  int n = this->n;
+  for (int i = 0; i < n; i++) {
+    int r = this->bitrev[i];
+    if (i < r) {
+      std::swap(data[i], data[r]);
+    }
+  }
+
+  // 時間間引きのバタフライ
+  // 複素数の積はstd::complexの演算子だとNaN・無限大の処理の関数呼び出しに
+  // なるので成分で計算する
+  float *d = reinterpret_cast<float *>(data);
+  const float *tw = reinterpret_cast<const float *>(this->twiddle.data());
+  for (int half = 1; half < n; half *= 2) {
+    int stride = n / (2 * half);
+    for (int start = 0; start < n; start += 2 * half) {
+      float *a = d + 2 * start;
+      float *b = a + 2 * half;
+      for (int k = 0; k < half; k++) {
+        float wr = tw[2 * k * stride], wi = tw[2 * k * stride + 1];
+        float br = b[2 * k] * wr - b[2 * k + 1] * wi;
+        float bi = b[2 * k] * wi + b[2 * k + 1] * wr;
+        float ar = a[2 * k], ai = a[2 * k + 1];
+        a[2 * k] = ar + br;
+        a[2 * k + 1] = ai + bi;
+        b[2 * k] = ar - br;
+        b[2 * k + 1] = ai - bi;
+      }
+    }
+  }
+}
+
+#endif
+
+} // namespace csirdr
@@ -0,0 +1,81 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <complex>
+#include <stdlib.h>
+#include <vector>
+
+#ifdef HAVE_FFTW3F
+#include <fftw3.h>
+#endif
+
+#ifndef CSI_FFT
+#define CSI_FFT
+
+namespace csirdr {
+
+/*
+ * 長さnの複素FFT（順方向，正規化なし）
+ * FFTW（単精度）があればそれを使い，なければ組み込みの基数2のFFT
+ * nは2のべき乗に限る
+ * 計画（FFTW）や回転因子・ビット反転表の計算はコンストラクタで行う
+ * FFTWの計画はスレッド安全でないので，構築は1つのスレッドで行うこと
+ */
+class Csi_fft {
+private:
+  int n;
+#ifdef HAVE_FFTW3F
+  fftwf_complex *buf;
+  fftwf_plan plan;
+#else
+  std::vector<int> bitrev;                    // ビット反転した添字
+  std::vector<std::complex<float>> twiddle;   // e^{-2πik/n} (k < n/2)
+#endif
+
+public:
+  explicit Csi_fft(int n);
+  ~Csi_fft();
+  Csi_fft(const Csi_fft &) = delete;
+  Csi_fft &operator=(const Csi_fft &) = delete;
+
+  int size() const { return this->n; }
+
+  /*
+   * その場での順方向変換
+   * input/output: data (n個)
+   */
+  void forward(std::complex<float> *data);
+};
+
+/*
+ * nが2のべき乗ならtrue
+ */
+inline bool is_power_of_two(int n) { return n > 0 and (n & (n - 1)) == 0; }
+
+} // namespace csirdr
+
+#endif /* end of include guard */
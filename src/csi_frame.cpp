@@ -0,0 +1,222 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <complex>
+#include <memory>
+#include <mutex>
+#include <stdlib.h>
+#include <vector>
+
+#include "csi_frame.hpp"
+#include "csi_math.hpp"
+
+namespace csirdr {
+
+Csi_frame::Csi_frame(Csi_frame_pool *pool, int n_elements) {
+  this->pool = pool;
+  this->n_elements = n_elements;
+  this->csi.resize(n_elements * FRAME_MAX_SUB);
+  this->amplitude_cache.resize(n_elements * FRAME_MAX_SUB);
+  this->phase_cache.resize(n_elements * FRAME_MAX_SUB);
+}
+
+void Csi_frame::reset() {
+  this->n_sub = 0;
+  this->mask = 0;
+  this->has_amplitude.store(false, std::memory_order_relaxed);
+  this->has_phase.store(false, std::memory_order_relaxed);
+}
+
+const float *Csi_frame::get_amplitude(int element) const {
+  // 複数のスレッドから参照されても計算は1回
+  if (!this->has_amplitude.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(this->cache_mtx);
+    if (!this->has_amplitude.load(std::memory_order_relaxed)) {
+      for (int e = 0; e < this->n_elements; e++) {
+        csi_magnitude(this->get_csi(e),
+                      this->amplitude_cache.data() + e * FRAME_MAX_SUB,
+                      this->n_sub);
+      }
+      this->has_amplitude.store(true, std::memory_order_release);
+    }
+  }
+  return this->amplitude_cache.data() + element * FRAME_MAX_SUB;
+}
+
+const float *Csi_frame::get_phase(int element) const {
+  if (!this->has_phase.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(this->cache_mtx);
+    if (!this->has_phase.load(std::memory_order_relaxed)) {
+      for (int e = 0; e < this->n_elements; e++) {
+        csi_phase(this->get_csi(e),
+                  this->phase_cache.data() + e * FRAME_MAX_SUB, this->n_sub);
+      }
+      this->has_phase.store(true, std::memory_order_release);
+    }
+  }
+  return this->phase_cache.data() + element * FRAME_MAX_SUB;
+}
+
+Csi_frame_ref::Csi_frame_ref(Csi_frame *frame) {
+  this->frame = frame;
+  if (frame != nullptr) {
+    frame->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+Csi_frame_ref::Csi_frame_ref(const Csi_frame_ref &other)
+    : Csi_frame_ref(other.frame) {}
+
+Csi_frame_ref::Csi_frame_ref(Csi_frame_ref &&other) noexcept {
+  this->frame = other.frame;
+  other.frame = nullptr;
+}
+
+Csi_frame_ref &Csi_frame_ref::operator=(const Csi_frame_ref &other) {
+  if (this->frame != other.frame) {
+    this->release();
+    this->frame = other.frame;
+    if (this->frame != nullptr) {
+      this->frame->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  return *this;
+}
+
+Csi_frame_ref &Csi_frame_ref::operator=(Csi_frame_ref &&other) noexcept {
+  if (this != &other) {
+    this->release();
+    this->frame = other.frame;
+    other.frame = nullptr;
+  }
+  return *this;
+}
+
+void Csi_frame_ref::release() {
+  if (this->frame == nullptr) {
+    return;
+  }
+  if (this->frame->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    this->frame->pool->put(this->frame);
+  }
+  this->frame = nullptr;
+}
+
+bool Csi_frame_slot::store(const Csi_frame_ref &ref) {
+  if (!ref) {
+    return false;
+  }
+
+  // 参照をコピーしてこの場所に移し，古いフレームの参照を手放す
+  Csi_frame_ref copy = ref;
+  Csi_frame_ref old;
+  old.frame = this->frame.exchange(copy.frame, std::memory_order_acq_rel);
+  copy.frame = nullptr;
+  return (bool)old;
+}
+
+Csi_frame_ref Csi_frame_slot::take() {
+  // 格納していた参照をそのまま引き継ぐ
+  Csi_frame_ref ref;
+  ref.frame = this->frame.exchange(nullptr, std::memory_order_acq_rel);
+  return ref;
+}
+
+Csi_frame_pool::Csi_frame_pool(int n_elements, int n_frames) {
+  this->free_list.reserve(n_frames);
+  for (int i = 0; i < n_frames; i++) {
+    this->frames.push_back(std::make_unique<Csi_frame>(this, n_elements));
+    this->free_list.push_back(this->frames.back().get());
+  }
+}
+
+Csi_frame_ref Csi_frame_pool::acquire() {
+  Csi_frame *frame;
+  {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    if (this->free_list.empty()) {
+      this->n_exhausted.fetch_add(1, std::memory_order_relaxed);
+      return Csi_frame_ref();
+    }
+    frame = this->free_list.back();
+    this->free_list.pop_back();
+  }
+  frame->reset();
+  return Csi_frame_ref(frame);
+}
+
+Csi_frame_ref Csi_frame_pool::clone(const Csi_frame &src, bool keep_amplitude,
+                                    bool keep_phase) {
+  Csi_frame_ref ref = this->acquire();
+  Csi_frame *frame = ref.get_mutable();
+  if (frame == nullptr) {
+    return ref;
+  }
+
+  frame->header = src.header;
+  frame->iface = src.iface;
+  frame->seq = src.seq;
+  frame->mask = src.mask;
+  frame->timestamp_ns = src.timestamp_ns;
+  frame->n_sub = src.n_sub;
+  int n_elements = std::min(frame->n_elements, src.n_elements);
+  for (int e = 0; e < n_elements; e++) {
+    std::copy(src.get_csi(e), src.get_csi(e) + src.n_sub,
+              frame->get_csi_buffer(e));
+  }
+
+  // 計算済みの振幅・位相（フラグを見てから読むので値は確定している）
+  if (keep_amplitude and src.has_amplitude.load(std::memory_order_acquire)) {
+    for (int e = 0; e < n_elements; e++) {
+      std::copy(src.get_amplitude(e), src.get_amplitude(e) + src.n_sub,
+                frame->amplitude_cache.data() + e * FRAME_MAX_SUB);
+    }
+    frame->has_amplitude.store(true, std::memory_order_release);
+  }
+  if (keep_phase and src.has_phase.load(std::memory_order_acquire)) {
+    for (int e = 0; e < n_elements; e++) {
+      std::copy(src.get_phase(e), src.get_phase(e) + src.n_sub,
+                frame->get_phase_buffer(e));
+    }
+    frame->set_phase_ready();
+  }
+  return ref;
+}
+
+void Csi_frame_pool::put(Csi_frame *frame) {
+  std::lock_guard<std::mutex> lock(this->mtx);
+  this->free_list.push_back(frame);
+}
+
+int Csi_frame_pool::get_n_free() {
+  std::lock_guard<std::mutex> lock(this->mtx);
+  return (int)this->free_list.size();
+}
+
+} // namespace csirdr
@@ -0,0 +1,246 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <atomic>
+#include <complex>
+#include <memory>
+#include <mutex>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+#include "csi_reader_func.hpp"
+
+#ifndef CSI_FRAME
+#define CSI_FRAME
+
+#define FRAME_MAX_SUB 256    // 1要素のサブキャリア数の上限
+#define FRAME_POOL_SIZE 256  // プールのフレーム数
+
+namespace csirdr {
+
+class Csi_frame_pool;
+
+/*
+ * 全コア・ストリームのCSIをまとめた1フレーム
+ * CSIは要素（stream * n_rx + core）ごとにFRAME_MAX_SUB個ずつ連続に並ぶ
+ * 振幅と位相は最初に参照されたときに計算してフレームに保存する
+ * プールから取得し，参照がなくなるとプールに戻る
+ */
+class Csi_frame {
+  friend class Csi_frame_pool;
+  friend class Csi_frame_ref;
+
+private:
+  Csi_frame_pool *pool;
+  std::atomic<int> refs{0};
+
+  int n_elements;
+  int n_sub = 0;
+  std::vector<std::complex<float>> csi;
+
+  // 振幅と位相のキャッシュ
+  mutable std::mutex cache_mtx;
+  mutable std::atomic<bool> has_amplitude{false};
+  mutable std::atomic<bool> has_phase{false};
+  mutable std::vector<float> amplitude_cache;
+  mutable std::vector<float> phase_cache;
+
+public:
+  csi_header header;  // 最後に受信したパケットのヘッダ
+  int iface = 0;      // 受信したインターフェイスの番号
+  uint16_t seq = 0;   // シーケンス番号
+  uint64_t mask = 0;  // 受信済みの要素
+  int64_t timestamp_ns = 0; // 最初のパケットの受信時刻（UNIX時間のナノ秒）
+
+  Csi_frame(Csi_frame_pool *pool, int n_elements);
+
+  /*
+   * 新しいフレームとして使うための初期化
+   */
+  void reset();
+
+  /*
+   * 要素のCSIの書き込み先（デコード用）
+   */
+  std::complex<float> *get_csi_buffer(int element) {
+    return this->csi.data() + element * FRAME_MAX_SUB;
+  }
+
+  /*
+   * 要素のCSIの書き込み完了
+   */
+  void set_element(int element, int n_sub) {
+    this->n_sub = n_sub;
+    this->mask |= 1ULL << element;
+  }
+
+  bool is_complete() const {
+    return this->mask ==
+           ((this->n_elements >= 64) ? ~0ULL
+                                     : (1ULL << this->n_elements) - 1);
+  }
+
+  int get_n_elements() const { return this->n_elements; }
+  int get_n_sub() const { return this->n_sub; }
+
+  /*
+   * 要素ごとのCSI（n_sub個）
+   */
+  const std::complex<float> *get_csi(int element) const {
+    return this->csi.data() + element * FRAME_MAX_SUB;
+  }
+
+  /*
+   * 要素ごとの振幅と位相（n_sub個，最初の呼び出しで計算）
+   */
+  const float *get_amplitude(int element) const;
+  const float *get_phase(int element) const;
+
+  /*
+   * 位相の書き込み先（変換用，CSIから計算する代わりに設定する）
+   * 全要素を書き込んだらset_phase_ready()を呼ぶ
+   */
+  float *get_phase_buffer(int element) {
+    return this->phase_cache.data() + element * FRAME_MAX_SUB;
+  }
+  void set_phase_ready() {
+    this->has_phase.store(true, std::memory_order_release);
+  }
+
+  /*
+   * 送信元MACアドレスの末尾2バイト
+   */
+  uint16_t get_mac_tail() const {
+    return (uint16_t)(this->header.tx_mac_add & 0xFFFF);
+  }
+};
+
+/*
+ * プールのフレームへの参照
+ * コピーで参照を共有し，最後の参照が破棄されるとフレームをプールに戻す
+ * アプリケーションは参照を保持している間だけフレームを読める
+ */
+class Csi_frame_ref {
+  friend class Csi_frame_slot;
+
+private:
+  Csi_frame *frame = nullptr;
+
+public:
+  Csi_frame_ref() {}
+  explicit Csi_frame_ref(Csi_frame *frame);
+  Csi_frame_ref(const Csi_frame_ref &other);
+  Csi_frame_ref(Csi_frame_ref &&other) noexcept;
+  Csi_frame_ref &operator=(const Csi_frame_ref &other);
+  Csi_frame_ref &operator=(Csi_frame_ref &&other) noexcept;
+  ~Csi_frame_ref() { this->release(); }
+
+  /*
+   * 参照の破棄
+   */
+  void release();
+
+  const Csi_frame *operator->() const { return this->frame; }
+  const Csi_frame &operator*() const { return *this->frame; }
+  explicit operator bool() const { return this->frame != nullptr; }
+
+  /*
+   * 書き込み用（フレームの組み立てのみ）
+   */
+  Csi_frame *get_mutable() { return this->frame; }
+};
+
+/*
+ * 最新のフレームを1つだけ保持する受け渡し場所（ロックフリー）
+ * 書き込み側は読まれていないフレームを置き換え，読み出し側は取り出す
+ * 保持しているフレームの参照はこの場所が持つ
+ */
+class Csi_frame_slot {
+private:
+  std::atomic<Csi_frame *> frame{nullptr};
+
+public:
+  ~Csi_frame_slot() { this->take(); }
+
+  /*
+   * フレームの格納（任意のスレッドから呼び出してよい）
+   * return: 読まれていないフレームを置き換えて手放したらtrue
+   */
+  bool store(const Csi_frame_ref &ref);
+
+  /*
+   * フレームの取り出し，新しいフレームがなければ空の参照
+   */
+  Csi_frame_ref take();
+};
+
+/*
+ * フレームのプール
+ * フレームはコンストラクタで確保し，以降はメモリ確保を行わない
+ * 取得は処理スレッドのみ，返却は任意のスレッドから行ってよい
+ */
+class Csi_frame_pool {
+  friend class Csi_frame_ref;
+
+private:
+  std::vector<std::unique_ptr<Csi_frame>> frames;
+
+  std::mutex mtx;
+  std::vector<Csi_frame *> free_list; // 容量はフレーム数で確保済み
+  std::atomic<uint64_t> n_exhausted{0}; // 空で取得できなかった回数
+
+  // 参照がなくなったフレームの返却
+  void put(Csi_frame *frame);
+
+public:
+  Csi_frame_pool(int n_elements, int n_frames = FRAME_POOL_SIZE);
+
+  /*
+   * フレームの取得，空なら空の参照を返す
+   */
+  Csi_frame_ref acquire();
+
+  /*
+   * フレームの複製（変換の段で使う）
+   * ヘッダなどとCSIをコピーする
+   * 振幅・位相は変換で変わらないものだけ計算済みならコピーする
+   * 空なら空の参照を返す
+   */
+  Csi_frame_ref clone(const Csi_frame &src, bool keep_amplitude = false,
+                      bool keep_phase = false);
+
+  int capacity() { return (int)this->frames.size(); }
+  int get_n_free();
+  uint64_t get_n_exhausted() {
+    return this->n_exhausted.load(std::memory_order_relaxed);
+  }
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
@@ -0,0 +1,517 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "csi_frame.hpp"
+#include "csi_graph.hpp"
+#include "csi_reader_func.hpp"
+#include "csi_stages.hpp"
+#include "csi_stats.hpp"
+
+namespace csirdr {
+
+// キューの待ち時間の計測用の時計
+static int64_t steady_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+bool parse_int(const std::string &str, int &value) {
+  if (str.empty() or std::isspace((unsigned char)str[0])) {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  long v = std::strtol(str.c_str(), &end, 10);
+  if (*end != '\0' or errno == ERANGE or v < INT_MIN or v > INT_MAX) {
+    return false;
+  }
+  value = (int)v;
+  return true;
+}
+
+bool parse_float(const std::string &str, float &value) {
+  double v;
+  if (!parse_double(str, v)) {
+    return false;
+  }
+  value = (float)v;
+  return true;
+}
+
+bool parse_double(const std::string &str, double &value) {
+  if (str.empty() or std::isspace((unsigned char)str[0])) {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  double v = std::strtod(str.c_str(), &end);
+  if (*end != '\0' or errno == ERANGE or !std::isfinite(v)) {
+    return false;
+  }
+  value = v;
+  return true;
+}
+
+bool parse_overload_policy(const std::string &name, overload_policy &policy) {
+  if (name == "drop-newest") {
+    policy = OVERLOAD_DROP_NEWEST;
+  } else if (name == "drop-oldest") {
+    policy = OVERLOAD_DROP_OLDEST;
+  } else if (name == "block") {
+    policy = OVERLOAD_BLOCK;
+  } else if (name == "adaptive") {
+    policy = OVERLOAD_ADAPTIVE;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::string get_overload_policy_name(overload_policy policy) {
+  switch (policy) {
+  case OVERLOAD_DROP_OLDEST:
+    return "drop-oldest";
+  case OVERLOAD_BLOCK:
+    return "block";
+  case OVERLOAD_ADAPTIVE:
+    return "adaptive";
+  default:
+    return "drop-newest";
+  }
+}
+
+bool Frame_queue::push(const Csi_frame_ref &frame, overload_policy policy,
+                       int block_timeout_ms, bool &evicted, bool &waited) {
+  evicted = false;
+  waited = false;
+  Csi_frame_ref old; // 破棄するフレームはロックの外で手放す
+  {
+    std::unique_lock<std::mutex> lock(this->mtx);
+    if (this->count == this->buf.size()) {
+      if (policy == OVERLOAD_DROP_OLDEST) {
+        old = std::move(this->buf[this->head].frame);
+        this->head = (this->head + 1) % this->buf.size();
+        this->count--;
+        evicted = true;
+      } else if (policy == OVERLOAD_BLOCK) {
+        waited = true;
+        this->cv_not_full.wait_for(
+            lock, std::chrono::milliseconds(block_timeout_ms),
+            [this] { return this->count < this->buf.size(); });
+        if (this->count == this->buf.size()) {
+          return false;
+        }
+      } else {
+        return false;
+      }
+    }
+
+    entry &e = this->buf[(this->head + this->count) % this->buf.size()];
+    e.frame = frame;
+    e.t_enqueue = steady_ns();
+    this->count++;
+    this->high_water = std::max(this->high_water, this->count);
+  }
+  return true;
+}
+
+bool Frame_queue::pop(Csi_frame_ref &frame, int64_t &wait_ns) {
+  std::lock_guard<std::mutex> lock(this->mtx);
+  if (this->count == 0) {
+    return false;
+  }
+  entry &e = this->buf[this->head];
+  frame = std::move(e.frame);
+  wait_ns = steady_ns() - e.t_enqueue;
+  this->head = (this->head + 1) % this->buf.size();
+  this->count--;
+  this->cv_not_full.notify_one();
+  return true;
+}
+
+size_t Frame_queue::size() {
+  std::lock_guard<std::mutex> lock(this->mtx);
+  return this->count;
+}
+
+size_t Frame_queue::get_high_water() {
+  std::lock_guard<std::mutex> lock(this->mtx);
+  return this->high_water;
+}
+
+Csi_graph::Csi_graph(int n_workers) {
+  this->n_workers = n_workers;
+  register_builtin_stages(*this);
+}
+
+Csi_graph::~Csi_graph() {
+  this->stop();
+
+  // 変換の段はフレームのプールを持つので，後段（キューや段が保持する
+  // フレーム）から先に破棄する
+  while (!this->nodes.empty()) {
+    this->nodes.pop_back();
+  }
+}
+
+void Csi_graph::register_stage(std::string name, stage_factory factory) {
+  this->factories[name] = factory;
+}
+
+int Csi_graph::add_stage(std::unique_ptr<Csi_stage> stage, int parent,
+                         int queue_size) {
+  int idx = (int)this->nodes.size();
+  if (parent >= idx) {
+    std::cerr << "Invalid parent stage: " << parent << std::endl;
+    parent = -1;
+  }
+  this->nodes.push_back(
+      std::make_unique<node>(std::move(stage), parent, queue_size));
+  if (parent < 0) {
+    this->roots.push_back(idx);
+  } else {
+    this->nodes[parent]->children.push_back(idx);
+  }
+  return idx;
+}
+
+bool Csi_graph::build(std::string spec) {
+  std::stringstream ss_branch(spec);
+  std::string branch;
+  while (std::getline(ss_branch, branch, ';')) {
+    int parent = -1;
+    std::stringstream ss_stage(branch);
+    std::string token;
+    while (std::getline(ss_stage, token, '>')) {
+      if (token == "") {
+        continue;
+      }
+
+      // "name:arg" の分割
+      std::string name = token, arg = "";
+      size_t pos = token.find(':');
+      if (pos != std::string::npos) {
+        name = token.substr(0, pos);
+        arg = token.substr(pos + 1);
+      }
+
+      auto it = this->factories.find(name);
+      if (it == this->factories.end()) {
+        std::cerr << "Unknown stage: " << name << std::endl;
+        return false;
+      }
+      // 引数の検査漏れで例外が出ても，不正な引数として扱う
+      std::unique_ptr<Csi_stage> stage;
+      try {
+        stage = it->second(arg);
+      } catch (const std::exception &) {
+        stage.reset();
+      }
+      if (!stage) {
+        std::cerr << "Invalid stage argument: " << token << std::endl;
+        return false;
+      }
+      parent = this->add_stage(std::move(stage), parent);
+    }
+  }
+  return true;
+}
+
+bool Csi_graph::set_overload_policy(std::string policy, int max_latency_ms) {
+  if (!parse_overload_policy(policy, this->policy)) {
+    std::cerr << "Unknown overload policy: " << policy << std::endl;
+    return false;
+  }
+  this->max_latency_ns = (int64_t)max_latency_ms * 1000000;
+  return true;
+}
+
+void Csi_graph::start() {
+  std::lock_guard<std::mutex> lock(this->mtx);
+  this->running = true;
+  for (int i = 0; i < this->n_workers; i++) {
+    this->workers.push_back(std::thread(&Csi_graph::worker_loop, this, i));
+  }
+}
+
+void Csi_graph::push(const Csi_frame_ref &frame) {
+  for (int idx : this->roots) {
+    if (this->n_workers == 0) {
+      // インライン実行
+      Csi_frame_ref f = frame;
+      this->run_stage(idx, f);
+    } else {
+      this->enqueue(idx, frame);
+    }
+  }
+}
+
+void Csi_graph::enqueue(int idx, const Csi_frame_ref &frame) {
+  node &n = *this->nodes[idx];
+
+  // adaptive: 間引きの割合に従って一様に間引く
+  if (this->policy == OVERLOAD_ADAPTIVE) {
+    int d = n.decimation.load(std::memory_order_relaxed);
+    uint64_t k = n.n_offered.fetch_add(1, std::memory_order_relaxed);
+    if (d > 1 and k % d != 0) {
+      n.n_decimated.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+  }
+
+  // 取り出したワーカーが先に減らしても0を下回らないように先に数える
+  this->pending.fetch_add(1, std::memory_order_relaxed);
+  bool evicted, waited;
+  bool pushed = n.queue.push(frame, this->policy, GRAPH_BLOCK_TIMEOUT_MS,
+                             evicted, waited);
+  if (waited) {
+    n.n_blocked.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (evicted) {
+    n.n_evicted.fetch_add(1, std::memory_order_relaxed);
+    this->release_pending();
+  }
+  if (!pushed) {
+    n.n_dropped.fetch_add(1, std::memory_order_relaxed);
+    this->release_pending();
+    return;
+  }
+  this->schedule(idx);
+}
+
+void Csi_graph::release_pending() {
+  if (this->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    this->cv_idle.notify_all();
+  }
+}
+
+void Csi_graph::adapt(node &n, int64_t wait_ns) {
+  n.total_wait_ns.fetch_add(wait_ns, std::memory_order_relaxed);
+  if (wait_ns > n.max_wait_ns.load(std::memory_order_relaxed)) {
+    n.max_wait_ns.store(wait_ns, std::memory_order_relaxed);
+  }
+  if (this->policy != OVERLOAD_ADAPTIVE) {
+    return;
+  }
+
+  // 待ち時間の移動平均（1/8）
+  n.wait_avg_ns += (wait_ns - n.wait_avg_ns) / 8;
+
+  // 目標の1/4ごとに見直す（遅い段でも見直しの間隔が延びないよう時間で区切る）
+  int64_t now = steady_ns();
+  if (now - n.t_adapt_ns < this->max_latency_ns / 4) {
+    return;
+  }
+  n.t_adapt_ns = now;
+
+  // 目標を超えて待ち時間が減っていなければ間引きを1.5倍に，
+  // 十分下回ったら1段ずつ戻す
+  // （間引きの効果は待ち時間に遅れて現れるので，減っている間は様子を見る）
+  int d = n.decimation.load(std::memory_order_relaxed);
+  if (n.wait_avg_ns > this->max_latency_ns and
+      n.wait_avg_ns >= n.wait_prev_ns) {
+    d = std::min(d + d / 2 + 1, GRAPH_MAX_DECIMATION);
+  } else if (n.wait_avg_ns < this->max_latency_ns / 2 and d > 1) {
+    d--;
+  }
+  n.wait_prev_ns = n.wait_avg_ns;
+  n.decimation.store(d, std::memory_order_relaxed);
+}
+
+void Csi_graph::schedule(int idx) {
+  // 実行待ちまたは実行中なら登録しない（1つの段は1スレッドで実行）
+  if (this->nodes[idx]->scheduled.exchange(true, std::memory_order_acq_rel)) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    this->ready.push_back(idx);
+  }
+  this->cv.notify_one();
+}
+
+void Csi_graph::run_stage(int idx, Csi_frame_ref &frame) {
+  node &n = *this->nodes[idx];
+  n.n_in.store(n.n_in.load(std::memory_order_relaxed) + 1,
+               std::memory_order_relaxed);
+
+  // 受信からの遅延（最後の段のみ）
+  if (this->latency_stats and stats_enabled and n.children.empty()) {
+    int64_t latency_ns = realtime_ns() - frame->timestamp_ns;
+    stats_record(STAGE_RECEIVE_TO_APP, latency_ns > 0 ? latency_ns : 0);
+  }
+
+  bool pass;
+  {
+    Stage_timer timer(STAGE_GRAPH_NODE);
+    pass = n.stage->process(frame);
+  }
+  if (!pass or !frame) {
+    return;
+  }
+  n.n_out.store(n.n_out.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+
+  // 後段には同じフレームの参照を渡す
+  for (int child : n.children) {
+    if (this->n_workers == 0) {
+      Csi_frame_ref f = frame;
+      this->run_stage(child, f);
+    } else {
+      this->enqueue(child, frame);
+    }
+  }
+}
+
+void Csi_graph::worker_loop(int id) {
+  if (stats_enabled) {
+    Csi_stats::set_thread_name("graph " + std::to_string(id));
+  }
+
+  while (true) {
+    int idx;
+    {
+      std::unique_lock<std::mutex> lock(this->mtx);
+      this->cv.wait(lock,
+                    [this] { return !this->ready.empty() or !this->running; });
+      if (this->ready.empty()) {
+        break;
+      }
+      idx = this->ready.front();
+      this->ready.pop_front();
+    }
+
+    // 段のキューからまとめて処理
+    node &n = *this->nodes[idx];
+    Csi_frame_ref frame;
+    int64_t wait_ns;
+    int k = 0;
+    while (k < GRAPH_BATCH_SIZE and n.queue.pop(frame, wait_ns)) {
+      this->adapt(n, wait_ns);
+      this->run_stage(idx, frame);
+      frame.release();
+      k++;
+      this->release_pending();
+    }
+
+    // 残っていれば再登録
+    n.scheduled.store(false, std::memory_order_release);
+    if (n.queue.size() > 0) {
+      this->schedule(idx);
+    }
+  }
+}
+
+void Csi_graph::stop() {
+  if (this->stopped) {
+    return;
+  }
+  this->stopped = true;
+
+  // キューが空になるのを待ってから停止
+  if (this->n_workers > 0) {
+    std::unique_lock<std::mutex> lock(this->mtx);
+    if (this->running) {
+      this->cv_idle.wait(lock, [this] {
+        return this->pending.load(std::memory_order_acquire) == 0;
+      });
+    }
+    this->running = false;
+  }
+  this->cv.notify_all();
+  for (auto &th : this->workers) {
+    th.join();
+  }
+  this->workers.clear();
+
+  // 前段から順に入力の終了を通知
+  for (auto &n : this->nodes) {
+    n->stage->flush();
+  }
+}
+
+void Csi_graph::print_summary(std::ostream &os) {
+  os << "Graph (" << this->n_workers << " workers, overload policy "
+     << get_overload_policy_name(this->policy) << "):" << std::endl;
+  for (int i = 0; i < (int)this->nodes.size(); i++) {
+    node &n = *this->nodes[i];
+    os << "   [" << i << "] " << n.stage->get_name() << " <- ";
+    if (n.parent < 0) {
+      os << "input";
+    } else {
+      os << "[" << n.parent << "]";
+    }
+    os << ": in " << n.n_in.load(std::memory_order_relaxed) << ", out "
+       << n.n_out.load(std::memory_order_relaxed) << ", dropped "
+       << n.n_dropped.load(std::memory_order_relaxed) << ", queue high water "
+       << n.queue.get_high_water() << "/" << n.queue.capacity()
+       << ", wait avg ";
+    uint64_t n_in = n.n_in.load(std::memory_order_relaxed);
+    os << (n_in > 0 ? n.total_wait_ns.load(std::memory_order_relaxed) / n_in /
+                          1000
+                    : 0)
+       << " us, max " << n.max_wait_ns.load(std::memory_order_relaxed) / 1000
+       << " us";
+    switch (this->policy) {
+    case OVERLOAD_DROP_OLDEST:
+      os << ", evicted " << n.n_evicted.load(std::memory_order_relaxed);
+      break;
+    case OVERLOAD_BLOCK:
+      os << ", blocked " << n.n_blocked.load(std::memory_order_relaxed);
+      break;
+    case OVERLOAD_ADAPTIVE:
+      os << ", decimated " << n.n_decimated.load(std::memory_order_relaxed)
+         << " (now 1/" << n.decimation.load(std::memory_order_relaxed) << ")";
+      break;
+    default:
+      break;
+    }
+    os << std::endl;
+  }
+}
+
+} // namespace csirdr
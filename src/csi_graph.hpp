@@ -0,0 +1,299 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "csi_frame.hpp"
+
+#ifndef CSI_GRAPH
+#define CSI_GRAPH
+
+#define GRAPH_WORKERS 2     // ワーカースレッド数（0ならインライン実行）
+#define GRAPH_QUEUE_SIZE 64 // 段ごとの入力キューの要素数
+#define GRAPH_BATCH_SIZE 16 // ワーカーが1つの段を続けて処理するフレーム数
+#define GRAPH_MAX_LATENCY_MS 100  // adaptiveで目標とするキューの待ち時間
+#define GRAPH_BLOCK_TIMEOUT_MS 100 // blockで待つ時間の上限（超えたら破棄）
+#define GRAPH_MAX_DECIMATION 64   // adaptiveの間引きの最大（1/n）
+
+namespace csirdr {
+
+/*
+ * 段のキューが処理に追いつかないときの方針
+ */
+enum overload_policy {
+  OVERLOAD_DROP_NEWEST = 0, // 満杯なら追加するフレームを破棄（既定）
+  OVERLOAD_DROP_OLDEST,     // 満杯なら最も古いフレームを破棄して追加
+  OVERLOAD_BLOCK,           // 空くまで入力側を待たせる（上限を超えたら破棄）
+  OVERLOAD_ADAPTIVE,        // 待ち時間が目標を超えないよう一様に間引く
+};
+
+/*
+ * 方針の名前（"drop-newest", "drop-oldest", "block", "adaptive"）の変換
+ * return: 未知の名前ならfalse
+ */
+bool parse_overload_policy(const std::string &name, overload_policy &policy);
+std::string get_overload_policy_name(overload_policy policy);
+
+/*
+ * 段の入力キュー（有界）
+ * 最も古いフレームを入力側から破棄できるように，排他制御付きの
+ * 固定長のリングバッファにする（要素はコンストラクタで確保）
+ * フレームごとに追加した時刻を保存し，待ち時間を計測する
+ */
+class Frame_queue {
+private:
+  struct entry {
+    Csi_frame_ref frame;
+    int64_t t_enqueue = 0; // steady_clockのナノ秒
+  };
+
+  std::vector<entry> buf;
+  size_t head = 0;  // 最も古い要素の位置
+  size_t count = 0; // 要素数
+  size_t high_water = 0;
+
+  std::mutex mtx;
+  std::condition_variable cv_not_full;
+
+public:
+  explicit Frame_queue(size_t capacity) : buf(capacity) {}
+
+  /*
+   * フレームの追加
+   * input: frame, policy, block_timeout_ms (OVERLOAD_BLOCKのみ)
+   * output: evicted (最も古いフレームを破棄した)
+   *         waited (空くのを待った)
+   * return: 追加できなければfalse
+   */
+  bool push(const Csi_frame_ref &frame, overload_policy policy,
+            int block_timeout_ms, bool &evicted, bool &waited);
+
+  /*
+   * 先頭のフレームの取り出し
+   * output: frame, wait_ns (キューでの待ち時間)
+   * return: 空ならfalse
+   */
+  bool pop(Csi_frame_ref &frame, int64_t &wait_ns);
+
+  size_t size();
+  size_t capacity() const { return this->buf.size(); }
+  size_t get_high_water();
+};
+
+/*
+ * 処理グラフの段
+ * フィルタ，変換，検出器，出力（シンク）はすべてこのクラスを継承する
+ * 1つの段が同時に複数のスレッドで実行されることはない
+ */
+class Csi_stage {
+public:
+  virtual ~Csi_stage() {}
+
+  /*
+   * 段の名前（集計の表示用）
+   */
+  virtual std::string get_name() = 0;
+
+  /*
+   * フレームの処理
+   * falseを返すと後段に渡さない（フィルタ）
+   * 入力のフレームは他の段と共有しているので書き換えない
+   * 変換はframeを新しく取得したフレームに置き換える
+   */
+  virtual bool process(Csi_frame_ref &frame) = 0;
+
+  /*
+   * 入力の終了（グラフの停止時に前段から順に呼び出す）
+   */
+  virtual void flush() {}
+};
+
+/*
+ * 段の引数などの数値の変換
+ * 文字列全体が数値として読めなければfalse（例外は投げない）
+ */
+bool parse_int(const std::string &str, int &value);
+bool parse_float(const std::string &str, float &value);
+bool parse_double(const std::string &str, double &value);
+
+/*
+ * 段を文字列の引数から生成する関数（"name:arg" の arg を受け取る）
+ * 引数が不正なら空のポインタを返す
+ */
+typedef std::function<std::unique_ptr<Csi_stage>(std::string)> stage_factory;
+
+/*
+ * 処理グラフ
+ * 段を木構造につなぎ，1つのフレームを複数の後段に参照で渡す（デコードは1回）
+ * 段ごとに有界のキュー（Frame_queue）を持ち，ワーカープールが実行する
+ * ワーカー数が0なら，push()を呼んだスレッドで順に実行する（インライン）
+ */
+class Csi_graph {
+private:
+  // グラフの節点
+  struct node {
+    std::unique_ptr<Csi_stage> stage;
+    int parent; // 前段の番号（負なら入力）
+    std::vector<int> children;
+    Frame_queue queue;
+    std::atomic<bool> scheduled{false}; // 実行待ちまたは実行中
+
+    // adaptiveの間引き（decimation個に1個を残す）
+    std::atomic<int> decimation{1};
+    std::atomic<uint64_t> n_offered{0}; // 間引きの判定をしたフレーム数
+    int64_t wait_avg_ns = 0;            // 待ち時間の移動平均（実行中の段のみ）
+    int64_t wait_prev_ns = 0;           // 前回の見直し時の移動平均
+    int64_t t_adapt_ns = 0;             // 前回の見直しの時刻
+
+    // 集計
+    std::atomic<uint64_t> n_in{0};
+    std::atomic<uint64_t> n_out{0};
+    std::atomic<uint64_t> n_dropped{0};   // キューが満杯で破棄した数
+    std::atomic<uint64_t> n_evicted{0};   // drop-oldestで破棄した数
+    std::atomic<uint64_t> n_decimated{0}; // adaptiveで間引いた数
+    std::atomic<uint64_t> n_blocked{0};   // blockで入力側を待たせた回数
+    std::atomic<int64_t> total_wait_ns{0}; // キューでの待ち時間の合計
+    std::atomic<int64_t> max_wait_ns{0};   // キューでの待ち時間の最大
+
+    node(std::unique_ptr<Csi_stage> stage, int parent, int queue_size)
+        : stage(std::move(stage)), parent(parent), queue(queue_size) {}
+  };
+
+  int n_workers;
+  std::vector<std::unique_ptr<node>> nodes;
+  std::vector<int> roots; // 入力を直接受け取る段
+
+  std::unordered_map<std::string, stage_factory> factories;
+
+  // ワーカープール
+  std::vector<std::thread> workers;
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::condition_variable cv_idle;
+  std::deque<int> ready; // 実行待ちの段（要素数は段の数以下）
+  bool running = false;
+  bool stopped = false;
+  bool latency_stats = false; // 受信から最後の段までの遅延の計測
+  std::atomic<uint64_t> pending{0}; // キューにあるか処理中のフレーム数
+
+  // 過負荷時の方針
+  overload_policy policy = OVERLOAD_DROP_NEWEST;
+  int64_t max_latency_ns = (int64_t)GRAPH_MAX_LATENCY_MS * 1000000;
+
+  void worker_loop(int id);
+
+  // 処理中のフレーム数を減らし，0になったらstop()に通知
+  void release_pending();
+
+  // adaptiveの間引きの見直し（段を実行するワーカーが呼び出す）
+  void adapt(node &n, int64_t wait_ns);
+
+  // 段のキューへの追加と実行待ちへの登録
+  void enqueue(int idx, const Csi_frame_ref &frame);
+  void schedule(int idx);
+
+  // 1つのフレームを段で処理して後段に渡す
+  void run_stage(int idx, Csi_frame_ref &frame);
+
+public:
+  Csi_graph(int n_workers = GRAPH_WORKERS);
+  ~Csi_graph();
+
+  /*
+   * 段の生成関数の登録
+   * 組み込みの段（csi_stages.hpp）はコンストラクタで登録する
+   */
+  void register_stage(std::string name, stage_factory factory);
+
+  /*
+   * 段の追加
+   * input: stage, parent (前段の番号，負なら入力に直接つなぐ)
+   * return: 段の番号
+   */
+  int add_stage(std::unique_ptr<Csi_stage> stage, int parent = -1,
+                int queue_size = GRAPH_QUEUE_SIZE);
+
+  /*
+   * 文字列からグラフを構築
+   * ">"で段を直列に，";"で入力からの分岐を区切る
+   * 例: "mac:1234>skip:2>plot;beacon>stats"
+   * return: 未知の段があればfalse
+   */
+  bool build(std::string spec);
+
+  /*
+   * 受信から最後の段（後段のない段）の処理開始までの遅延を計測する
+   * フレームの受信時刻が現在の時計と比較できるライブキャプチャで使う
+   */
+  void set_latency_stats(bool on) { this->latency_stats = on; }
+
+  /*
+   * 段のキューが追いつかないときの方針の設定（start()の前に呼び出す）
+   * input: policy ("drop-newest", "drop-oldest", "block", "adaptive")
+   *        max_latency_ms (adaptiveで目標とするキューの待ち時間)
+   * return: 未知の方針ならfalse
+   */
+  bool set_overload_policy(std::string policy,
+                           int max_latency_ms = GRAPH_MAX_LATENCY_MS);
+
+  /*
+   * ワーカーの開始
+   */
+  void start();
+
+  /*
+   * フレームの入力（処理スレッドから呼び出す）
+   */
+  void push(const Csi_frame_ref &frame);
+
+  /*
+   * キューを空にしてからワーカーを停止し，段をflush()する
+   */
+  void stop();
+
+  /*
+   * 段ごとの集計を出力
+   */
+  void print_summary(std::ostream &os);
+
+  int get_n_stages() { return (int)this->nodes.size(); }
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
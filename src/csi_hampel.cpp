@@ -0,0 +1,165 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "csi_frame.hpp"
+#include "csi_hampel.hpp"
+
+namespace csirdr {
+
+Hampel_filter::Hampel_filter(int window, float threshold) {
+  this->window = std::max(window, 3);
+  this->threshold = threshold;
+}
+
+void Hampel_filter::reset(hampel_state &st, int n_elements, int n_sub) {
+  st.n_elements = n_elements;
+  st.n_sub = n_sub;
+  st.count = 0;
+  st.head = 0;
+  size_t size = (size_t)n_elements * FRAME_MAX_SUB * this->window;
+  st.history.assign(size, 0);
+  st.sorted.assign(size, 0);
+}
+
+void Hampel_filter::update(hampel_state &st, int ch, float value,
+                           float &median, float &mad) {
+  float *ring = st.history.data() + (size_t)ch * this->window;
+  float *s = st.sorted.data() + (size_t)ch * this->window;
+
+  // 最も古い値の削除
+  int n = st.count;
+  if (n == this->window) {
+    float old = ring[st.head];
+    int pos = std::lower_bound(s, s + n, old) - s;
+    std::memmove(s + pos, s + pos + 1, (n - pos - 1) * sizeof(float));
+    n--;
+  }
+
+  // 新しい値の挿入
+  int pos = std::upper_bound(s, s + n, value) - s;
+  std::memmove(s + pos + 1, s + pos, (n - pos) * sizeof(float));
+  s[pos] = value;
+  n++;
+  ring[st.head] = value;
+
+  // 中央値
+  int mid = n / 2;
+  median = (n % 2 == 1) ? s[mid] : 0.5f * (s[mid - 1] + s[mid]);
+
+  // MAD: 中央値からの偏差は，中央値の左側を右から，右側を左から読むと
+  // それぞれ昇順なので，2つを併合して小さい順に中央の位置まで数える
+  int l = mid - 1, r = mid;
+  if (n % 2 == 1) {
+    l = mid;
+    r = mid + 1;
+  }
+  float prev = 0, cur = 0;
+  for (int i = 0; i <= mid; i++) {
+    prev = cur;
+    if (r >= n or (l >= 0 and median - s[l] <= s[r] - median)) {
+      cur = median - s[l--];
+    } else {
+      cur = s[r++] - median;
+    }
+  }
+  mad = (n % 2 == 1) ? cur : 0.5f * (prev + cur);
+}
+
+bool Hampel_filter::process(Csi_frame_ref &frame) {
+  if (!this->pool) {
+    this->pool = std::make_unique<Csi_frame_pool>(frame->get_n_elements());
+  }
+  hampel_state &st = this->states.get(*frame);
+  if (frame->get_n_elements() != st.n_elements or
+      frame->get_n_sub() != st.n_sub) {
+    this->reset(st, frame->get_n_elements(), frame->get_n_sub());
+  }
+
+  // 位相は変えないので計算済みならそのまま使う
+  Csi_frame_ref out = this->pool->clone(*frame, false, true);
+  Csi_frame *dst = out.get_mutable();
+  if (dst == nullptr) {
+    this->n_exhausted++;
+    return false;
+  }
+
+  // 窓が3つ以上になるまでは判定しない
+  bool judge = st.count + 1 >= 3;
+  const float scale = 1.4826f * this->threshold; // MADを標準偏差に換算
+  int n_elements = std::min(st.n_elements, dst->get_n_elements());
+  for (int e = 0; e < n_elements; e++) {
+    const float *amplitude = frame->get_amplitude(e);
+    std::complex<float> *csi = dst->get_csi_buffer(e);
+    for (int sub = 0; sub < st.n_sub; sub++) {
+      float median, mad;
+      this->update(st, e * FRAME_MAX_SUB + sub, amplitude[sub], median, mad);
+      if (!judge or std::fabs(amplitude[sub] - median) <= scale * mad) {
+        continue;
+      }
+
+      // 振幅を中央値に置き換える
+      csi[sub] = amplitude[sub] > 0 ? csi[sub] * (median / amplitude[sub])
+                                    : std::complex<float>(median, 0);
+      this->n_replaced++;
+    }
+  }
+  this->n_samples += (uint64_t)n_elements * st.n_sub;
+  st.head = (st.head + 1) % this->window;
+  st.count = std::min(st.count + 1, this->window);
+
+  // 後段にはフィルタしたフレームを渡す
+  frame = std::move(out);
+  return true;
+}
+
+void Hampel_filter::flush() {
+  std::cout << "Hampel filter (window " << this->window << ", threshold "
+            << this->threshold << "): " << this->n_replaced << " / "
+            << this->n_samples << " values replaced, "
+            << this->states.size() << " transmitters" << std::endl;
+  if (this->states.get_n_evicted() > 0) {
+    std::cerr << "hampel: " << this->states.get_n_evicted()
+              << " transmitter windows discarded (more than " << TX_STATE_MAX
+              << " transmitters)" << std::endl;
+  }
+  if (this->n_exhausted > 0) {
+    std::cerr << "hampel: " << this->n_exhausted
+              << " frames dropped (pool exhausted)" << std::endl;
+  }
+}
+
+} // namespace csirdr
@@ -0,0 +1,108 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <memory>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "csi_frame.hpp"
+#include "csi_graph.hpp"
+#include "csi_tx_state.hpp"
+
+#ifndef CSI_HAMPEL
+#define CSI_HAMPEL
+
+#define HAMPEL_WINDOW 11      // 窓のフレーム数の既定値
+#define HAMPEL_THRESHOLD 3.0f // 外れ値とするMADの倍数の既定値
+
+namespace csirdr {
+
+/*
+ * 1つの送信機の窓
+ */
+typedef struct {
+  int n_elements = 0;
+  int n_sub = 0;
+  int count = 0; // 窓の値の数（window個まで）
+  int head = 0;  // リングで次に書き込む位置（最も古い値）
+  std::vector<float> history; // (要素 * FRAME_MAX_SUB + サブキャリア) * window
+  std::vector<float> sorted;  // 同じ並びで，各窓を昇順に保持
+} hampel_state;
+
+/*
+ * 時間方向のHampelフィルタ（振幅の外れ値の除去）
+ * 要素・サブキャリアごとに直近window個の振幅の中央値とMAD（中央値からの
+ * 絶対偏差の中央値）を求め，|x - 中央値| > threshold * 1.4826 * MAD なら
+ * 振幅を中央値に置き換える（位相は変えない）
+ * 遅延を出さないよう，窓は現在のフレームまでの直近window個とする
+ * 窓は送信機（MACアドレスと受信インターフェイス）ごとに持つ
+ *
+ * 要素・サブキャリアごとに窓の値を時間順（リング）と昇順（ソート済み配列）
+ * の2つで持ち，フレームごとに最も古い値の削除と新しい値の挿入を
+ * 二分探索とmemmoveで行う（中央値は参照のみ，MADは中央値から両側へ
+ * 走査する併合で窓の半分を読む）
+ * 段の指定: "hampel" または "hampel:window[:threshold]"
+ */
+class Hampel_filter : public Csi_stage {
+private:
+  int window;
+  float threshold;
+
+  std::unique_ptr<Csi_frame_pool> pool; // 最初のフレームの要素数で確保
+  Tx_state_map<hampel_state> states;
+
+  uint64_t n_samples = 0;  // 判定した値の数
+  uint64_t n_replaced = 0; // 置き換えた値の数
+  uint64_t n_exhausted = 0; // プールが空で破棄したフレーム数
+
+  // 窓の初期化（要素数やサブキャリア数が変わったとき）
+  void reset(hampel_state &st, int n_elements, int n_sub);
+
+  /*
+   * 1つの窓の更新
+   * input: st, ch (要素 * FRAME_MAX_SUB + サブキャリア), value
+   * output: median, mad
+   */
+  void update(hampel_state &st, int ch, float value, float &median,
+              float &mad);
+
+public:
+  Hampel_filter(int window = HAMPEL_WINDOW,
+                float threshold = HAMPEL_THRESHOLD);
+  std::string get_name() override { return "hampel"; }
+  bool process(Csi_frame_ref &frame) override;
+
+  /*
+   * 置き換えた値の割合の出力
+   */
+  void flush() override;
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
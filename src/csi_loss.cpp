@@ -0,0 +1,231 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#include "csi_loss.hpp"
+#include "csi_reader_func.hpp"
+
+namespace csirdr {
+
+// MACアドレス末尾4桁の文字列（csi_seq.csvと同じ形式）
+static std::string mac_str(uint64_t mac) {
+  std::stringstream ss;
+  ss << std::hex << std::setw(4) << std::setfill('0') << (mac & 0x0000FFFF);
+  return ss.str();
+}
+
+// 集計のキーの表示（複数インターフェイスなら番号を付ける）
+static std::string key_str(uint64_t key, bool multi_iface) {
+  if (!multi_iface) {
+    return mac_str(key);
+  }
+  return mac_str(key) + "@" + std::to_string(key >> 48);
+}
+
+Csi_loss::Csi_loss(int n_rx, int n_tx) {
+  this->n_rx = std::min(n_rx, MAX_CORE);
+  this->n_tx = std::min(n_tx, MAX_STREAM);
+
+  // 対象とするコア・ストリームのビットマスク
+  // ビット位置は stream * MAX_CORE + core
+  this->full_mask = 0;
+  for (int s = 0; s < this->n_tx; s++) {
+    for (int c = 0; c < this->n_rx; c++) {
+      this->full_mask |= 1ULL << (s * MAX_CORE + c);
+    }
+  }
+}
+
+void Csi_loss::close_frame(tx_loss &tx) {
+  tx.has_frame = false;
+  if (tx.cur_dup) {
+    return;
+  }
+
+  if ((tx.cur_mask & this->full_mask) == this->full_mask) {
+    tx.frames_complete++;
+    this->totals.frames_complete.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  tx.frames_partial++;
+  this->totals.frames_partial.fetch_add(1, std::memory_order_relaxed);
+  for (int s = 0; s < this->n_tx; s++) {
+    for (int c = 0; c < this->n_rx; c++) {
+      if (!(tx.cur_mask & (1ULL << (s * MAX_CORE + c)))) {
+        tx.missing[s][c]++;
+      }
+    }
+  }
+}
+
+void Csi_loss::on_packet(const csi_header &header, int iface) {
+  // シーケンス番号の上位12ビットがシーケンス，下位4ビットがフラグメント
+  uint16_t seq = header.seq_num / 16;
+  int core = header.core_stream_num & 0x7;
+  int stream = (header.core_stream_num >> 3) & 0x7;
+  uint64_t bit = 1ULL << (stream * MAX_CORE + core);
+
+  std::lock_guard<std::mutex> lock(this->mtx);
+  if (iface > 0) {
+    this->multi_iface = true;
+  }
+  uint64_t key =
+      (header.tx_mac_add & 0xFFFFFFFFFFFFULL) | ((uint64_t)iface << 48);
+  tx_loss &tx = this->table[key];
+  tx.packets++;
+  this->totals.packets.fetch_add(1, std::memory_order_relaxed);
+
+  // 組み立て中のフレームと同じシーケンス番号
+  if (tx.has_frame and seq == tx.cur_seq) {
+    if (tx.cur_mask & bit) {
+      // 同じコア・ストリームのパケットが重複
+      tx.seq_dups++;
+      this->totals.seq_dups.fetch_add(1, std::memory_order_relaxed);
+    }
+    tx.cur_mask |= bit;
+    return;
+  }
+
+  // 新しいシーケンス番号なので組み立て中のフレームを確定
+  if (tx.has_frame) {
+    this->close_frame(tx);
+  }
+
+  bool dup = false;
+  if (tx.has_seq) {
+    int diff = (seq - tx.last_seq + SEQ_NUM_MODULO) % SEQ_NUM_MODULO;
+    if (diff == 0 or diff > SEQ_NUM_MODULO / 2) {
+      // 再送または順序の逆転
+      tx.seq_dups++;
+      this->totals.seq_dups.fetch_add(1, std::memory_order_relaxed);
+      dup = true;
+    } else if (diff > 1) {
+      tx.seq_gaps += diff - 1;
+      this->totals.seq_gaps.fetch_add(diff - 1, std::memory_order_relaxed);
+    }
+  }
+
+  if (!dup) {
+    tx.last_seq = seq;
+    tx.has_seq = true;
+  }
+
+  tx.has_frame = true;
+  tx.cur_dup = dup;
+  tx.cur_seq = seq;
+  tx.cur_mask = bit;
+}
+
+void Csi_loss::flush() {
+  std::lock_guard<std::mutex> lock(this->mtx);
+  for (auto &kv : this->table) {
+    if (kv.second.has_frame) {
+      this->close_frame(kv.second);
+    }
+  }
+}
+
+void Csi_loss::set_pcap_stats(uint64_t recv, uint64_t drop, uint64_t ifdrop) {
+  this->totals.pcap_recv.store(recv, std::memory_order_relaxed);
+  this->totals.pcap_drop.store(drop, std::memory_order_relaxed);
+  this->totals.pcap_ifdrop.store(ifdrop, std::memory_order_relaxed);
+  this->totals.has_pcap_stats.store(true, std::memory_order_release);
+}
+
+void Csi_loss::print_line(std::ostream &os) {
+  const loss_totals &t = this->totals;
+  os << "packets: " << t.packets.load(std::memory_order_relaxed)
+     << ", frames: " << t.frames_complete.load(std::memory_order_relaxed)
+     << ", partial: " << t.frames_partial.load(std::memory_order_relaxed)
+     << ", seq gaps: " << t.seq_gaps.load(std::memory_order_relaxed)
+     << ", seq dups: " << t.seq_dups.load(std::memory_order_relaxed);
+  if (t.has_pcap_stats.load(std::memory_order_acquire)) {
+    os << ", kernel drop: " << t.pcap_drop.load(std::memory_order_relaxed)
+       << ", if drop: " << t.pcap_ifdrop.load(std::memory_order_relaxed);
+  }
+}
+
+void Csi_loss::print_summary(std::ostream &os) {
+  std::lock_guard<std::mutex> lock(this->mtx);
+  os << "=========================================" << std::endl;
+  os << "Loss summary:" << std::endl;
+  if (this->totals.has_pcap_stats.load(std::memory_order_acquire)) {
+    os << "   pcap received:   " << this->totals.pcap_recv << std::endl
+       << "   kernel dropped:  " << this->totals.pcap_drop << std::endl
+       << "   if dropped:      " << this->totals.pcap_ifdrop << std::endl;
+  }
+  for (auto &kv : this->table) {
+    const tx_loss &tx = kv.second;
+    os << "   " << key_str(kv.first, this->multi_iface) << ": packets "
+       << tx.packets << ", complete " << tx.frames_complete << ", partial "
+       << tx.frames_partial << ", seq gaps " << tx.seq_gaps << ", seq dups "
+       << tx.seq_dups << std::endl;
+    for (int s = 0; s < this->n_tx; s++) {
+      for (int c = 0; c < this->n_rx; c++) {
+        if (tx.missing[s][c] > 0) {
+          os << "      missing core " << c << " stream " << s << ": "
+             << tx.missing[s][c] << std::endl;
+        }
+      }
+    }
+  }
+  os << "=========================================" << std::endl;
+}
+
+void Csi_loss::write_summary(std::ofstream &ofs) {
+  std::lock_guard<std::mutex> lock(this->mtx);
+  ofs << "macadd,packets,frames_complete,frames_partial,seq_gaps,seq_dups";
+  for (int s = 0; s < this->n_tx; s++) {
+    for (int c = 0; c < this->n_rx; c++) {
+      ofs << ",missing_c" << c << "s" << s;
+    }
+  }
+  ofs << std::endl;
+
+  for (auto &kv : this->table) {
+    const tx_loss &tx = kv.second;
+    ofs << key_str(kv.first, this->multi_iface) << "," << tx.packets << ","
+        << tx.frames_complete << "," << tx.frames_partial << ","
+        << tx.seq_gaps << "," << tx.seq_dups;
+    for (int s = 0; s < this->n_tx; s++) {
+      for (int c = 0; c < this->n_rx; c++) {
+        ofs << "," << tx.missing[s][c];
+      }
+    }
+    ofs << std::endl;
+  }
+}
+
+} // namespace csirdr
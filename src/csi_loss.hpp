@@ -0,0 +1,150 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <stdlib.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "csi_reader_func.hpp"
+
+#ifndef CSI_LOSS
+#define CSI_LOSS
+
+#define SEQ_NUM_MODULO 4096 // 802.11のシーケンス番号は12ビット
+#define MAX_CORE 8
+#define MAX_STREAM 8
+
+namespace csirdr {
+
+/*
+ * 送信機ごとの損失の集計
+ */
+typedef struct {
+  uint64_t packets;         // 受信したCSIパケット数
+  uint64_t frames_complete; // 全コア・ストリームがそろったフレーム数
+  uint64_t frames_partial;  // 一部のコア・ストリームが欠けたフレーム数
+  uint64_t seq_gaps;        // シーケンス番号の欠番の数
+  uint64_t seq_dups;        // 重複または逆行したシーケンス番号の数
+  uint64_t missing[MAX_STREAM][MAX_CORE]; // 欠けたコア・ストリームごとの数
+
+  // 直前のシーケンス番号
+  bool has_seq;
+  uint16_t last_seq;
+
+  // 組み立て中のフレーム
+  bool has_frame;
+  bool cur_dup;
+  uint16_t cur_seq;
+  uint64_t cur_mask;
+} tx_loss;
+
+/*
+ * 全送信機の合計
+ * ロックせずに他スレッド（状態表示）から読み出せる
+ */
+struct loss_totals {
+  std::atomic<uint64_t> packets{0};
+  std::atomic<uint64_t> frames_complete{0};
+  std::atomic<uint64_t> frames_partial{0};
+  std::atomic<uint64_t> seq_gaps{0};
+  std::atomic<uint64_t> seq_dups{0};
+
+  // libpcapの統計
+  std::atomic<bool> has_pcap_stats{false};
+  std::atomic<uint64_t> pcap_recv{0};
+  std::atomic<uint64_t> pcap_drop{0};
+  std::atomic<uint64_t> pcap_ifdrop{0};
+};
+
+/*
+ * シーケンス番号の欠番，重複，フレームの欠けとlibpcapのドロップを集計するクラス
+ * ライブ・オフラインの両方でパケットのヘッダごとにon_packet()を呼び出す
+ * 複数スレッドから呼び出してよい
+ */
+class Csi_loss {
+private:
+  int n_rx; // コア数
+  int n_tx; // ストリーム数
+  uint64_t full_mask;
+
+  std::mutex mtx;
+  std::unordered_map<uint64_t, tx_loss> table; // キーは MAC | iface << 48
+  loss_totals totals;
+  bool multi_iface = false; // 2つ目以降のインターフェイスから受信したか
+
+  // 組み立て中のフレームを確定
+  void close_frame(tx_loss &tx);
+
+public:
+  Csi_loss(int n_rx, int n_tx);
+
+  /*
+   * パケットのヘッダを記録
+   * 複数インターフェイスで受信する場合は，インターフェイスごとに集計する
+   */
+  void on_packet(const csi_header &header, int iface = 0);
+
+  /*
+   * 組み立て中のフレームをすべて確定（測定終了時に呼び出す）
+   */
+  void flush();
+
+  /*
+   * libpcapの統計（ps_recv, ps_drop, ps_ifdrop）を記録
+   */
+  void set_pcap_stats(uint64_t recv, uint64_t drop, uint64_t ifdrop);
+
+  /*
+   * 全送信機の合計の出力
+   */
+  const loss_totals &get_totals() { return this->totals; }
+
+  /*
+   * 1行の要約を出力（ライブ表示用）
+   */
+  void print_line(std::ostream &os);
+
+  /*
+   * 送信機ごとの集計を出力
+   */
+  void print_summary(std::ostream &os);
+
+  /*
+   * 送信機ごとの集計をCSV形式で出力
+   */
+  void write_summary(std::ofstream &ofs);
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
@@ -0,0 +1,267 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstring>
+
+#include "csi_math.hpp"
+
+namespace csirdr {
+
+bool fast_math_enabled = false;
+
+namespace {
+// 複素数の配列を実部・虚部が交互に並んだfloatの配列として読む
+inline const float *as_floats(const std::complex<float> *csi) {
+  return reinterpret_cast<const float *>(csi);
+}
+
+inline float fast_sqrt(float p) {
+  // 逆平方根の初期値（ビット演算）とニュートン法1回
+  // p = 0 でも y は有限なので p * y = 0
+  uint32_t i;
+  std::memcpy(&i, &p, sizeof(i));
+  i = 0x5f375a86 - (i >> 1);
+  float y;
+  std::memcpy(&y, &i, sizeof(y));
+  y = y * (1.5f - 0.5f * p * y * y);
+  return p * y;
+}
+
+inline float fast_atan2(float y, float x) {
+  // |a| <= 1 に折り返してatanを多項式で近似し，象限を戻す
+  float ax = std::fabs(x);
+  float ay = std::fabs(y);
+  float mx = ax > ay ? ax : ay;
+  float mn = ax > ay ? ay : ax;
+  float a = mn / (mx + 1e-30f);
+  float s = a * a;
+  float r =
+      a * (0.9998660f +
+           s * (-0.3302995f +
+                s * (0.1801410f + s * (-0.0851330f + s * 0.0208351f))));
+  r = ay > ax ? 1.57079637f - r : r;
+  r = x < 0 ? 3.14159274f - r : r;
+  return y < 0 ? -r : r;
+}
+
+inline float fast_log2(float p) {
+  // p = m * 2^e（1 <= m < 2）とし，log2(m)を4次の多項式で近似
+  uint32_t i;
+  std::memcpy(&i, &p, sizeof(i));
+  float e = (float)((int32_t)(i >> 23) - 127);
+  i = (i & 0x007fffff) | 0x3f800000;
+  float m;
+  std::memcpy(&m, &i, sizeof(m));
+  return e - 2.50561455f +
+         m * (4.04961657f +
+              m * (-2.09940195f + m * (0.63551097f + m * -0.08001085f)));
+}
+} // namespace
+
+void csi_magnitude(const std::complex<float> *csi, float *out, int n) {
+  const float *__restrict c = as_floats(csi);
+  float *__restrict o = out;
+  if (fast_math_enabled) {
+    for (int i = 0; i < n; i++) {
+      o[i] = fast_sqrt(c[2 * i] * c[2 * i] + c[2 * i + 1] * c[2 * i + 1]);
+    }
+    return;
+  }
+  for (int i = 0; i < n; i++) {
+    o[i] = std::sqrt(c[2 * i] * c[2 * i] + c[2 * i + 1] * c[2 * i + 1]);
+  }
+}
+
+void csi_power(const std::complex<float> *csi, float *out, int n) {
+  const float *__restrict c = as_floats(csi);
+  float *__restrict o = out;
+  for (int i = 0; i < n; i++) {
+    o[i] = c[2 * i] * c[2 * i] + c[2 * i + 1] * c[2 * i + 1];
+  }
+}
+
+void csi_db(const std::complex<float> *csi, float *out, int n) {
+  csi_power(csi, out, n);
+  float *__restrict o = out;
+  if (fast_math_enabled) {
+    // 10 log10(p) = 10 log10(2) log2(p)
+    for (int i = 0; i < n; i++) {
+      float p = o[i] > CSI_POWER_FLOOR ? o[i] : CSI_POWER_FLOOR;
+      o[i] = 3.01029996f * fast_log2(p);
+    }
+    return;
+  }
+  for (int i = 0; i < n; i++) {
+    float p = o[i] > CSI_POWER_FLOOR ? o[i] : CSI_POWER_FLOOR;
+    o[i] = 10.0f * std::log10(p);
+  }
+}
+
+void csi_phase(const std::complex<float> *csi, float *out, int n) {
+  if (fast_math_enabled) {
+    csi_phase_fast(csi, out, n);
+    return;
+  }
+  const float *__restrict c = as_floats(csi);
+  float *__restrict o = out;
+  for (int i = 0; i < n; i++) {
+    o[i] = std::atan2(c[2 * i + 1], c[2 * i]);
+  }
+}
+
+void csi_phase_fast(const std::complex<float> *csi, float *out, int n) {
+  const float *__restrict c = as_floats(csi);
+  float *__restrict o = out;
+  for (int i = 0; i < n; i++) {
+    o[i] = fast_atan2(c[2 * i + 1], c[2 * i]);
+  }
+}
+
+void csi_unwrap(float *phase, int n) {
+  // 隣との差を2piで割って丸めた回数を求め，その累積（前置和）の2pi倍を
+  // 引く．4要素ずつベクトル型で行い，前置和はずらした加算2回と前の
+  // ブロックからの繰り上がりで求める
+  // （丸めは仮数部からはみ出させる定数の加減算で行う）
+  typedef float v4f __attribute__((vector_size(16)));
+  typedef int v4i __attribute__((vector_size(16)));
+  const float two_pi = 6.28318531f;
+  const float round_magic = 12582912.0f; // 1.5 * 2^23
+  const v4i zero = {0, 0, 0, 0};
+  if (n < 2) {
+    return;
+  }
+
+  v4f last = {0, 0, 0, phase[0]}; // 前のブロックの補正前の値
+  v4i carry = zero;
+  int i = 1;
+  for (; i + 4 <= n; i += 4) {
+    v4f cur;
+    std::memcpy(&cur, phase + i, sizeof(cur));
+    v4f prev = __builtin_shuffle(last, cur, v4i{3, 4, 5, 6});
+    v4f k = ((cur - prev) * (1.0f / two_pi) + round_magic) - round_magic;
+    v4i cnt = __builtin_convertvector(k, v4i);
+    cnt += __builtin_shuffle(cnt, zero, v4i{4, 0, 1, 2});
+    cnt += __builtin_shuffle(cnt, zero, v4i{4, 4, 0, 1});
+    cnt += carry;
+    carry = __builtin_shuffle(cnt, v4i{3, 3, 3, 3});
+    last = cur;
+    cur -= two_pi * __builtin_convertvector(cnt, v4f);
+    std::memcpy(phase + i, &cur, sizeof(cur));
+  }
+
+  // 端数
+  float prev = last[3];
+  int32_t acc = carry[0];
+  for (; i < n; i++) {
+    float cur = phase[i];
+    float k = ((cur - prev) * (1.0f / two_pi) + round_magic) - round_magic;
+    acc += (int32_t)k;
+    prev = cur;
+    phase[i] = cur - two_pi * (float)acc;
+  }
+}
+
+void csi_linear_fit(const float *x, const float *y, int n, float &slope,
+                    float &offset) {
+  // 浮動小数点の総和は順序を変えられないので自動ではベクトル化されない
+  // 4つの部分和をベクトル型で明示的に持つ
+  typedef float v4f __attribute__((vector_size(16)));
+  v4f sx = {}, sy = {}, sxx = {}, sxy = {};
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    v4f xv, yv;
+    std::memcpy(&xv, x + i, sizeof(xv));
+    std::memcpy(&yv, y + i, sizeof(yv));
+    sx += xv;
+    sy += yv;
+    sxx += xv * xv;
+    sxy += xv * yv;
+  }
+  double tx = 0, ty = 0, txx = 0, txy = 0;
+  for (int l = 0; l < 4; l++) {
+    tx += sx[l];
+    ty += sy[l];
+    txx += sxx[l];
+    txy += sxy[l];
+  }
+  for (; i < n; i++) {
+    tx += x[i];
+    ty += y[i];
+    txx += (double)x[i] * x[i];
+    txy += (double)x[i] * y[i];
+  }
+
+  double det = n * txx - tx * tx;
+  slope = (n >= 2 and det > 0) ? (float)((n * txy - tx * ty) / det) : 0;
+  offset = n >= 1 ? (float)((ty - slope * tx) / n) : 0;
+}
+
+void csi_rotate(const std::complex<float> *csi, std::complex<float> *out,
+                int n, float slope, float offset) {
+  // 回転子 e^{-i(slope k + offset)} を4本の漸化式（1本は4サブキャリア
+  // おき）で更新し，4サブキャリアずつベクトル型で回転する
+  // 漸化式は独立なので依存の連鎖が短く，sin, cosは最初の4つのみ
+  typedef float v4f __attribute__((vector_size(16)));
+  typedef int v4i __attribute__((vector_size(16)));
+  v4f wr, wi;
+  for (int l = 0; l < 4; l++) {
+    wr[l] = std::cos(slope * l + offset);
+    wi[l] = -std::sin(slope * l + offset);
+  }
+  float rr = std::cos(4 * slope), ri = -std::sin(4 * slope);
+  const float *c = as_floats(csi);
+  float *o = reinterpret_cast<float *>(out);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    // 実部と虚部に分けて回転し，交互の並びに戻す
+    v4f a, b;
+    std::memcpy(&a, c + 2 * i, sizeof(a));
+    std::memcpy(&b, c + 2 * i + 4, sizeof(b));
+    v4f re = __builtin_shuffle(a, b, v4i{0, 2, 4, 6});
+    v4f im = __builtin_shuffle(a, b, v4i{1, 3, 5, 7});
+    v4f ore = re * wr - im * wi;
+    v4f oim = re * wi + im * wr;
+    a = __builtin_shuffle(ore, oim, v4i{0, 4, 1, 5});
+    b = __builtin_shuffle(ore, oim, v4i{2, 6, 3, 7});
+    std::memcpy(o + 2 * i, &a, sizeof(a));
+    std::memcpy(o + 2 * i + 4, &b, sizeof(b));
+
+    v4f t = wr * rr - wi * ri;
+    wi = wr * ri + wi * rr;
+    wr = t;
+  }
+  for (int l = 0; i < n; i++, l++) {
+    float re = c[2 * i], im = c[2 * i + 1];
+    o[2 * i] = re * wr[l] - im * wi[l];
+    o[2 * i + 1] = re * wi[l] + im * wr[l];
+  }
+}
+
+} // namespace csirdr
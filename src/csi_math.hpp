@@ -0,0 +1,91 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <complex>
+
+#ifndef CSI_MATH
+#define CSI_MATH
+
+#define CSI_POWER_FLOOR 1e-10f // dBに変換する電力の下限（-100 dB）
+
+namespace csirdr {
+
+/*
+ * 近似計算の有効・無効
+ * スレッド開始前に設定し，以降は読み出しのみ
+ * 有効なら振幅・位相・dBを次の誤差の近似で求める
+ *   振幅: 相対誤差 0.18% 以下（逆平方根のビット演算とニュートン法1回）
+ *   位相: 絶対誤差 1.2e-5 rad 以下（atanの9次の多項式）
+ *   dB:   絶対誤差 0.0005 dB 以下（指数部と仮数部の4次の多項式によるlog2）
+ */
+extern bool fast_math_enabled;
+
+/*
+ * 連続した複素数の配列に対する一括の計算
+ * ループは分岐を含まず，コンパイラがSIMD命令にベクトル化する
+ * input: csi (n個の複素数), n
+ * output: out (n個)
+ */
+void csi_magnitude(const std::complex<float> *csi, float *out, int n); // |c|
+void csi_power(const std::complex<float> *csi, float *out, int n); // |c|^2
+void csi_db(const std::complex<float> *csi, float *out, int n); // 10log|c|^2
+void csi_phase(const std::complex<float> *csi, float *out, int n); // arg(c)
+
+/*
+ * 常に近似で求める位相（fast_math_enabledによらない）
+ * 誤差が問題にならない後段の処理（位相の補正など）で使う
+ */
+void csi_phase_fast(const std::complex<float> *csi, float *out, int n);
+
+/*
+ * 位相のアンラップ（隣との差が[-pi, pi)になるよう2piの倍数を足す）
+ * input: phase (n個), n
+ * output: phase (n個，上書き)
+ */
+void csi_unwrap(float *phase, int n);
+
+/*
+ * 最小二乗法による直線 y = slope x + offset の当てはめ
+ * 和は4要素のベクトル型（GCCのベクトル拡張）で求める
+ * input: x, y (n個), n
+ * output: slope, offset (n < 2 なら slope = 0)
+ */
+void csi_linear_fit(const float *x, const float *y, int n, float &slope,
+                    float &offset);
+
+/*
+ * サブキャリア番号に比例する位相の回転 c[k] e^{-i(slope k + offset)}
+ * 回転子は漸化式で更新する（256サブキャリアで誤差 1e-5 以下）
+ * input: csi (n個), n, slope, offset
+ * output: out (n個，csiと同じでもよい)
+ */
+void csi_rotate(const std::complex<float> *csi, std::complex<float> *out,
+                int n, float slope, float offset);
+
+} // namespace csirdr
+
+#endif /* end of include guard */
@@ -0,0 +1,249 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <ostream>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "csi_frame.hpp"
+#include "csi_motion.hpp"
+
+namespace csirdr {
+
+Motion_stats::Motion_stats(std::string path, double window_sec) {
+  this->window_sec = window_sec;
+  this->ofs.open(path);
+  if (!this->ofs.is_open()) {
+    std::cerr << "Failed to open " << path << std::endl;
+    return;
+  }
+  this->ofs << "mac,seq,timestamp_ns,frames,median_var,mean_var,median_corr"
+            << std::endl;
+}
+
+void Motion_window::reset(int n_elements, int n_sub) {
+  this->n_elements = n_elements;
+  this->n_sub = n_sub;
+  this->n_channels = n_elements * n_sub;
+  this->n = 0;
+  this->mean.assign(this->n_channels, 0);
+  this->m2.assign(this->n_channels, 0);
+  this->cov.assign(this->n_channels, 0);
+  this->delta.assign(this->n_channels, 0);
+  this->summary.assign(this->n_channels, 0);
+
+  this->capacity = MOTION_INIT_FRAMES;
+  this->head = 0;
+  this->history.assign((size_t)this->capacity * this->n_channels, 0);
+  this->timestamps.assign(this->capacity, 0);
+}
+
+void Motion_window::grow() {
+  // 最も古いフレームが先頭になるように並べ直して容量を2倍にする
+  int capacity = this->capacity * 2;
+  std::vector<float> history((size_t)capacity * this->n_channels);
+  std::vector<int64_t> timestamps(capacity);
+  for (int i = 0; i < this->n; i++) {
+    int src = (this->head + i) % this->capacity;
+    std::copy(this->history.begin() + (size_t)src * this->n_channels,
+              this->history.begin() + (size_t)(src + 1) * this->n_channels,
+              history.begin() + (size_t)i * this->n_channels);
+    timestamps[i] = this->timestamps[src];
+  }
+  this->history.swap(history);
+  this->timestamps.swap(timestamps);
+  this->capacity = capacity;
+  this->head = 0;
+}
+
+void Motion_window::add(const float *x) {
+  this->n++;
+  double inv = 1.0 / this->n;
+  for (int ch = 0; ch < this->n_channels; ch++) {
+    double d = x[ch] - this->mean[ch];
+    this->delta[ch] = d;
+    this->mean[ch] += d * inv;
+    this->m2[ch] += d * (x[ch] - this->mean[ch]);
+  }
+
+  // 共分散: 一方は更新前，他方は更新後の平均からの偏差の積を足す
+  for (int e = 0; e < this->n_elements; e++) {
+    int base = e * this->n_sub;
+    for (int sub = base; sub < base + this->n_sub - 1; sub++) {
+      this->cov[sub] += this->delta[sub] * (x[sub + 1] - this->mean[sub + 1]);
+    }
+  }
+}
+
+void Motion_window::remove(const float *x) {
+  this->n--;
+  if (this->n == 0) {
+    std::fill(this->mean.begin(), this->mean.end(), 0);
+    std::fill(this->m2.begin(), this->m2.end(), 0);
+    std::fill(this->cov.begin(), this->cov.end(), 0);
+    return;
+  }
+
+  // 追加の逆: 削除前の平均からの偏差を残し，削除後の平均からの偏差と掛ける
+  double inv = 1.0 / this->n;
+  for (int ch = 0; ch < this->n_channels; ch++) {
+    double d = x[ch] - this->mean[ch];
+    this->delta[ch] = d;
+    this->mean[ch] -= d * inv;
+    this->m2[ch] = std::max(this->m2[ch] - d * (x[ch] - this->mean[ch]), 0.0);
+  }
+  for (int e = 0; e < this->n_elements; e++) {
+    int base = e * this->n_sub;
+    for (int sub = base; sub < base + this->n_sub - 1; sub++) {
+      this->cov[sub] -= (x[sub] - this->mean[sub]) * this->delta[sub + 1];
+    }
+  }
+}
+
+void Motion_window::write_summary(std::ostream &os, const Csi_frame &frame) {
+  os << std::hex << std::setw(4) << std::setfill('0')
+            << frame.get_mac_tail() << std::dec << ',' << frame.seq << ','
+            << frame.timestamp_ns << ',' << this->n;
+  if (this->n < 2) {
+    os << ",,,\n";
+    return;
+  }
+
+  // 分散の中央値と平均（振幅が常に0のサブキャリアは除く）
+  double inv = 1.0 / (this->n - 1);
+  int n_valid = 0;
+  double sum = 0;
+  for (int ch = 0; ch < this->n_channels; ch++) {
+    if (this->mean[ch] > 0) {
+      float var = (float)(this->m2[ch] * inv);
+      this->summary[n_valid++] = var;
+      sum += var;
+    }
+  }
+  if (n_valid == 0) {
+    os << ",,,\n";
+    return;
+  }
+  auto mid = this->summary.begin() + n_valid / 2;
+  std::nth_element(this->summary.begin(), mid,
+                   this->summary.begin() + n_valid);
+  os << ',' << *mid << ',' << sum / n_valid;
+
+  // 隣のサブキャリアとの相関の中央値（分散が0の組は除く）
+  int n_corr = 0;
+  for (int e = 0; e < this->n_elements; e++) {
+    int base = e * this->n_sub;
+    for (int sub = base; sub < base + this->n_sub - 1; sub++) {
+      double den = this->m2[sub] * this->m2[sub + 1];
+      if (den > 0) {
+        this->summary[n_corr++] = (float)(this->cov[sub] / std::sqrt(den));
+      }
+    }
+  }
+  os << ',';
+  if (n_corr > 0) {
+    mid = this->summary.begin() + n_corr / 2;
+    std::nth_element(this->summary.begin(), mid,
+                     this->summary.begin() + n_corr);
+    os << *mid;
+  }
+  os << '\n';
+}
+
+int Motion_window::push(const Csi_frame &frame, int64_t window_ns) {
+  int n_elements = frame.get_n_elements();
+  int n_sub = frame.get_n_sub();
+  if (n_elements != this->n_elements or n_sub != this->n_sub) {
+    this->reset(n_elements, n_sub);
+  }
+
+  // 窓から外れたフレームの削除
+  int64_t t = frame.timestamp_ns;
+  while (this->n > 0 and t - this->timestamps[this->head] >= window_ns) {
+    this->remove(this->history.data() +
+                 (size_t)this->head * this->n_channels);
+    this->head = (this->head + 1) % this->capacity;
+  }
+
+  // 履歴が一杯なら広げ，最大容量なら最も古いフレームを捨てる
+  int n_overflow = 0;
+  if (this->n == this->capacity) {
+    if (this->capacity < MOTION_MAX_FRAMES) {
+      this->grow();
+    } else {
+      this->remove(this->history.data() +
+                   (size_t)this->head * this->n_channels);
+      this->head = (this->head + 1) % this->capacity;
+      n_overflow++;
+    }
+  }
+
+  // 新しいフレームの振幅を履歴に書き込んで追加
+  int tail = (this->head + this->n) % this->capacity;
+  float *x = this->history.data() + (size_t)tail * this->n_channels;
+  for (int e = 0; e < n_elements; e++) {
+    const float *amplitude = frame.get_amplitude(e);
+    std::copy(amplitude, amplitude + n_sub, x + e * n_sub);
+  }
+  this->timestamps[tail] = t;
+  this->add(x);
+  return n_overflow;
+}
+
+bool Motion_stats::process(Csi_frame_ref &frame) {
+  this->n_frames++;
+  Motion_window &window = this->windows.get(*frame);
+  this->n_overflow +=
+      window.push(*frame, (int64_t)(this->window_sec * 1e9));
+  window.write_summary(this->ofs, *frame);
+  return true;
+}
+
+void Motion_stats::flush() {
+  this->ofs.flush();
+  std::cout << "Motion stats (window " << this->window_sec
+            << " s): " << this->n_frames << " frames, "
+            << this->windows.size() << " transmitters" << std::endl;
+  if (this->windows.get_n_evicted() > 0) {
+    std::cerr << "motion: " << this->windows.get_n_evicted()
+              << " transmitter windows discarded (more than " << TX_STATE_MAX
+              << " transmitters)" << std::endl;
+  }
+  if (this->n_overflow > 0) {
+    std::cerr << "motion: " << this->n_overflow
+              << " frames dropped from the window (more than "
+              << MOTION_MAX_FRAMES << " frames in window)" << std::endl;
+  }
+}
+
+} // namespace csirdr
@@ -0,0 +1,125 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <fstream>
+#include <ostream>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "csi_frame.hpp"
+#include "csi_graph.hpp"
+#include "csi_tx_state.hpp"
+
+#ifndef CSI_MOTION
+#define CSI_MOTION
+
+#define MOTION_WINDOW_SEC 3.0 // 窓の長さ（秒）の既定値
+#define MOTION_INIT_FRAMES 256  // 履歴の初期容量（フレーム数）
+#define MOTION_MAX_FRAMES 4096  // 履歴の最大容量（超えたら古い順に捨てる）
+
+namespace csirdr {
+
+/*
+ * 1つの送信機の時間窓の統計量と振幅の履歴
+ */
+class Motion_window {
+private:
+  int n_elements = 0;
+  int n_sub = 0;
+  int n_channels = 0; // n_elements * n_sub
+
+  // 窓の統計量（チャネル = 要素 * n_sub + サブキャリア）
+  int n = 0;
+  std::vector<double> mean;
+  std::vector<double> m2;     // 平均からの偏差の2乗和
+  std::vector<double> cov;    // 同じ要素の次のサブキャリアとの偏差の積和
+  std::vector<double> delta;  // 更新前の平均からの偏差（作業領域）
+  std::vector<float> summary; // 中央値を求めるための作業領域
+
+  // 振幅の履歴（n_channels個ずつのリング）
+  int capacity = 0;
+  int head = 0; // 最も古いフレームの位置
+  std::vector<float> history;
+  std::vector<int64_t> timestamps;
+
+  void reset(int n_elements, int n_sub);
+  void grow();
+
+  // 1フレーム分の振幅の窓への追加と削除
+  void add(const float *x);
+  void remove(const float *x);
+
+public:
+  /*
+   * フレームの追加と窓から外れたフレームの削除
+   * return: 容量を超えて窓より先に捨てたフレーム数
+   */
+  int push(const Csi_frame &frame, int64_t window_ns);
+
+  /*
+   * 窓の統計量の要約を1行書き出す
+   */
+  void write_summary(std::ostream &os, const Csi_frame &frame);
+};
+
+/*
+ * 時間窓での振幅の移動統計（動きの検出用）
+ * 要素・サブキャリアごとに直近window_sec秒の振幅の平均・分散と，
+ * 隣のサブキャリアとの相関をWelford法の追加・削除で更新する
+ * 窓から外れるフレームの振幅は履歴（リング）から読んで削除するので，
+ * 1フレームあたりの計算量は窓の長さによらずサブキャリア数に比例する
+ * 窓は送信機（MACアドレスと受信インターフェイス）ごとに持ち，
+ * CSVの行はフレームの送信機の窓の値になる
+ * フレームごとに，0でないサブキャリアについての分散の中央値・平均と
+ * 相関の中央値を1行ずつCSVに書き出し，フレームはそのまま後段に渡す
+ * 段の指定: "motion:パス" または "motion:秒数:パス"
+ */
+class Motion_stats : public Csi_stage {
+private:
+  double window_sec;
+  std::ofstream ofs;
+  Tx_state_map<Motion_window> windows;
+
+  uint64_t n_frames = 0;
+  uint64_t n_overflow = 0; // 容量を超えて窓より先に捨てたフレーム数
+
+public:
+  Motion_stats(std::string path, double window_sec = MOTION_WINDOW_SEC);
+  std::string get_name() override { return "motion"; }
+  bool is_open() { return this->ofs.is_open(); }
+  bool process(Csi_frame_ref &frame) override;
+
+  /*
+   * 処理したフレーム数などの出力
+   */
+  void flush() override;
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
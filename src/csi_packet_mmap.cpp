@@ -0,0 +1,325 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include <pcap/pcap.h>
+
+#include "csi_packet_mmap.hpp"
+#include "csi_reader_func.hpp"
+#include "csi_stats.hpp"
+
+namespace csirdr {
+
+Csi_packet_mmap::Csi_packet_mmap(std::string interface, int fanout_group,
+                                 int block_size, int block_nr) {
+  this->interface = interface;
+  this->fanout_group = fanout_group;
+  this->block_size = block_size;
+  this->block_nr = block_nr;
+}
+
+Csi_packet_mmap::~Csi_packet_mmap() { this->close(); }
+
+bool Csi_packet_mmap::open(std::string bpf_filter) {
+  // ソケットの作成
+  // プロトコル0のソケットはバインドでプロトコルを設定するまで何も受信しない
+  // （フィルタやリングの設定中に他のインターフェイスのパケットが入らない）
+  this->fd = socket(AF_PACKET, SOCK_RAW, 0);
+  if (this->fd < 0) {
+    std::cerr << "Cannot open packet socket: " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+
+  // インターフェイスのリンク層の種類
+  // フィルタのコンパイルとUDPペイロードの解析で同じものを使う
+  struct ifreq ifr;
+  std::memset(&ifr, 0, sizeof(ifr));
+  std::strncpy(ifr.ifr_name, this->interface.c_str(), IFNAMSIZ - 1);
+  if (ioctl(this->fd, SIOCGIFHWADDR, &ifr) != 0) {
+    std::cerr << "Cannot get link type of " << this->interface << ": "
+              << std::strerror(errno) << std::endl;
+    this->close();
+    return false;
+  }
+  switch (ifr.ifr_hwaddr.sa_family) {
+  case ARPHRD_ETHER:
+  case ARPHRD_LOOPBACK:
+    this->link_type = DLT_EN10MB;
+    break;
+  case ARPHRD_NONE: // tunなど（IPヘッダから始まる）
+    this->link_type = DLT_RAW;
+    break;
+  default:
+    std::cerr << "Unsupported link type of " << this->interface << ": "
+              << ifr.ifr_hwaddr.sa_family << std::endl;
+    this->close();
+    return false;
+  }
+
+  // BPFフィルタ
+  // libpcapでコンパイルしてソケットに直接設定する
+  // 受信を始めるバインドの前に設定して，フィルタ前のパケットが
+  // リングに入らないようにする
+  // 設定できなければ，フィルタなしで受信を続けずに失敗とする
+  if (bpf_filter != "") {
+    pcap_t *dead = pcap_open_dead(this->link_type, MMAP_FRAME_SIZE);
+    struct bpf_program prog;
+    bool attached = false;
+    if (pcap_compile(dead, &prog, bpf_filter.c_str(), 1,
+                     PCAP_NETMASK_UNKNOWN) != 0) {
+      std::cerr << "Cannot compile BPF filter: " << pcap_geterr(dead)
+                << std::endl;
+    } else {
+      struct sock_fprog fprog;
+      fprog.len = prog.bf_len;
+      fprog.filter = (struct sock_filter *)prog.bf_insns;
+      if (setsockopt(this->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+                     sizeof(fprog)) != 0) {
+        std::cerr << "Cannot attach BPF filter: " << std::strerror(errno)
+                  << std::endl;
+      } else {
+        attached = true;
+      }
+      pcap_freecode(&prog);
+    }
+    pcap_close(dead);
+    if (!attached) {
+      this->close();
+      return false;
+    }
+  }
+
+  // TPACKET_V3
+  int version = TPACKET_V3;
+  if (setsockopt(this->fd, SOL_PACKET, PACKET_VERSION, &version,
+                 sizeof(version)) != 0) {
+    std::cerr << "Cannot set TPACKET_V3: " << std::strerror(errno)
+              << std::endl;
+    this->close();
+    return false;
+  }
+
+  // アダプタ（ハードウェア）のタイムスタンプ
+  // 使えなければカーネルのタイムスタンプのまま
+  if (this->hw_timestamp) {
+    this->enable_hw_timestamp();
+  }
+
+  // 受信リング
+  struct tpacket_req3 req;
+  std::memset(&req, 0, sizeof(req));
+  req.tp_block_size = this->block_size;
+  req.tp_block_nr = this->block_nr;
+  req.tp_frame_size = MMAP_FRAME_SIZE;
+  req.tp_frame_nr = (this->block_size / MMAP_FRAME_SIZE) * this->block_nr;
+  req.tp_retire_blk_tov = MMAP_BLOCK_TIMEOUT_MS;
+  if (setsockopt(this->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) !=
+      0) {
+    std::cerr << "Cannot set PACKET_RX_RING: " << std::strerror(errno)
+              << std::endl;
+    this->close();
+    return false;
+  }
+
+  this->map_len = (size_t)this->block_size * this->block_nr;
+  void *m = mmap(NULL, this->map_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, this->fd, 0);
+  if (m == MAP_FAILED) {
+    std::cerr << "Cannot mmap packet ring: " << std::strerror(errno)
+              << std::endl;
+    this->map_len = 0;
+    this->close();
+    return false;
+  }
+  this->map = (uint8_t *)m;
+
+  // インターフェイスへのバインド（ここでプロトコルを設定して受信を始める）
+  struct sockaddr_ll ll;
+  std::memset(&ll, 0, sizeof(ll));
+  ll.sll_family = AF_PACKET;
+  ll.sll_protocol = htons(ETH_P_ALL);
+  ll.sll_ifindex = if_nametoindex(this->interface.c_str());
+  if (ll.sll_ifindex == 0 or
+      bind(this->fd, (struct sockaddr *)&ll, sizeof(ll)) != 0) {
+    std::cerr << "Cannot bind to interface: " << this->interface << std::endl;
+    this->close();
+    return false;
+  }
+
+  // ファンアウト（同じグループの複数ソケットでフローを分担）
+  if (this->fanout_group >= 0) {
+    int arg = (this->fanout_group & 0xFFFF) | (PACKET_FANOUT_HASH << 16);
+    if (setsockopt(this->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) !=
+        0) {
+      std::cerr << "Cannot join fanout group " << this->fanout_group << ": "
+                << std::strerror(errno) << std::endl;
+    }
+  }
+
+  this->cur_block = 0;
+  this->holding_block = false;
+  return true;
+}
+
+void Csi_packet_mmap::enable_hw_timestamp() {
+  // インターフェイスで受信パケットのタイムスタンプを有効化
+  struct hwtstamp_config config;
+  std::memset(&config, 0, sizeof(config));
+  config.tx_type = HWTSTAMP_TX_OFF;
+  config.rx_filter = HWTSTAMP_FILTER_ALL;
+
+  struct ifreq ifr;
+  std::memset(&ifr, 0, sizeof(ifr));
+  std::strncpy(ifr.ifr_name, this->interface.c_str(), IFNAMSIZ - 1);
+  ifr.ifr_data = (char *)&config;
+  if (ioctl(this->fd, SIOCSHWTSTAMP, &ifr) != 0) {
+    std::cerr << "Cannot enable hardware timestamping on " << this->interface
+              << ": " << std::strerror(errno) << std::endl;
+  }
+
+  // リングのヘッダ（tp_sec, tp_nsec）にアダプタの時刻を書き込ませる
+  int req = SOF_TIMESTAMPING_RAW_HARDWARE;
+  if (setsockopt(this->fd, SOL_PACKET, PACKET_TIMESTAMP, &req, sizeof(req)) !=
+      0) {
+    std::cerr << "Cannot set PACKET_TIMESTAMP: " << std::strerror(errno)
+              << std::endl;
+  }
+}
+
+void Csi_packet_mmap::close() {
+  if (this->map != nullptr) {
+    munmap(this->map, this->map_len);
+    this->map = nullptr;
+  }
+  if (this->fd >= 0) {
+    ::close(this->fd);
+    this->fd = -1;
+  }
+}
+
+bool Csi_packet_mmap::next_block(int timeout_ms,
+                                 std::vector<csi_packet_view> &views) {
+  views.clear();
+
+  struct tpacket_block_desc *bd =
+      (struct tpacket_block_desc *)(this->map +
+                                    (size_t)this->cur_block * this->block_size);
+
+  // ブロックがユーザ空間に渡されるまで待つ
+  if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+        TP_STATUS_USER)) {
+    struct pollfd pfd;
+    pfd.fd = this->fd;
+    pfd.events = POLLIN | POLLERR;
+    pfd.revents = 0;
+    poll(&pfd, 1, timeout_ms);
+    if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+          TP_STATUS_USER)) {
+      return false;
+    }
+  }
+  this->holding_block = true;
+
+  // ブロック中のパケットを順にたどる
+  int n_pkts = bd->hdr.bh1.num_pkts;
+  struct tpacket3_hdr *ppd =
+      (struct tpacket3_hdr *)((uint8_t *)bd +
+                              bd->hdr.bh1.offset_to_first_pkt);
+  for (int i = 0; i < n_pkts; i++) {
+    Stage_timer timer(STAGE_RECEIVE);
+    uint8_t *frame = (uint8_t *)ppd + ppd->tp_mac;
+    int offset, payload_len;
+
+    Stage_timer timer_udp(STAGE_UDP_PARSE);
+    bool is_udp = get_udp_payload(frame, ppd->tp_snaplen, this->link_type,
+                                  offset, payload_len);
+    timer_udp.stop();
+
+    if (is_udp and
+        payload_len >= CSI_HEADER_OFFSET + 64 * BYTE_OF_CSI_DATA_UNIT) {
+      csi_packet_view v;
+      v.payload = frame + offset;
+      v.data_len = payload_len;
+      v.timestamp_ns = (int64_t)ppd->tp_sec * 1000000000 + ppd->tp_nsec;
+      if (ppd->tp_status & TP_STATUS_TS_RAW_HARDWARE) {
+        this->n_hw_timestamps++;
+      }
+      views.push_back(v);
+    }
+
+    ppd = (struct tpacket3_hdr *)((uint8_t *)ppd + ppd->tp_next_offset);
+  }
+
+  return true;
+}
+
+void Csi_packet_mmap::release_block() {
+  if (!this->holding_block) {
+    return;
+  }
+  struct tpacket_block_desc *bd =
+      (struct tpacket_block_desc *)(this->map +
+                                    (size_t)this->cur_block * this->block_size);
+  __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                   __ATOMIC_RELEASE);
+  this->cur_block = (this->cur_block + 1) % this->block_nr;
+  this->holding_block = false;
+}
+
+void Csi_packet_mmap::get_statistics(uint64_t &packets, uint64_t &drops) {
+  struct tpacket_stats_v3 st;
+  socklen_t len = sizeof(st);
+  if (this->fd >= 0 and
+      getsockopt(this->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0) {
+    this->total_packets += st.tp_packets;
+    this->total_drops += st.tp_drops;
+  }
+  packets = this->total_packets;
+  drops = this->total_drops;
+}
+
+} // namespace csirdr
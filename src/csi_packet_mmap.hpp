@@ -0,0 +1,134 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#ifndef CSI_PACKET_MMAP
+#define CSI_PACKET_MMAP
+
+#define MMAP_BLOCK_SIZE (1 << 20) // リングの1ブロックのバイト数
+#define MMAP_BLOCK_NR 64          // リングのブロック数
+#define MMAP_FRAME_SIZE 2048      // パケット1つあたりの目安のバイト数
+#define MMAP_BLOCK_TIMEOUT_MS 10  // ブロックが埋まらなくても返却するまでの時間
+
+namespace csirdr {
+
+/*
+ * ブロック中のUDPペイロードへの参照
+ * ブロックを返却するまで有効
+ */
+typedef struct {
+  uint8_t *payload;
+  int data_len;
+  int64_t timestamp_ns; // 受信時刻（UNIX時間のナノ秒）
+} csi_packet_view;
+
+/*
+ * AF_PACKETのTPACKET_V3メモリマップドリングによるキャプチャ
+ * カーネルが書き込んだブロックをそのまま読み出すので，
+ * パケットごとのコピーとコールバックがない
+ * 使い方: open() → next_block() → (viewsを処理) → release_block() → ...
+ */
+class Csi_packet_mmap {
+private:
+  std::string interface;
+  int fanout_group; // PACKET_FANOUTのグループID（負なら使用しない）
+
+  int fd = -1;
+  uint8_t *map = nullptr;
+  size_t map_len = 0;
+  int block_size;
+  int block_nr;
+  int cur_block = 0;
+  bool holding_block = false;
+  int link_type = 1; // インターフェイスのリンク層（DLT_*，1はEthernet）
+
+  // PACKET_STATISTICSは読み出すたびにリセットされるので累積する
+  uint64_t total_packets = 0;
+  uint64_t total_drops = 0;
+
+  // アダプタのタイムスタンプ
+  bool hw_timestamp = false;
+  uint64_t n_hw_timestamps = 0; // アダプタの時刻が付いていたパケット数
+  void enable_hw_timestamp();
+
+public:
+  Csi_packet_mmap(std::string interface, int fanout_group = -1,
+                  int block_size = MMAP_BLOCK_SIZE,
+                  int block_nr = MMAP_BLOCK_NR);
+  ~Csi_packet_mmap();
+
+  /*
+   * アダプタのタイムスタンプ（SIOCSHWTSTAMP, PACKET_TIMESTAMP）の使用
+   * open()の前に呼び出す
+   * アダプタの時計がシステム時計と同期していないと受信からの遅延は無意味
+   */
+  void set_hw_timestamp(bool on) { this->hw_timestamp = on; }
+
+  /*
+   * アダプタの時刻が付いていたパケット数
+   */
+  uint64_t get_n_hw_timestamps() { return this->n_hw_timestamps; }
+
+  /*
+   * ソケットの作成，BPFフィルタの設定，リングのマップ，バインド
+   * フィルタはインターフェイスのリンク層（Ethernetか生のIP）に合わせて
+   * コンパイルする
+   * input: std::string bpf_filter (make_bpf_filter()の出力，空なら無し)
+   * return: 成功したらtrue（フィルタを設定できなければfalse）
+   */
+  bool open(std::string bpf_filter);
+
+  /*
+   * ソケットとリングの解放
+   */
+  void close();
+
+  /*
+   * 次のブロックを最大timeout_msだけ待ち，UDPペイロードの参照を出力
+   * viewsは呼び出し側で確保したものを使い回す
+   * return: ブロックを取得したらtrue（パケット数0のこともある）
+   */
+  bool next_block(int timeout_ms, std::vector<csi_packet_view> &views);
+
+  /*
+   * next_block()で取得したブロックをカーネルに返却
+   */
+  void release_block();
+
+  /*
+   * カーネルでの受信数とドロップ数（累積）
+   */
+  void get_statistics(uint64_t &packets, uint64_t &drops);
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
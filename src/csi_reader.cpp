@@ -41,8 +41,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <PcapFileDevice.h>
 #include <UdpLayer.h>
 
+#include "csi_loss.hpp"
 #include "csi_reader.hpp"
 #include "csi_reader_func.hpp"
+#include "csi_stats.hpp"
 
 namespace csirdr {
 
@@ -74,6 +76,7 @@ Csi_reader::Csi_reader(std::filesystem::path pcap_path,
 
   // 行列要素数
   this->n_csi_elements = this->n_rx * this->n_tx;
+  this->pool = std::make_unique<Csi_frame_pool>(this->n_csi_elements);
 
   // 設定の出力
   std::cout << "=========================================" << std::endl;
@@ -95,6 +98,7 @@ void Csi_reader::decode(bool rm_guard_pilot) {
   // - シーケンス番号などの雑多データ
   std::filesystem::path csi_value_path = this->output_dir / "csi_value.csv";
   std::filesystem::path csi_seq_path = this->output_dir / "csi_seq.csv";
+  std::filesystem::path csi_loss_path = this->output_dir / "csi_loss.csv";
 
   // 出力ファイル名
   std::ofstream fs_csi_value;
@@ -111,6 +115,12 @@ void Csi_reader::decode(bool rm_guard_pilot) {
              << ","
              << "timestamp" << std::endl;
 
+  // デバイスのデコード関数
+  csirdr::csi_decode_func decode = csirdr::get_csi_decoder(this->device);
+  if (decode == nullptr) {
+    return;
+  }
+
   // デコードの実行・出力
   pcpp::IFileReaderDevice *reader =
       pcpp::IFileReaderDevice::getReader(this->pcap_path);
@@ -120,14 +130,33 @@ void Csi_reader::decode(bool rm_guard_pilot) {
   std::stringstream temp_seq;            // 出力データの一時保存
   std::vector<csirdr::csi_vec> temp_csi; // 出力データの一時保存
   uint32_t target_mac_add = 0xFFFFFFFF;  // APのMACアドレス
+  csirdr::csi_header frame_header;       // フレーム先頭のヘッダ
+  int64_t frame_timestamp_ns = 0;        // フレーム先頭の受信時刻
+  csirdr::Csi_loss loss(this->n_rx, this->n_tx); // 欠番や欠けたフレームの集計
 
-  while (reader->getNextPacket(raw_packet)) {
+  // パケットの読み出し（計測のため関数化）
+  auto next_packet = [&]() {
+    Stage_timer timer(STAGE_RECEIVE);
+    return reader->getNextPacket(raw_packet);
+  };
+
+  while (next_packet()) {
     // フレーム解析
+    Stage_timer timer_udp(STAGE_UDP_PARSE);
     pcpp::Packet packet(&raw_packet);
     pcpp::UdpLayer *udp_layer = packet.getLayerOfType<pcpp::UdpLayer>();
+    if (udp_layer == NULL) {
+      continue;
+    }
     uint8_t *payload = udp_layer->getLayerPayload();
     int data_len = udp_layer->getDataLen();
-    csirdr::csi_header header = csirdr::get_csi_header(payload);
+    timer_udp.stop();
+
+    Stage_timer timer_header(STAGE_HEADER_PARSE);
+    csirdr::csi_header header =
+        csirdr::get_csi_header(payload, this->new_header);
+    timer_header.stop();
+    loss.on_packet(header);
 
     // 送受信アンテナが0,0の場合は，temp_*を書き込むか消去するか
     // 書き込んだ後はtarget_mac_addの更新
@@ -136,10 +165,19 @@ void Csi_reader::decode(bool rm_guard_pilot) {
       if ((target_mac_add != 0xFFFFFFFF) and
           ((int)temp_csi.size() == this->n_csi_elements)) {
         // 書き込み処理
+        Stage_timer timer(STAGE_OUTPUT_WRITE);
         fs_csi_seq << temp_seq.str() << std::endl;
         csirdr::write_csi(fs_csi_value, temp_csi, this->n_tx, this->n_rx);
+        timer.stop();
+
+        // 処理グラフ
+        if (this->graph != nullptr) {
+          this->push_frame(temp_csi, frame_header, frame_timestamp_ns);
+        }
       }
 
+      Stage_timer timer(STAGE_FRAME_ASSEMBLY);
+
       // temp_*のクリア
       temp_csi.clear();
       temp_seq.str("");
@@ -147,24 +185,23 @@ void Csi_reader::decode(bool rm_guard_pilot) {
 
       // target_mac_addの更新
       target_mac_add = header.tx_mac_add;
+      frame_header = header;
+      frame_timestamp_ns = timespec_to_ns(raw_packet.getPacketTimeStamp());
 
       // シーケンス番号などのデータはこのタイミングで取得
       temp_seq << std::hex << std::setw(4) << std::setfill('0')
                << (target_mac_add & 0x0000FFFF) << "," << std::dec
                << header.seq_num / 16 << "," << header.seq_num % 16 << ","
                << raw_packet.getPacketTimeStamp().tv_sec << "."
+               << std::setw(9) << std::setfill('0')
                << raw_packet.getPacketTimeStamp().tv_nsec;
     }
 
     // CSIデータの読み込み
-    // asusやraspiの分岐はここで行う
-    if (this->device == "asus") {
-      temp_csi.push_back(csirdr::get_csi_from_packet_bcm4366c0(
-          payload, data_len, this->wlan_std, rm_guard_pilot));
-    } else if (this->device == "raspi") {
-      temp_csi.push_back(csirdr::get_csi_from_packet_raspi(
-          payload, data_len, this->wlan_std, rm_guard_pilot));
-    }
+    // asusやraspiのデコード関数はループの前に選択済み
+    csirdr::csi_vec csi(csirdr::cal_number_of_subcarrier(data_len));
+    decode(payload, data_len, this->wlan_std, csi.data(), rm_guard_pilot);
+    temp_csi.push_back(std::move(csi));
   }
 
   reader->close();
@@ -172,5 +209,32 @@ void Csi_reader::decode(bool rm_guard_pilot) {
   // 出力ファイルのクローズ
   fs_csi_seq.close();
   fs_csi_value.close();
+
+  // 損失の集計の出力
+  loss.flush();
+  loss.print_summary(std::cout);
+  std::ofstream fs_csi_loss(csi_loss_path.string());
+  loss.write_summary(fs_csi_loss);
+  fs_csi_loss.close();
+}
+
+void Csi_reader::push_frame(const std::vector<csi_vec> &csi,
+                            const csi_header &header, int64_t timestamp_ns) {
+  Csi_frame_ref ref = this->pool->acquire();
+  Csi_frame *frame = ref.get_mutable();
+  if (frame == nullptr) {
+    return;
+  }
+
+  frame->header = header;
+  frame->seq = header.seq_num / 16;
+  frame->timestamp_ns = timestamp_ns;
+  for (int e = 0; e < (int)csi.size(); e++) {
+    int n_sub = std::min((int)csi[e].size(), FRAME_MAX_SUB);
+    std::copy(csi[e].begin(), csi[e].begin() + n_sub,
+              frame->get_csi_buffer(e));
+    frame->set_element(e, n_sub);
+  }
+  this->graph->push(ref);
 }
 } // namespace csirdr
@@ -27,12 +27,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <filesystem>
 #include <iostream>
+#include <memory>
 #include <stdlib.h>
 #include <unordered_map>
 #include <vector>
 
 #include <Packet.h>
 
+#include "csi_frame.hpp"
+#include "csi_graph.hpp"
 #include "csi_reader_func.hpp"
 
 #ifndef CSI_READER
@@ -69,9 +72,21 @@ public:
    */
   void decode(bool rm_gurd_pilot = true);
 
+  /*
+   * 処理グラフの設定
+   * 書き出したフレームを同じスレッドでグラフに渡す（ワーカー数0で使う）
+   */
+  void set_graph(csirdr::Csi_graph *graph) { this->graph = graph; }
+
 private:
   bool new_header;
   std::string wlan_std;
+
+  // 処理グラフに渡すフレーム
+  csirdr::Csi_graph *graph = nullptr;
+  std::unique_ptr<csirdr::Csi_frame_pool> pool;
+  void push_frame(const std::vector<csirdr::csi_vec> &csi,
+                  const csirdr::csi_header &header, int64_t timestamp_ns);
 };
 } // namespace csirdr
 
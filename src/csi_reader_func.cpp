@@ -25,7 +25,9 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <algorithm>
 #include <bitset>
+#include <cmath>
 #include <complex>
 #include <fstream>
 #include <iomanip>
@@ -40,7 +42,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <PcapFileDevice.h>
 #include <UdpLayer.h>
 
+#include "csi_math.hpp"
 #include "csi_reader_func.hpp"
+#include "csi_stats.hpp"
 
 namespace csirdr {
 
@@ -63,7 +67,7 @@ csi_header get_csi_header(uint8_t *payload, bool new_header) {
    * ヘッダの構造体を返却
    * ヘッダがバージョンによって変わっているので，それに対応する必要がある
    */
-  csi_header header;
+  csi_header header = {0, 0, 0};
 
   if (new_header) {
     // 新しいタイプのヘッダ
@@ -103,6 +107,84 @@ csi_header get_csi_header(uint8_t *payload, bool new_header) {
   return header;
 }
 
+bool get_udp_payload(const uint8_t *frame, int frame_len, int link_type,
+                     int &offset, int &payload_len) {
+  // リンク層のヘッダ長とネットワーク層のプロトコルの取得
+  int pos;
+  uint16_t ether_type;
+  switch (link_type) {
+  case 1: // Ethernet
+    if (frame_len < 14) {
+      return false;
+    }
+    pos = 14;
+    ether_type = (frame[12] << BITS_PER_BYTE) | frame[13];
+    // VLANタグ（802.1Q, 802.1ad）
+    while ((ether_type == 0x8100 or ether_type == 0x88a8) and
+           frame_len >= pos + 4) {
+      ether_type = (frame[pos + 2] << BITS_PER_BYTE) | frame[pos + 3];
+      pos += 4;
+    }
+    break;
+  case 113: // Linux cooked capture
+    if (frame_len < 16) {
+      return false;
+    }
+    pos = 16;
+    ether_type = (frame[14] << BITS_PER_BYTE) | frame[15];
+    break;
+  case 12:
+  case 14:
+  case 101: // Raw IP
+    if (frame_len < 1) {
+      return false;
+    }
+    pos = 0;
+    ether_type = (frame[0] >> 4) == 6 ? 0x86dd : 0x0800;
+    break;
+  case 228: // Raw IPv4
+    pos = 0;
+    ether_type = 0x0800;
+    break;
+  case 229: // Raw IPv6
+    pos = 0;
+    ether_type = 0x86dd;
+    break;
+  default:
+    return false;
+  }
+
+  // IPヘッダ
+  if (ether_type == 0x0800) {
+    if (frame_len < pos + 20 or (frame[pos] >> 4) != 4 or
+        frame[pos + 9] != 17) {
+      return false;
+    }
+    // フラグメントの2つ目以降にはUDPヘッダがない
+    if (((frame[pos + 6] & 0x1F) << BITS_PER_BYTE | frame[pos + 7]) != 0) {
+      return false;
+    }
+    pos += (frame[pos] & 0x0F) * 4;
+  } else if (ether_type == 0x86dd) {
+    // 拡張ヘッダには対応しない
+    if (frame_len < pos + 40 or frame[pos + 6] != 17) {
+      return false;
+    }
+    pos += 40;
+  } else {
+    return false;
+  }
+
+  // UDPヘッダ
+  if (frame_len < pos + 8) {
+    return false;
+  }
+  int udp_len = (frame[pos + 4] << BITS_PER_BYTE) | frame[pos + 5];
+  offset = pos + 8;
+  payload_len = std::min(udp_len - 8, frame_len - offset);
+  return payload_len >= 0;
+}
+
 int cal_number_of_subcarrier(int data_len) {
   if ((data_len - 18) / 4 >= 256) {
     return 256;
@@ -116,46 +198,69 @@ int cal_number_of_subcarrier(int data_len) {
 csi_vec get_csi_from_packet_bcm4366c0(uint8_t *payload, int data_len,
                                       std::string wlan_std,
                                       bool rm_guard_pilot) {
-  uint8_t *csi_data =
+  csi_vec csi(cal_number_of_subcarrier(data_len));
+  decode_csi_bcm4366c0(payload, data_len, wlan_std, csi.data(),
+                       rm_guard_pilot);
+  return csi;
+}
+
+int decode_csi_bcm4366c0(const uint8_t *payload, int data_len,
+                         const std::string &wlan_std, std::complex<float> *csi,
+                         bool rm_guard_pilot) {
+  const uint8_t *csi_data =
       payload +
       CSI_HEADER_OFFSET; //  UDPデータのうち，ヘッダを除いたCSIデータのポインタ
 
   int num_subcarrier = cal_number_of_subcarrier(data_len); // サブキャリア数
 
-  uint32_t csi_data_unit = 0; // 4ByteのCSIデータを一時保存する
-
-  // UDPペイロードから読み出したCSIデータの保存
-  // 実数部，虚数部，指数部をサブキャリアの個数だけ格納する．
-  std::vector<std::vector<int>> csi_data_extracted(num_subcarrier,
-                                                   std::vector<int>(3, 0));
+  // ビットマスクとシフト幅（extract_csi_bcm4366c0()と同じ）
+  const uint32_t mask_exponent_part = (1 << BITS_OF_EXPONENT_PART) - 1;
+  const uint32_t mask_numerics_part = (1 << BITS_OF_NUMERICS_PART) - 1;
+  const int shft_for_real_part =
+      BITS_OF_EXPONENT_PART + BITS_OF_NUMERICS_PART + 1;
+  const int shft_for_imag_part = BITS_OF_EXPONENT_PART;
+  const int shft_for_sigh_real =
+      BITS_OF_EXPONENT_PART + 2 * BITS_OF_NUMERICS_PART + 1;
+  const int shft_for_sigh_imag = BITS_OF_EXPONENT_PART + BITS_OF_NUMERICS_PART;
 
-  // バイナリから，実部・虚部・指数部を取り出す部分
-  // サブキャリア数で繰り返す
-  for (int sub = 0; sub < num_subcarrier; sub++) {
+  {
+    Stage_timer timer(STAGE_CSI_DECODE);
 
-    // CSI1要素が記録されている4バイトを読み出し
-    // リトルエンディアンなのかビッグエンディアンなのか？
-    for (int i = 0; i < BYTE_OF_CSI_DATA_UNIT; i++) {
+    // 実部・虚部・指数部を取り出して，指数部を反映させる
+    // 中間の配列を作らずにサブキャリアごとに直接計算する
+    for (int sub = 0; sub < num_subcarrier; sub++) {
       // リトルエンディアン
-      csi_data_unit = (csi_data_unit << BITS_PER_BYTE) |
-                      csi_data[(3 - i) + sub * BYTE_OF_CSI_DATA_UNIT];
-    }
+      const uint8_t *p = csi_data + sub * BYTE_OF_CSI_DATA_UNIT;
+      uint32_t csi_data_unit = (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                               ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+
+      int real_part =
+          (int)(csi_data_unit >> shft_for_real_part) & mask_numerics_part;
+      int imag_part =
+          (int)(csi_data_unit >> shft_for_imag_part) & mask_numerics_part;
+      int exp_part = (int)csi_data_unit & mask_exponent_part;
+
+      if ((csi_data_unit >> shft_for_sigh_real) & 1U) {
+        real_part = -real_part;
+      }
+      if ((csi_data_unit >> shft_for_sigh_imag) & 1U) {
+        imag_part = -imag_part;
+      }
+      if (exp_part > MAX_EXPONENT_PART) {
+        exp_part = exp_part - (MAX_EXPONENT_PART + 1) * 2;
+      }
 
-    // 専用の抽出関数に投げて出力を得る．
-    // サブキャリア全体のデータを格納する
-    csi_data_extracted[sub] = extract_csi_bcm4366c0(csi_data_unit);
+      // x * 2^e（2のべき乗なのでpow()と同じ値）
+      csi[sub] = std::complex<float>(std::ldexp((float)real_part, exp_part),
+                                     std::ldexp((float)imag_part, exp_part));
+    }
   }
 
-  // 実部・虚部に対して，指数部を反映させて出力を完成させる部分
-  // 関数化して，のちに変更しやすくする
-  // パケット単位でのデコード結果の出力
-  // ファイルへの書き出しは別の関数で実行
-  // 書き出しはパケット単位にしておく
   if (rm_guard_pilot) {
-    return post_process_csi(cal_csi_bcm4366c0(csi_data_extracted), wlan_std);
-  } else {
-    return cal_csi_bcm4366c0(csi_data_extracted);
+    Stage_timer timer(STAGE_POST_PROCESS);
+    post_process_csi(csi, num_subcarrier, wlan_std);
   }
+  return num_subcarrier;
 }
 
 std::vector<int> extract_csi_bcm4366c0(uint32_t csi_data_unit) {
@@ -219,7 +324,15 @@ float float_element_bcm4366c0(int x, int e) { return x * pow(2.0, e); }
 
 csi_vec get_csi_from_packet_raspi(uint8_t *payload, int data_len,
                                   std::string wlan_std, bool rm_guard_pilot) {
-  uint8_t *csi_data =
+  csi_vec csi(cal_number_of_subcarrier(data_len));
+  decode_csi_raspi(payload, data_len, wlan_std, csi.data(), rm_guard_pilot);
+  return csi;
+}
+
+int decode_csi_raspi(const uint8_t *payload, int data_len,
+                     const std::string &wlan_std, std::complex<float> *csi,
+                     bool rm_guard_pilot) {
+  const uint8_t *csi_data =
       payload +
       CSI_HEADER_OFFSET; //  UDPデータのうち，ヘッダを除いたCSIデータのポインタ
 
@@ -227,71 +340,93 @@ csi_vec get_csi_from_packet_raspi(uint8_t *payload, int data_len,
 
   uint32_t csi_data_unit = 0; // 4ByteのCSIデータを一時保存する
 
-  // UDPペイロードから読み出したCSIデータの保存
-  // 実部，虚部をサブキャリアの個数だけ格納する．
-  csi_vec csi_data_extracted(num_subcarrier);
+  {
+    Stage_timer timer(STAGE_CSI_DECODE);
 
-  // バイナリから，実部・虚部を取り出す部分
-  // サブキャリア数で繰り返す
-  for (int sub = 0; sub < num_subcarrier; sub++) {
+    // バイナリから，実部・虚部を取り出す部分
+    // サブキャリア数で繰り返す
+    for (int sub = 0; sub < num_subcarrier; sub++) {
 
-    // CSI1要素が記録されている4バイトを読み出し
-    // リトルエンディアンなのかビッグエンディアンなのか？
-    for (int i = 0; i < BYTE_OF_CSI_DATA_UNIT; i++) {
-      // リトルエンディアン
-      csi_data_unit = (csi_data_unit << BITS_PER_BYTE) |
-                      csi_data[(3 - i) + sub * BYTE_OF_CSI_DATA_UNIT];
-    }
+      // CSI1要素が記録されている4バイトを読み出し
+      // リトルエンディアンなのかビッグエンディアンなのか？
+      for (int i = 0; i < BYTE_OF_CSI_DATA_UNIT; i++) {
+        // リトルエンディアン
+        csi_data_unit = (csi_data_unit << BITS_PER_BYTE) |
+                        csi_data[(3 - i) + sub * BYTE_OF_CSI_DATA_UNIT];
+      }
 
-    // 上位16bitが実部，下位16bitが虚部
-    // その両方が16ビット整数
-    // todo: 正負の確認を実験データから行う
-    int16_t real = (int16_t)((csi_data_unit >> 16) & 0x0000FFFF);
-    int16_t imag = (int16_t)(csi_data_unit & 0x0000FFFF);
-    csi_data_extracted[sub] = std::complex<float>(real, imag);
+      // 上位16bitが実部，下位16bitが虚部
+      // その両方が16ビット整数
+      // todo: 正負の確認を実験データから行う
+      int16_t real = (int16_t)((csi_data_unit >> 16) & 0x0000FFFF);
+      int16_t imag = (int16_t)(csi_data_unit & 0x0000FFFF);
+      csi[sub] = std::complex<float>(real, imag);
+    }
   }
 
   if (rm_guard_pilot) {
-    return post_process_csi(csi_data_extracted, wlan_std);
-  } else {
-    return csi_data_extracted;
+    Stage_timer timer(STAGE_POST_PROCESS);
+    post_process_csi(csi, num_subcarrier, wlan_std);
   }
+  return num_subcarrier;
+}
+
+csi_decode_func get_csi_decoder(const std::string &device) {
+  // デバイス名とデコード関数の対応
+  static const struct {
+    const char *name;
+    csi_decode_func decode;
+  } decoders[] = {
+      {"asus", decode_csi_bcm4366c0},
+      {"bcm4366c0", decode_csi_bcm4366c0},
+      {"raspi", decode_csi_raspi},
+      {"bcm43455c0", decode_csi_raspi},
+  };
+
+  for (auto &d : decoders) {
+    if (device == d.name) {
+      return d.decode;
+    }
+  }
+  std::cerr << "Unknown device: " << device << std::endl;
+  return nullptr;
 }
 
 csi_vec post_process_csi(csi_vec vec, std::string wlan_std) {
+  post_process_csi(vec.data(), (int)vec.size(), wlan_std);
+  return vec;
+}
+
+void post_process_csi(std::complex<float> *csi, int n_sub,
+                      const std::string &wlan_std) {
   // サブキャリア系列の前後半の入れ替え
-  int n_sub = (int)vec.size();
+  // 周波数系列の前半後半を入れ替える
   int n_sub_half = n_sub / 2;
-  int idx_vec;
-  csi_vec ret_vec(n_sub, std::complex<float>(0));
-
-  for (int idx_ret_vec = 0; idx_ret_vec < n_sub; idx_ret_vec++) {
-    // 周波数系列の前半後半を入れ替える
-    idx_vec = (idx_ret_vec + n_sub_half) % n_sub;
-    ret_vec[idx_ret_vec] = vec[idx_vec];
-  }
+  std::rotate(csi, csi + n_sub_half, csi + n_sub);
 
   // ガードバンドとパイロットサブキャリアでの
   // CSIの要素を削除
-  std::vector<int> zero_sub;
+  const std::vector<int> *zero_sub = nullptr;
   if (n_sub == 64 and wlan_std == "ac") {
-    zero_sub = zero_sub_20_ac;
+    zero_sub = &zero_sub_20_ac;
   } else if (n_sub == 128 and wlan_std == "ac") {
-    zero_sub = zero_sub_40_ac;
+    zero_sub = &zero_sub_40_ac;
   } else if (n_sub == 256 and wlan_std == "ac") {
-    zero_sub = zero_sub_80_ac;
+    zero_sub = &zero_sub_80_ac;
   } else if (n_sub == 64 and wlan_std == "ax") {
-    zero_sub = zero_sub_80_ax;
+    zero_sub = &zero_sub_80_ax;
   } else if (n_sub == 128 and wlan_std == "ax") {
-    zero_sub = zero_sub_80_ax;
+    zero_sub = &zero_sub_80_ax;
   } else if (n_sub == 256 and wlan_std == "ax") {
-    zero_sub = zero_sub_80_ax;
+    zero_sub = &zero_sub_80_ax;
+  }
+  if (zero_sub == nullptr) {
+    return;
   }
 
-  for (int i = 0; i < (int)zero_sub.size(); i++) {
-    ret_vec[zero_sub[i]] = std::complex<float>(0., 0.);
+  for (int i = 0; i < (int)zero_sub->size(); i++) {
+    csi[(*zero_sub)[i]] = std::complex<float>(0., 0.);
   }
-  return ret_vec;
 }
 
 void write_csi(std::ofstream &ofs, std::vector<csi_vec> csi, int n_tx, int n_rx,
@@ -308,6 +443,21 @@ void write_csi(std::ofstream &ofs, std::vector<csi_vec> csi, int n_tx, int n_rx,
     temp_ss << label << ',';
   }
 
+  // 振幅・位相は要素ごとに一括で計算しておく
+  std::vector<std::vector<float>> amplitude, phase;
+  if (mode == 2 or mode == 3) {
+    amplitude.resize(csi.size());
+    phase.resize(csi.size());
+    for (int e = 0; e < (int)csi.size(); e++) {
+      amplitude[e].resize(csi[e].size());
+      csi_magnitude(csi[e].data(), amplitude[e].data(), csi[e].size());
+      if (mode == 2) {
+        phase[e].resize(csi[e].size());
+        csi_phase(csi[e].data(), phase[e].data(), csi[e].size());
+      }
+    }
+  }
+
   for (int sub = 0; sub < n_sub; sub++) {
     for (int e = 0; e < n_tx * n_rx; e++) {
       e_idx = (e % n_rx) * n_rx + (e / n_tx); // 要素番号計算
@@ -319,10 +469,10 @@ void write_csi(std::ofstream &ofs, std::vector<csi_vec> csi, int n_tx, int n_rx,
         temp_ss << csi[e_idx][sub].real() << ',' << csi[e_idx][sub].imag()
                 << std::endl;
       } else if (mode == 2) {
-        temp_ss << std::abs(csi[e_idx][sub]) << ',' << std::arg(csi[e_idx][sub])
+        temp_ss << amplitude[e_idx][sub] << ',' << phase[e_idx][sub]
                 << std::endl;
       } else if (mode == 3) {
-        temp_ss << std::abs(csi[e_idx][sub]) << ',';
+        temp_ss << amplitude[e_idx][sub] << ',';
       } else {
         temp_ss << csi[e_idx][sub].real() << ',' << csi[e_idx][sub].imag()
                 << ',';
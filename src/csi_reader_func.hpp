@@ -30,6 +30,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <iomanip>
 #include <iostream>
 #include <stdlib.h>
+#include <time.h>
 #include <vector>
 
 #ifndef CSI_READER_FUNC
@@ -63,6 +64,36 @@ typedef std::vector<std::complex<float>> csi_vec;
  */
 csi_header get_csi_header(uint8_t *payload, bool new_header = false);
 
+/*
+ * 受信時刻（UNIX時間のナノ秒）への変換
+ */
+inline int64_t timespec_to_ns(const timespec &ts) {
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * 現在時刻（CLOCK_REALTIME，ナノ秒）
+ * カーネルの受信時刻と同じ時計
+ */
+inline int64_t realtime_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return timespec_to_ns(ts);
+}
+
+/*
+ * キャプチャしたフレームからUDPペイロードの位置を求める関数
+ * pcpp::Packetを構築せずに，Ethernet(VLAN), Linux SLL, Raw IPの
+ * リンク層とIPv4/IPv6を直接解析する
+ * input: const uint8_t *frame, int frame_len
+ *        int link_type (= raw_packet->getLinkLayerType())
+ * output: int &offset (フレーム先頭からUDPペイロードまでのバイト数)
+ *         int &payload_len (UDPペイロードのバイト数)
+ * return: UDPパケットならtrue
+ */
+bool get_udp_payload(const uint8_t *frame, int frame_len, int link_type,
+                     int &offset, int &payload_len);
+
 /*
  * UDPのペイロードのデータ長（バイト）からCSIのサブキャリア数を計算する関数
  * input: int data_len (= udp_layer->getDataLen())
@@ -81,6 +112,18 @@ csi_vec get_csi_from_packet_bcm4366c0(uint8_t *payload, int data_len,
                                       std::string wlan_std,
                                       bool rm_guard_pilot = true);
 
+/*
+ * bcm4366c0専用のUDPのペイロードからCSIを指定した領域にデコードする関数
+ * メモリ確保を行わない（ライブキャプチャ用）
+ * input: const uint8_t *payload
+ *        int data_len (= udp_layer->getDataLen())
+ * output: std::complex<float> *csi (cal_number_of_subcarrier()個以上の領域)
+ * return: サブキャリア数
+ */
+int decode_csi_bcm4366c0(const uint8_t *payload, int data_len,
+                         const std::string &wlan_std, std::complex<float> *csi,
+                         bool rm_guard_pilot = true);
+
 /*
  * bcm4366c0専用のCSIデータ抽出関数
  * 4バイトのCSI１要素のデータから，実数部，虚数部，指数部を出力
@@ -118,6 +161,33 @@ csi_vec get_csi_from_packet_raspi(uint8_t *payload, int data_len,
                                   std::string wlan_std,
                                   bool rm_guard_pilot = true);
 
+/*
+ * raspi専用のUDPのペイロードからCSIを指定した領域にデコードする関数
+ * メモリ確保を行わない（ライブキャプチャ用）
+ * input: const uint8_t *payload
+ *        int data_len (= udp_layer->getDataLen())
+ * output: std::complex<float> *csi (cal_number_of_subcarrier()個以上の領域)
+ * return: サブキャリア数
+ */
+int decode_csi_raspi(const uint8_t *payload, int data_len,
+                     const std::string &wlan_std, std::complex<float> *csi,
+                     bool rm_guard_pilot = true);
+
+/*
+ * デバイスごとのデコード関数の型（decode_csi_raspi()などと同じ引数）
+ */
+typedef int (*csi_decode_func)(const uint8_t *payload, int data_len,
+                               const std::string &wlan_std,
+                               std::complex<float> *csi, bool rm_guard_pilot);
+
+/*
+ * デバイス名からデコード関数を取得する関数
+ * 起動時に1回だけ呼び出し，パケットごとの分岐をなくす
+ * input: device ("asus", "bcm4366c0", "raspi", "bcm43455c0")
+ * return: デコード関数（未知のデバイスならnullptr）
+ */
+csi_decode_func get_csi_decoder(const std::string &device);
+
 /*
  * サブキャリア系列のCSIデータの処理をする関数
  * 1. サブキャリア系列を前後半で入れ替える
@@ -127,6 +197,13 @@ csi_vec get_csi_from_packet_raspi(uint8_t *payload, int data_len,
  */
 csi_vec post_process_csi(csi_vec vec, std::string wlan_std);
 
+/*
+ * post_process_csi()の配列をその場で書き換える版
+ * input: std::complex<float> *csi, int n_sub
+ */
+void post_process_csi(std::complex<float> *csi, int n_sub,
+                      const std::string &wlan_std);
+
 /*
  * 完全なCSIのサブキャリア系列をofstreamに出力
  * CSV形式で出力
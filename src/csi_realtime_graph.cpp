@@ -25,6 +25,12 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
@@ -32,6 +38,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <sstream>
 #include <stdlib.h>
 #include <string>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
 #include <Packet.h>
@@ -40,19 +49,97 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <SystemUtils.h>
 #include <UdpLayer.h>
 
-#include "csi_capture.hpp"
+#include "csi_frame.hpp"
+#include "csi_math.hpp"
 #include "csi_reader_func.hpp"
 #include "csi_realtime_graph.hpp"
+#include "csi_stats.hpp"
 
 namespace csirdr {
-Csi_plot::Csi_plot(std::string target_mac, int nrx, int ntx, bool new_header,
-                   std::string wlan_std, int skip)
-    : Csi_capture("wlan0", target_mac, nrx, ntx, new_header, wlan_std) {
-  this->skip = skip;
-  this->gnuplot = popen("gnuplot", "w");
+Csi_waterfall::Csi_waterfall(int n_rows) {
+  this->n_rows = n_rows;
+
+  // gnuplotが読むファイル（共有メモリがあればディスクに書かない）
+  std::string dir =
+      std::filesystem::is_directory("/dev/shm") ? "/dev/shm" : "/tmp";
+  this->path =
+      dir + "/nexlive_waterfall_" + std::to_string(getpid()) + ".bin";
+  this->fd = open(this->path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (this->fd < 0) {
+    std::cerr << "Failed to create " << this->path << std::endl;
+  }
+}
+
+Csi_waterfall::~Csi_waterfall() {
+  if (this->rows != nullptr) {
+    munmap(this->rows, this->map_size);
+  }
+  if (this->fd >= 0) {
+    close(this->fd);
+    unlink(this->path.c_str());
+  }
 }
 
-Csi_plot::~Csi_plot() { pclose(this->gnuplot); }
+bool Csi_waterfall::resize(int width) {
+  if (this->rows != nullptr) {
+    munmap(this->rows, this->map_size);
+    this->rows = nullptr;
+  }
+  this->width = 0;
+  this->next = 0;
+
+  // ファイルを作り直して0で埋める
+  size_t size = (size_t)this->n_rows * width * sizeof(float);
+  if (this->fd < 0 or ftruncate(this->fd, 0) < 0 or
+      ftruncate(this->fd, size) < 0) {
+    return false;
+  }
+  void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd,
+                 0);
+  if (p == MAP_FAILED) {
+    std::cerr << "Failed to map " << this->path << std::endl;
+    return false;
+  }
+  this->rows = (float *)p;
+  this->map_size = size;
+  this->width = width;
+  return true;
+}
+
+bool Csi_waterfall::push(const std::vector<float> &values) {
+  if ((int)values.size() != this->width and !this->resize(values.size())) {
+    return false;
+  }
+
+  // 最も古い行だけを上書き（ファイルのページキャッシュに直接書く）
+  std::memcpy(this->rows + (size_t)this->next * this->width, values.data(),
+              this->width * sizeof(float));
+  this->next = (this->next + 1) % this->n_rows;
+  return true;
+}
+
+std::string Csi_waterfall::get_plot_command(double dy) {
+  // 行 next .. n_rows-1 が古い側，行 0 .. next-1 が新しい側
+  std::stringstream ss;
+  int n_old = this->n_rows - this->next;
+  ss << "plot '" << this->path << "' binary array=(" << this->width << ","
+     << n_old << ") skip=" << (size_t)this->next * this->width * sizeof(float)
+     << " format='%float32' dy=" << dy << " origin=(0,0) with image";
+  if (this->next > 0) {
+    ss << ", '" << this->path << "' binary array=(" << this->width << ","
+       << this->next << ") format='%float32' dy=" << dy << " origin=(0,"
+       << n_old * dy << ") with image";
+  }
+  ss << "\n";
+  return ss.str();
+}
+
+Csi_plot::Csi_plot() { this->gnuplot = popen("gnuplot", "w"); }
+
+Csi_plot::~Csi_plot() {
+  this->stop_render();
+  pclose(this->gnuplot);
+}
 
 void Csi_plot::set_graph_opt(int top, int n_sub, std::string graph_type) {
   // gnuplot plot option setting
@@ -68,6 +155,7 @@ void Csi_plot::set_graph_opt(int top, int n_sub, std::string graph_type) {
   fprintf(this->gnuplot, "set lmargin 12\n");
   fprintf(this->gnuplot, "set xlabel \"Subcarrier index\"\n");
 
+  this->top = top;
   if (graph_type == "abs") {
     fprintf(this->gnuplot, "set ylabel \"CSI amplitude\"\n");
     fprintf(this->gnuplot, "set xrange [0:%d]\n", n_sub);
@@ -78,74 +166,356 @@ void Csi_plot::set_graph_opt(int top, int n_sub, std::string graph_type) {
     fprintf(this->gnuplot, "set xrange [0:%d]\n", n_sub);
     fprintf(this->gnuplot, "set yrange [-pi:pi]\n");
     this->graph_type = "phase";
+  } else if (graph_type == "db") {
+    // 振幅の上限をdBにした値を上限とし，下は60 dB分を表示する
+    double db_top = 20 * std::log10(top > 0 ? top : 1);
+    fprintf(this->gnuplot, "set ylabel \"CSI power (dB)\"\n");
+    fprintf(this->gnuplot, "set xrange [0:%d]\n", n_sub);
+    fprintf(this->gnuplot, "set yrange [%f:%f]\n", db_top - 60, db_top);
+    this->graph_type = "power";
   }
   fflush(this->gnuplot);
 }
 
-bool Csi_plot::is_skip() {
-  if (this->skip == 0) {
+bool Csi_plot::set_layout(std::string layout, int n_rx, int n_tx) {
+  if (layout != "panel" and layout != "overlay" and layout != "interleave") {
+    std::cerr << "Unknown plot layout: " << layout << std::endl;
     return false;
   }
+  this->layout = layout;
+  this->n_rx = n_rx;
+  this->n_tx = n_tx;
+  if (n_rx * n_tx <= 1) {
+    return true;
+  }
 
-  this->graph_counter = (this->graph_counter + 1) % (this->skip + 1);
-  return !(this->graph_counter == 1);
+  // 要素ごとに区別できるよう凡例・文字の大きさを変える
+  if (layout == "overlay") {
+    fprintf(this->gnuplot, "set key outside right font \",14\"\n");
+  } else if (layout == "panel") {
+    fprintf(this->gnuplot, "set xlabel font \",10\"\n");
+    fprintf(this->gnuplot, "set ylabel font \",10\"\n");
+    fprintf(this->gnuplot, "set tics font \",10\"\n");
+    fprintf(this->gnuplot, "set title font \",12\"\n");
+    fprintf(this->gnuplot, "set ylabel offset 0,0\n");
+    fprintf(this->gnuplot, "set lmargin 8\n");
+  }
+  fflush(this->gnuplot);
+  return true;
 }
 
-void Csi_plot::csi_app() {
-  // スキップ処理
-  if (this->is_skip()) {
-    this->clear_temp_csi();
+void Csi_plot::set_waterfall(double window_sec, double fps) {
+  if (window_sec <= 0 or fps <= 0) {
     return;
   }
+  int n_rows = (int)(window_sec * fps + 0.5);
+  this->waterfall = std::make_unique<Csi_waterfall>(n_rows);
 
-  // MACアドレスが異なれば終了
-  if (!this->is_target_mac()) {
-    this->clear_temp_csi();
-    return;
+  // 縦軸を時間（上が最新），色を振幅・位相にする
+  fprintf(this->gnuplot, "set ylabel \"Time (s)\"\n");
+  fprintf(this->gnuplot, "set yrange [0:%f]\n", n_rows / fps);
+  fprintf(this->gnuplot, "set cblabel \"CSI %s\"\n",
+          this->graph_type.c_str());
+  if (this->graph_type == "amplitude") {
+    fprintf(this->gnuplot, "set cbrange [0:%d]\n", this->top);
+  } else if (this->graph_type == "power") {
+    double db_top = 20 * std::log10(this->top > 0 ? this->top : 1);
+    fprintf(this->gnuplot, "set cbrange [%f:%f]\n", db_top - 60, db_top);
+  } else {
+    fprintf(this->gnuplot, "set cbrange [-pi:pi]\n");
   }
+  fprintf(this->gnuplot, "set palette rgbformulae 33,13,10\n");
 
-  // CSIの数が足りてなければ終了
-  if (!this->is_full_temp_csi()) {
+  // 要素を横に並べた行になるので，横軸は行の幅に合わせる
+  fprintf(this->gnuplot, "set autoscale xfix\n");
+  fflush(this->gnuplot);
+}
+
+void Csi_plot::set_fps(double fps, std::string mode) {
+  this->fps = fps;
+  this->mean = mode == "mean";
+  if (fps <= 0) {
     return;
   }
+  this->t_publish = std::chrono::steady_clock::now();
+  this->rendering = true;
+  this->render_thread = std::thread(&Csi_plot::render_loop, this);
+}
 
-  // ビーコンフレームなら終了
-  if (this->is_from_beacon()) {
-    this->clear_temp_csi();
+bool Csi_plot::process(Csi_frame_ref &frame) {
+  this->n_frames++;
+
+  // フレームごとに描画
+  if (this->fps <= 0) {
+    this->fill_values(*frame);
+    this->send_values(this->values);
+    return true;
+  }
+
+  if (!this->mean) {
+    // 最新のフレームを置くだけ（描画されなかったフレームは手放す）
+    this->latest.store(frame);
+    return true;
+  }
+
+  // 平均: 表示する値を足し合わせ，描画の間隔ごとに受け渡す
+  this->fill_values(*frame);
+  if (this->sum.size() != this->values.size()) {
+    this->sum.assign(this->values.size(), 0);
+    this->n_sum = 0;
+  }
+  for (size_t i = 0; i < this->values.size(); i++) {
+    this->sum[i] += this->values[i];
+  }
+  this->n_sum++;
+
+  auto now = std::chrono::steady_clock::now();
+  if (now >= this->t_publish) {
+    std::vector<float> &back = this->mean_buf[this->mean_back];
+    back.resize(this->sum.size());
+    for (size_t i = 0; i < this->sum.size(); i++) {
+      back[i] = this->sum[i] / this->n_sum;
+    }
+    this->mean_back =
+        this->mean_middle.exchange(this->mean_back | MEAN_FRESH,
+                                   std::memory_order_acq_rel) &
+        ~MEAN_FRESH;
+    std::fill(this->sum.begin(), this->sum.end(), 0);
+    this->n_sum = 0;
+    this->t_publish =
+        now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                  std::chrono::duration<double>(1.0 / this->fps));
+  }
+  return true;
+}
+
+void Csi_plot::render_loop() {
+  auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(1.0 / this->fps));
+  auto next = std::chrono::steady_clock::now() + period;
+
+  std::unique_lock<std::mutex> lock(this->render_mtx);
+  while (this->rendering) {
+    this->render_cv.wait_until(lock, next, [this] { return !this->rendering; });
+    if (!this->rendering) {
+      break;
+    }
+
+    // 描画が間隔より遅れたら，遅れた分の描画は行わない
+    next += period;
+    auto now = std::chrono::steady_clock::now();
+    if (next < now) {
+      next = now + period;
+    }
+
+    lock.unlock();
+    const std::vector<float> *row = nullptr;
+    if (this->mean) {
+      int middle = this->mean_middle.load(std::memory_order_relaxed);
+      if (middle & MEAN_FRESH) {
+        this->mean_front = this->mean_middle.exchange(
+                               this->mean_front, std::memory_order_acq_rel) &
+                           ~MEAN_FRESH;
+        row = &this->mean_buf[this->mean_front];
+      }
+    } else {
+      Csi_frame_ref frame = this->latest.take();
+      if (frame) {
+        this->fill_values(*frame);
+        row = &this->values;
+      }
+    }
+
+    // ウォーターフォールは時間軸をそろえるため，フレームがなくても
+    // 空の行を追加する（平均の描画ではvaluesを段の処理が書き換えるので，
+    // 描画スレッドだけが使う行を送る）
+    if (row == nullptr and this->waterfall and
+        this->waterfall->get_width() > 0) {
+      this->empty_row.assign(this->waterfall->get_width(), 0);
+      row = &this->empty_row;
+    }
+    if (row != nullptr) {
+      this->send_values(*row);
+    }
+    lock.lock();
+  }
+}
+
+void Csi_plot::fill_values(const Csi_frame &frame) {
+  // グラフに図示するデータ（フレームに保存された振幅・位相を参照）
+  // dBはフレームに保存しないので，要素ごとに一時領域で計算する
+  int n_elements = frame.get_n_elements();
+  int n_sub = frame.get_n_sub();
+  auto get_data = [&](int e) -> const float * {
+    if (this->graph_type == "amplitude") {
+      return frame.get_amplitude(e);
+    } else if (this->graph_type == "power") {
+      this->db_buf.resize(FRAME_MAX_SUB);
+      csi_db(frame.get_csi(e), this->db_buf.data(), n_sub);
+      return this->db_buf.data();
+    }
+    return frame.get_phase(e);
+  };
+  this->values.resize(n_elements * n_sub);
+  if (this->layout == "interleave") {
+    // 要素はサブキャリアごとに並べ，配列の添字をx座標にする
+    for (int e = 0; e < n_elements; e++) {
+      const float *data = get_data(e);
+      for (int sub = 0; sub < n_sub; sub++) {
+        this->values[e + n_elements * sub] = data[sub];
+      }
+    }
     return;
   }
 
-  // グラフに図示するデータを取得
-  std::vector<float> data = this->get_temp_csi_series(this->get_graph_type());
+  // 要素ごとに連続に並べる（要素ごとの配列をそのまま送れる）
+  for (int e = 0; e < n_elements; e++) {
+    const float *data = get_data(e);
+    std::memcpy(this->values.data() + e * n_sub, data, n_sub * sizeof(float));
+  }
+}
+
+void Csi_plot::send_values(const std::vector<float> &values) {
+  auto t0 = std::chrono::steady_clock::now();
+  if (this->n_rendered.load(std::memory_order_relaxed) == 0) {
+    this->t_first = t0;
+  }
 
   // gnuplotで処理
-  fprintf(this->gnuplot, "plot \'-\' ls 1 with lines\n");
-  for (int i = 0; i < (int)data.size(); i++) {
-    fprintf(this->gnuplot, "%d\t%f\n", i, data[i]);
+  {
+    Stage_timer timer(STAGE_OUTPUT_WRITE);
+    if (this->waterfall) {
+      // 1行を書き込み，gnuplotにはファイルを読み直すコマンドだけを送る
+      this->waterfall->push(values);
+      std::string cmd = this->waterfall->get_plot_command(1.0 / this->fps);
+      fwrite(cmd.data(), 1, cmd.size(), this->gnuplot);
+      fflush(this->gnuplot);
+    } else {
+      this->send_lines(values);
+    }
   }
-  fprintf(this->gnuplot, "e\n");
+
+  this->n_rendered.fetch_add(1, std::memory_order_relaxed);
+  this->write_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - t0)
+                        .count();
+}
+
+void Csi_plot::send_lines(const std::vector<float> &values) {
+  // 全要素のコマンドとデータを1つのバッファにまとめる（容量は使い回す）
+  // gnuplotは'-'ごとに，コマンドの後に続くデータを順に読む
+  int n_elements = this->n_rx * this->n_tx;
+  if (this->layout == "interleave" or n_elements <= 0 or
+      values.size() % n_elements != 0) {
+    n_elements = 1;
+  }
+  int n = (int)values.size() / n_elements;
+  bool panel = this->layout == "panel" and n_elements > 1;
+  bool overlay = this->layout == "overlay" and n_elements > 1;
+
+  char cmd[256];
+  this->send_buf.clear();
+  if (panel) {
+    snprintf(cmd, sizeof(cmd), "set multiplot layout %d,%d\n", this->n_tx,
+             this->n_rx);
+    this->append_text(cmd);
+  }
+  for (int e = 0; e < n_elements; e++) {
+    int core = e % this->n_rx;
+    int stream = e / this->n_rx;
+    if (panel) {
+      snprintf(cmd, sizeof(cmd), "set title \"core %d, nss %d\"\n", core,
+               stream);
+      this->append_text(cmd);
+    }
+    this->append_text(e > 0 and overlay ? ", " : "plot ");
+    this->append_text("'-'");
+    if (this->binary) {
+      snprintf(cmd, sizeof(cmd), " binary array=(%d) format='%%float32'", n);
+      this->append_text(cmd);
+    }
+    if (overlay) {
+      snprintf(cmd, sizeof(cmd),
+               " lw 2 lc %d with lines title \"core %d, nss %d\"", e + 1,
+               core, stream);
+      this->append_text(cmd);
+    } else {
+      this->append_text(" ls 1 with lines");
+    }
+    if (!overlay) {
+      this->append_text("\n");
+      this->append_data(values.data() + e * n, n);
+    }
+  }
+  if (overlay) {
+    this->append_text("\n");
+    for (int e = 0; e < n_elements; e++) {
+      this->append_data(values.data() + e * n, n);
+    }
+  }
+  if (panel) {
+    this->append_text("unset multiplot\n");
+  }
+
+  fwrite(this->send_buf.data(), 1, this->send_buf.size(), this->gnuplot);
   fflush(this->gnuplot);
+}
 
-  this->clear_temp_csi();
+void Csi_plot::append_text(const char *text) {
+  this->send_buf.insert(this->send_buf.end(), text, text + strlen(text));
 }
 
-void Csi_plot::on_packet_arrives(pcpp::RawPacket *raw_packet,
-                                 pcpp::PcapLiveDevice *dev, void *cookie){
-  pcpp::Packet parsed_packet(raw_packet);
-  if (!parsed_packet.isPacketOfType(pcpp::UDP))
+void Csi_plot::append_data(const float *data, int n) {
+  if (this->binary) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    this->send_buf.insert(this->send_buf.end(), bytes,
+                          bytes + n * sizeof(float));
     return;
+  }
+  char line[64];
+  for (int i = 0; i < n; i++) {
+    snprintf(line, sizeof(line), "%d\t%f\n", i, data[i]);
+    this->append_text(line);
+  }
+  this->append_text("e\n");
+}
 
-  Csi_plot *cap = (Csi_plot *)cookie;
+void Csi_plot::stop_render() {
+  if (this->render_thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(this->render_mtx);
+      this->rendering = false;
+    }
+    this->render_cv.notify_all();
+    this->render_thread.join();
+  }
+}
 
-  // デコードしてクラスのメンバ変数にCSIを一時保存
-  cap->load_packet(parsed_packet);
+void Csi_plot::flush() {
+  this->stop_render();
+  this->latest.take(); // 描画されなかったフレームをプールに戻す
 
-  // MACアドレスの表示
-  std::cout << "\rtarget MAC address: " << cap->get_target_mac_add()
-            << ", this CSI MAC address: " << cap->get_temp_mac_add();
+  uint64_t n_rendered = this->n_rendered.load(std::memory_order_relaxed);
+  if (n_rendered == 0) {
+    return;
+  }
 
-  // アプリケーション
-  cap->csi_app();
+  // 書き込みはgnuplotが読み終わるまで待つので，1フレームの書き込み時間から
+  // 描画できる最大のフレームレートを見積もる
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - this->t_first)
+                       .count();
+  double write_us = this->write_ns / 1000.0 / n_rendered;
+  std::cout << "Plot ("
+            << (this->waterfall ? "waterfall"
+                                : (this->binary ? "binary" : "text"))
+            << ", "
+            << (this->fps > 0 ? (this->mean ? "mean" : "latest") : "every")
+            << "): " << this->n_frames << " frames, " << n_rendered
+            << " rendered, " << std::fixed << std::setprecision(1)
+            << n_rendered / elapsed << " fps, write " << write_us
+            << " us/frame (max " << 1e6 / write_us << " fps)"
+            << std::defaultfloat << std::endl;
 }
 
 } // namespace csirdr
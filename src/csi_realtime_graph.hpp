@@ -25,40 +25,160 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <stdlib.h>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
-#include <Packet.h>
-#include <PcapLiveDeviceList.h>
-
-#include "csi_capture.hpp"
+#include "csi_frame.hpp"
+#include "csi_graph.hpp"
 #include "csi_reader_func.hpp"
 
 #ifndef CSI_REALTIME_PLOT
 #define CSI_REALTIME_PLOT
 
+#define PLOT_FPS 30 // 描画のフレームレートの既定値
+
 namespace csirdr {
-class Csi_plot : public Csi_capture {
+
+/*
+ * ウォーターフォール表示（時間 x サブキャリア）の2次元リングバッファ
+ * 共有メモリ上のファイルをmmapして確保し，1行ずつ上書きする
+ * gnuplotはファイルを直接読むので，パイプで送るのはコマンドのみ
+ */
+class Csi_waterfall {
+private:
+  std::string path;
+  int fd = -1;
+  float *rows = nullptr; // n_rows x width（mmapしたファイル）
+  size_t map_size = 0;
+  int n_rows;
+  int width = 0;
+  int next = 0; // 次に書き込む行（最も古い行）
+
+  // 幅の変更（内容は消去）
+  bool resize(int width);
+
+public:
+  Csi_waterfall(int n_rows);
+  ~Csi_waterfall();
+
+  /*
+   * 1行の書き込み（最も古い行を上書き）
+   * 幅が変わったら全体を消去する
+   */
+  bool push(const std::vector<float> &values);
+
+  /*
+   * 最も古い行を下，最新の行を上に並べて描画するgnuplotのコマンド
+   * リングの継ぎ目で2つの画像に分けて描く
+   * input: dy (1行の時間)
+   */
+  std::string get_plot_command(double dy);
+
+  int get_width() { return this->width; }
+};
+
+/*
+ * gnuplotによるリアルタイムのグラフ表示
+ * 処理グラフの出力（シンク）の段として使う
+ * 描画は専用のスレッドが一定のフレームレートで行い，その間に届いた
+ * フレームのうち最新のもの（または平均）だけを描画する
+ * 段の処理はフレームを受け渡し場所に置くだけで，描画を待たない
+ * ウォーターフォール表示では描画のたびに1行を追加する
+ * 段の指定: "plot"
+ */
+class Csi_plot : public Csi_stage {
 private:
   // gnuplotのパイプ
   FILE *gnuplot;
 
   std::string graph_type;
-  int skip;
-  int graph_counter = 0;
+
+  /*
+   * gnuplotへのデータの送り方
+   * binary: float32の配列をインラインのバイナリで送る（既定）
+   * text:   1点ずつ文字列にして送る（比較用）
+   * どちらも全要素のコマンドとデータをまとめたバッファを1回のfwriteで書く
+   */
+  bool binary = true;
+
+  /*
+   * 複数の要素（stream * n_rx + core）の並べ方
+   * panel:      要素ごとにmultiplotのパネルに描く（既定）
+   * overlay:    1つのグラフに要素ごとの色で重ねて描く
+   * interleave: 全要素をサブキャリアごとに並べた1本の線で描く
+   * interleave以外では表示する値を要素ごとに連続に並べる
+   */
+  std::string layout = "panel";
+  int n_rx = 1;
+  int n_tx = 1;
+  std::vector<float> values;     // 表示する値（x座標の順）
+  std::vector<float> db_buf;     // 1要素のdB（フレームに保存しない）
+  std::vector<uint8_t> send_buf; // コマンドとデータ（使い回す）
+  std::vector<float> empty_row;  // フレームがない間の行（描画スレッドのみ）
+
+  /*
+   * 描画スレッド
+   * fpsが0なら段の処理の中でフレームごとに描画する
+   */
+  double fps = 0;
+  bool mean = false; // 間隔内のフレームの平均を描画
+  std::thread render_thread;
+  std::mutex render_mtx; // 描画スレッドの停止の通知のみ
+  std::condition_variable render_cv;
+  bool rendering = false;
+
+  // 最新のフレーム（latest）
+  Csi_frame_slot latest;
+
+  // 間隔内の平均（mean）
+  // 段の処理で足し合わせ，間隔ごとに平均をトリプルバッファで受け渡す
+  std::vector<float> sum;
+  int n_sum = 0;
+  std::chrono::steady_clock::time_point t_publish;
+  std::vector<float> mean_buf[3];
+  std::atomic<int> mean_middle{1}; // 受け渡し中のバッファ（MEAN_FRESHは未読）
+  int mean_back = 0;               // 段の処理が書き込むバッファ
+  int mean_front = 2;              // 描画スレッドが読むバッファ
+  static constexpr int MEAN_FRESH = 4;
+
+  // ウォーターフォール表示（nullptrなら現在のフレームのみ）
+  std::unique_ptr<Csi_waterfall> waterfall;
+  int top = 0; // 振幅の表示の上限
+
+  // 描画速度の計測
+  uint64_t n_frames = 0;              // 受け取ったフレーム数
+  std::atomic<uint64_t> n_rendered{0}; // 描画したフレーム数
+  int64_t write_ns = 0; // gnuplotへの書き込みにかかった時間の合計
+  std::chrono::steady_clock::time_point t_first;
+
+  void render_loop();
+  void stop_render();
+
+  // フレームから表示する値を求める
+  void fill_values(const Csi_frame &frame);
+
+  // 表示する値の描画
+  void send_values(const std::vector<float> &values);
+  void send_lines(const std::vector<float> &values);
+  void append_text(const char *text);
+  void append_data(const float *data, int n);
 
 public:
   /*
    * コンストラクタ
-   * ファイルパスの保存と，MACアドレスの保存を実行
+   * gnuplotを起動する
    */
-  Csi_plot(std::string target_mac, int nrx = 1, int ntx = 1,
-           bool new_header = true, std::string wlan_std = "11ac",
-            int skip = 0);
+  Csi_plot();
 
   ~Csi_plot(); // ディストラクタ
 
@@ -68,26 +188,51 @@ public:
   void set_graph_opt(int top, int num_sub, std::string graph_type);
 
   /*
-   * パケットキャプチャコールバック関数
-   * 静的メンバ関数
+   * 複数の要素の並べ方の設定（"panel"，"overlay"，"interleave"）
+   * input: n_rx (コア数), n_tx (空間ストリーム数)
    */
-  static void on_packet_arrives(pcpp::RawPacket *raw_packet,
-                                pcpp::PcapLiveDevice *dev, void *cookie);
+  bool set_layout(std::string layout, int n_rx, int n_tx);
+
   /*
-   * グラフアプリケーション
+   * データの送り方の設定（"binary" または "text"）
    */
-  void csi_app() override;
+  void set_transfer(std::string transfer) {
+    this->binary = transfer != "text";
+  }
 
   /*
-   * グラフタイプの出力
+   * ウォーターフォール表示の設定（set_fps()の前に呼び出す）
+   * 描画のたびに1行を追加し，直近window_sec秒を時間 x サブキャリアの
+   * ヒートマップで表示する（1行は描画の間隔）
    */
-  std::string get_graph_type() { return this->graph_type; }
+  void set_waterfall(double window_sec, double fps);
 
   /*
-   * スキップの判定
+   * 描画のフレームレートの設定と描画スレッドの開始
+   * （set_graph_opt()の後に呼び出す）
+   * input: fps (0ならフレームごとに描画)
+   *        mode ("latest": 最新のフレーム，"mean": 間隔内の平均)
    */
-  bool is_skip();
+  void set_fps(double fps, std::string mode = "latest");
+
+  std::string get_name() override { return "plot"; }
+
+  /*
+   * フレームのグラフ表示
+   */
+  bool process(Csi_frame_ref &frame) override;
+
+  /*
+   * 描画スレッドの停止と，描画したフレーム数と速度の出力
+   */
+  void flush() override;
+
+  /*
+   * グラフタイプの出力
+   */
+  std::string get_graph_type() { return this->graph_type; }
 };
+
 } // namespace csirdr
 
 #endif /* end of include guard */
@@ -0,0 +1,87 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <complex>
+#include <cstring>
+#include <stdlib.h>
+
+#include "csi_frame.hpp"
+#include "csi_record.hpp"
+
+namespace csirdr {
+
+size_t get_record_size(const Csi_frame &frame) {
+  return sizeof(csi_record_header) + (size_t)frame.get_n_elements() *
+                                         frame.get_n_sub() *
+                                         sizeof(std::complex<float>);
+}
+
+csi_record_header make_record_header(const Csi_frame &frame) {
+  csi_record_header h;
+  std::memset(&h, 0, sizeof(h));
+  h.magic = CSI_RECORD_MAGIC;
+  h.version = CSI_RECORD_VERSION;
+  h.header_len = sizeof(csi_record_header);
+  h.record_len = (uint32_t)get_record_size(frame);
+  h.seq = frame.seq;
+  h.iface = (uint16_t)frame.iface;
+  h.timestamp_ns = frame.timestamp_ns;
+  h.tx_mac_add = frame.header.tx_mac_add;
+  h.n_elements = (uint16_t)frame.get_n_elements();
+  h.n_sub = (uint16_t)frame.get_n_sub();
+  return h;
+}
+
+size_t encode_frame_record(const Csi_frame &frame, uint8_t *buf) {
+  csi_record_header h = make_record_header(frame);
+  std::memcpy(buf, &h, sizeof(h));
+
+  // フレームの要素はFRAME_MAX_SUB間隔なので，n_sub個ずつ詰めて書く
+  size_t pos = sizeof(h);
+  size_t n_bytes = frame.get_n_sub() * sizeof(std::complex<float>);
+  for (int e = 0; e < frame.get_n_elements(); e++) {
+    std::memcpy(buf + pos, frame.get_csi(e), n_bytes);
+    pos += n_bytes;
+  }
+  return pos;
+}
+
+bool check_record_header(const uint8_t *buf, size_t len) {
+  if (len < sizeof(csi_record_header)) {
+    return false;
+  }
+  csi_record_header h;
+  std::memcpy(&h, buf, sizeof(h));
+  if (h.magic != CSI_RECORD_MAGIC or h.version != CSI_RECORD_VERSION or
+      h.header_len != sizeof(csi_record_header)) {
+    return false;
+  }
+  size_t n_data = (size_t)h.n_elements * h.n_sub * sizeof(std::complex<float>);
+  return h.record_len == h.header_len + n_data and h.record_len <= len;
+}
+
+} // namespace csirdr
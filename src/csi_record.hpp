@@ -0,0 +1,90 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string>
+
+#include "csi_frame.hpp"
+
+#ifndef CSI_RECORD
+#define CSI_RECORD
+
+#define CSI_RECORD_MAGIC 0x52495343 // "CSIR"（リトルエンディアン）
+#define CSI_RECORD_VERSION 1
+
+namespace csirdr {
+
+/*
+ * デコード済みフレームのバイナリ形式のレコードヘッダ
+ * 記録ファイル，ストリーミング，共有メモリで共通に使う
+ * ヘッダの後にCSI（std::complex<float>，n_elements * n_sub個）が
+ * 要素（stream * n_rx + core）の順に続く
+ * 値はすべてホストのバイト順（リトルエンディアン）
+ */
+typedef struct {
+  uint32_t magic;        // CSI_RECORD_MAGIC
+  uint16_t version;      // CSI_RECORD_VERSION
+  uint16_t header_len;   // レコードヘッダのバイト数
+  uint32_t record_len;   // ヘッダを含むレコード全体のバイト数
+  uint16_t seq;          // シーケンス番号
+  uint16_t iface;        // 受信したインターフェイスの番号
+  int64_t timestamp_ns;  // 受信時刻（UNIX時間のナノ秒）
+  uint64_t tx_mac_add;   // 送信元MACアドレス
+  uint16_t n_elements;   // CSI行列の要素数
+  uint16_t n_sub;        // 要素ごとのサブキャリア数
+  uint32_t reserved;
+} csi_record_header;
+
+static_assert(sizeof(csi_record_header) == 40, "csi_record_header layout");
+
+/*
+ * フレームのレコードのバイト数
+ */
+size_t get_record_size(const Csi_frame &frame);
+
+/*
+ * フレームのレコードヘッダの作成
+ */
+csi_record_header make_record_header(const Csi_frame &frame);
+
+/*
+ * フレームをレコードに書き出す関数
+ * input: frame, uint8_t *buf (get_record_size()バイト以上の領域)
+ * return: 書き出したバイト数
+ */
+size_t encode_frame_record(const Csi_frame &frame, uint8_t *buf);
+
+/*
+ * レコードヘッダの検証
+ * input: buf, len (読み出し可能なバイト数)
+ * return: ヘッダが正しくlenバイトにレコード全体が入っていればtrue
+ */
+bool check_record_header(const uint8_t *buf, size_t len);
+
+} // namespace csirdr
+
+#endif /* end of include guard */
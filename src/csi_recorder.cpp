@@ -0,0 +1,437 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cerrno>
+#include <chrono>
+#include <complex>
+#include <cstring>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "csi_frame.hpp"
+#include "csi_record.hpp"
+#include "csi_recorder.hpp"
+
+namespace csirdr {
+
+Csi_file_writer::Csi_file_writer(std::string prefix, std::string ext,
+                                 uint64_t rotate_bytes, int rotate_sec) {
+  this->prefix = prefix;
+  this->ext = ext;
+  this->rotate_bytes = rotate_bytes;
+  this->rotate_sec = rotate_sec;
+}
+
+Csi_file_writer::~Csi_file_writer() {
+  this->stop();
+  for (int i = 0; i < 2; i++) {
+    free(this->buffers[i]);
+  }
+}
+
+bool Csi_file_writer::start() {
+  // ページ境界にそろえた大きなバッファ（書き出しは1面ずつまとめて行う）
+  for (int i = 0; i < 2; i++) {
+    void *p = nullptr;
+    if (this->buffers[i] == nullptr and
+        posix_memalign(&p, RECORD_BUFFER_ALIGN, RECORD_BUFFER_SIZE) != 0) {
+      std::cerr << "Failed to allocate record buffer" << std::endl;
+      return false;
+    }
+    if (p != nullptr) {
+      this->buffers[i] = (uint8_t *)p;
+    }
+    this->lengths[i] = 0;
+  }
+  this->active = 0;
+  this->flushing = -1;
+
+#ifdef HAVE_LIBURING
+  this->use_uring = io_uring_queue_init(4, &this->ring, 0) == 0;
+  if (!this->use_uring) {
+    std::cerr << "io_uring is not available, falling back to write()"
+              << std::endl;
+  }
+#endif
+
+  if (!this->open_next()) {
+    return false;
+  }
+
+  this->queued_bytes = this->file_header.size();
+  this->running = true;
+  this->t_swap = std::chrono::steady_clock::now();
+  this->io_thread = std::thread(&Csi_file_writer::io_loop, this);
+  return true;
+}
+
+void Csi_file_writer::stop() {
+  {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    if (!this->running) {
+      return;
+    }
+    this->running = false;
+  }
+  this->cv.notify_one();
+  this->io_thread.join();
+  this->close_file();
+
+#ifdef HAVE_LIBURING
+  if (this->use_uring) {
+    io_uring_queue_exit(&this->ring);
+    this->use_uring = false;
+  }
+#endif
+}
+
+bool Csi_file_writer::write(const struct iovec *iov, int iovcnt) {
+  size_t n = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    n += iov[i].iov_len;
+  }
+
+  std::unique_lock<std::mutex> lock(this->mtx);
+  if (!this->running) {
+    return false;
+  }
+  if (n > RECORD_BUFFER_SIZE) {
+    this->n_dropped++;
+    return false;
+  }
+
+  // 大きさによるローテーションはレコードの境界でバッファを区切り，
+  // 次のバッファの書き出し前にファイルを切り替える
+  bool rotate = this->rotate_bytes > 0 and
+                this->queued_bytes > this->file_header.size() and
+                this->queued_bytes + n > this->rotate_bytes;
+
+  // 満杯ならバッファを入れ替えてI/Oスレッドに渡す
+  // 前のバッファがまだ書き出し中なら待たずに破棄する
+  if ((rotate and this->lengths[this->active] > 0) or
+      this->lengths[this->active] + n > RECORD_BUFFER_SIZE) {
+    if (this->flushing >= 0) {
+      this->n_dropped++;
+      return false;
+    }
+    this->flushing = this->active;
+    this->active ^= 1;
+    this->t_swap = std::chrono::steady_clock::now();
+    this->cv.notify_one();
+  }
+  if (rotate) {
+    this->rotate_before[this->active] = true;
+    this->queued_bytes = this->file_header.size();
+  }
+
+  uint8_t *dst = this->buffers[this->active] + this->lengths[this->active];
+  for (int i = 0; i < iovcnt; i++) {
+    std::memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+    dst += iov[i].iov_len;
+  }
+  this->lengths[this->active] += n;
+  this->queued_bytes += n;
+  this->n_records++;
+  return true;
+}
+
+void Csi_file_writer::io_loop() {
+  std::unique_lock<std::mutex> lock(this->mtx);
+  while (true) {
+    this->cv.wait_for(lock, std::chrono::milliseconds(RECORD_FLUSH_MS), [&] {
+      return this->flushing >= 0 or !this->running;
+    });
+
+    if (this->flushing < 0) {
+      // 一定時間ごと，および停止時は満杯でないバッファも書き出す
+      auto now = std::chrono::steady_clock::now();
+      bool timeout =
+          now - this->t_swap >= std::chrono::milliseconds(RECORD_FLUSH_MS);
+      if (this->lengths[this->active] > 0 and (timeout or !this->running)) {
+        this->flushing = this->active;
+        this->active ^= 1;
+        this->t_swap = now;
+      } else if (!this->running) {
+        break;
+      } else {
+        continue;
+      }
+    }
+
+    // 書き出しの間は書き込み側がもう一方のバッファを使う
+    int idx = this->flushing;
+    size_t len = this->lengths[idx];
+    bool over_size = this->rotate_before[idx];
+    this->rotate_before[idx] = false;
+
+    // ローテーションはバッファの境界で行うので，レコードは分割されない
+    // 時間による切り替えは，以降の書き込みを新しいファイルの分として数える
+    auto now = std::chrono::steady_clock::now();
+    bool over_time =
+        this->rotate_sec > 0 and
+        now - this->t_open >= std::chrono::seconds(this->rotate_sec) and
+        this->file_bytes > this->file_header.size();
+    if (over_time and !over_size) {
+      this->queued_bytes =
+          this->file_header.size() + len + this->lengths[this->active];
+    }
+    lock.unlock();
+
+    if (over_size or over_time) {
+      this->close_file();
+      this->open_next();
+    }
+    if (this->fd < 0 or !this->write_all(this->buffers[idx], len)) {
+      this->n_errors++;
+    }
+
+    lock.lock();
+    this->lengths[idx] = 0;
+    this->flushing = -1;
+  }
+}
+
+bool Csi_file_writer::open_next() {
+  std::stringstream ss;
+  ss << this->prefix;
+  if (this->rotate_bytes > 0 or this->rotate_sec > 0) {
+    ss << "_" << std::setw(3) << std::setfill('0') << this->n_files;
+  }
+  ss << this->ext;
+
+  this->fd = ::open(ss.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (this->fd < 0) {
+    std::cerr << "Failed to open " << ss.str() << ": " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+  this->n_files++;
+  this->file_bytes = 0;
+  this->t_open = std::chrono::steady_clock::now();
+
+  if (this->file_header.size() > 0 and
+      !this->write_all(this->file_header.data(), this->file_header.size())) {
+    return false;
+  }
+  return true;
+}
+
+void Csi_file_writer::close_file() {
+  if (this->fd >= 0) {
+    ::close(this->fd);
+    this->fd = -1;
+  }
+}
+
+bool Csi_file_writer::write_all(const uint8_t *data, size_t len) {
+  while (len > 0) {
+    ssize_t res;
+    int err; // 失敗したときのエラー番号
+#ifdef HAVE_LIBURING
+    if (this->use_uring) {
+      struct io_uring_sqe *sqe = io_uring_get_sqe(&this->ring);
+      io_uring_prep_write(sqe, this->fd, data, len, this->file_bytes);
+      io_uring_submit(&this->ring);
+      struct io_uring_cqe *cqe;
+      if (io_uring_wait_cqe(&this->ring, &cqe) < 0) {
+        return false;
+      }
+      res = cqe->res;
+      io_uring_cqe_seen(&this->ring, cqe);
+      if (res == -EINTR) {
+        continue;
+      }
+      err = res < 0 ? (int)-res : EIO; // io_uringは負のエラー番号を返す
+    } else
+#endif
+    {
+      res = ::write(this->fd, data, len);
+      if (res < 0 and errno == EINTR) {
+        continue;
+      }
+      err = res < 0 ? errno : EIO;
+    }
+    if (res <= 0) {
+      std::cerr << "Failed to write record: " << strerror(err) << std::endl;
+      return false;
+    }
+    data += res;
+    len -= res;
+    this->file_bytes += res;
+    this->n_bytes += res;
+  }
+  return true;
+}
+
+void Csi_file_writer::print_summary(std::ostream &os) {
+  os << "  " << this->prefix << "*" << this->ext << ": " << this->n_records
+     << " records, " << this->n_bytes << " bytes, " << this->n_files
+     << " files, " << this->n_dropped << " dropped, " << this->n_errors
+     << " write errors" << std::endl;
+}
+
+Csi_recorder::Csi_recorder(std::string prefix, uint64_t rotate_bytes,
+                           int rotate_sec, bool record_raw, bool record_frames)
+    : raw(prefix, ".pcap", rotate_bytes, rotate_sec),
+      frames(prefix, ".csi", rotate_bytes, rotate_sec) {
+  this->record_raw = record_raw;
+  this->record_frames = record_frames;
+
+  // pcapのグローバルヘッダ（ナノ秒精度，リンク層なし）
+  uint32_t magic = PCAP_MAGIC_NSEC;
+  uint16_t version[2] = {2, 4};
+  int32_t thiszone = 0;
+  uint32_t sigfigs = 0;
+  uint32_t snaplen = PCAP_SNAPLEN;
+  uint32_t linktype = PCAP_LINKTYPE_RAW;
+  std::vector<uint8_t> header(24);
+  std::memcpy(header.data(), &magic, 4);
+  std::memcpy(header.data() + 4, version, 4);
+  std::memcpy(header.data() + 8, &thiszone, 4);
+  std::memcpy(header.data() + 12, &sigfigs, 4);
+  std::memcpy(header.data() + 16, &snaplen, 4);
+  std::memcpy(header.data() + 20, &linktype, 4);
+  this->raw.set_file_header(header);
+}
+
+bool Csi_recorder::start() {
+  if (this->record_raw and !this->raw.start()) {
+    return false;
+  }
+  if (this->record_frames and !this->frames.start()) {
+    return false;
+  }
+  return true;
+}
+
+void Csi_recorder::stop() {
+  this->raw.stop();
+  this->frames.stop();
+}
+
+void Csi_recorder::write_packet(const uint8_t *payload, int data_len,
+                                int64_t timestamp_ns) {
+  if (!this->record_raw) {
+    return;
+  }
+
+  // pcapのレコードヘッダとIPv4/UDPヘッダ（ネットワークのバイト順）
+  uint8_t hdr[16 + 20 + 8];
+  uint32_t ts[2] = {(uint32_t)(timestamp_ns / 1000000000),
+                    (uint32_t)(timestamp_ns % 1000000000)};
+  uint32_t caplen[2] = {(uint32_t)(28 + data_len), (uint32_t)(28 + data_len)};
+  std::memcpy(hdr, ts, 8);
+  std::memcpy(hdr + 8, caplen, 8);
+
+  uint8_t *ip = hdr + 16;
+  int ip_len = 28 + data_len;
+  ip[0] = 0x45; // IPv4，ヘッダ長20バイト
+  ip[1] = 0;
+  ip[2] = ip_len >> 8;
+  ip[3] = ip_len & 0xFF;
+  ip[4] = this->ip_id >> 8;
+  ip[5] = this->ip_id & 0xFF;
+  ip[6] = 0;
+  ip[7] = 0;
+  ip[8] = 64; // TTL
+  ip[9] = 17; // UDP
+  ip[10] = 0;
+  ip[11] = 0;
+  for (int i = 0; i < 4; i++) {
+    ip[12 + i] = (RECORD_SRC_ADDR >> (24 - 8 * i)) & 0xFF;
+    ip[16 + i] = 0xFF; // ブロードキャスト
+  }
+  uint32_t sum = 0;
+  for (int i = 0; i < 20; i += 2) {
+    sum += (ip[i] << 8) | ip[i + 1];
+  }
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  ip[10] = (~sum >> 8) & 0xFF;
+  ip[11] = ~sum & 0xFF;
+  this->ip_id++;
+
+  uint8_t *udp = ip + 20;
+  int udp_len = 8 + data_len;
+  udp[0] = this->port >> 8;
+  udp[1] = this->port & 0xFF;
+  udp[2] = this->port >> 8;
+  udp[3] = this->port & 0xFF;
+  udp[4] = udp_len >> 8;
+  udp[5] = udp_len & 0xFF;
+  udp[6] = 0; // チェックサムなし
+  udp[7] = 0;
+
+  struct iovec iov[2];
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = (void *)payload;
+  iov[1].iov_len = data_len;
+  this->raw.write(iov, 2);
+}
+
+void Csi_recorder::write_frame(const Csi_frame &frame) {
+  if (!this->record_frames) {
+    return;
+  }
+
+  // ヘッダと要素ごとのCSIをまとめて1つのレコードとして書き込む
+  csi_record_header h = make_record_header(frame);
+  struct iovec iov[1 + 64]; // 要素数はmaskのビット数（64）以下
+  int n = 0;
+  iov[n].iov_base = &h;
+  iov[n].iov_len = sizeof(h);
+  n++;
+  size_t n_bytes = frame.get_n_sub() * sizeof(std::complex<float>);
+  for (int e = 0; e < frame.get_n_elements(); e++) {
+    iov[n].iov_base = (void *)frame.get_csi(e);
+    iov[n].iov_len = n_bytes;
+    n++;
+  }
+  this->frames.write(iov, n);
+}
+
+void Csi_recorder::print_summary(std::ostream &os) {
+  os << "Recorder:" << std::endl;
+  if (this->record_raw) {
+    this->raw.print_summary(os);
+  }
+  if (this->record_frames) {
+    this->frames.print_summary(os);
+  }
+}
+
+} // namespace csirdr
@@ -0,0 +1,222 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <stdlib.h>
+#include <string>
+#include <sys/uio.h>
+#include <thread>
+#include <vector>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "csi_frame.hpp"
+#include "csi_graph.hpp"
+#include "csi_record.hpp"
+
+#ifndef CSI_RECORDER
+#define CSI_RECORDER
+
+#define RECORD_BUFFER_SIZE (4 << 20) // 書き込みバッファ1面のバイト数
+#define RECORD_BUFFER_ALIGN 4096     // バッファのアラインメント
+#define RECORD_FLUSH_MS 1000         // 満杯でないバッファを書き出す間隔
+#define PCAP_MAGIC_NSEC 0xa1b23c4d   // ナノ秒精度のpcap
+#define PCAP_LINKTYPE_RAW 101        // リンク層なし（IPv4から始まる）
+#define PCAP_SNAPLEN 65535
+#define RECORD_SRC_ADDR 0x0a0a0a0a // Nexmonの送信元（10.10.10.10）
+#define RECORD_UDP_PORT 5500       // 既定のUDPポート（NEXMON_CSI_PORT）
+
+namespace csirdr {
+
+/*
+ * 専用のI/Oスレッドでファイルに書き込むライタ
+ * 2面のバッファの一方に書き込み，満杯になったら入れ替えて
+ * もう一方をI/Oスレッドが書き出す（liburingがあればio_uringを使う）
+ * I/Oが追いつかず両方のバッファが埋まった場合は，書き込み側を
+ * 待たせずにレコードを破棄して集計する
+ * 大きさまたは時間でファイルを切り替える（ローテーション）
+ */
+class Csi_file_writer {
+private:
+  std::string prefix;  // ファイル名（拡張子を除く）
+  std::string ext;     // 拡張子
+  uint64_t rotate_bytes = 0; // 0ならローテーションしない
+  int rotate_sec = 0;        // 0ならローテーションしない
+  std::vector<uint8_t> file_header; // ファイルごとに先頭に書き出す
+
+  // 2面のバッファ
+  uint8_t *buffers[2] = {nullptr, nullptr};
+  size_t lengths[2] = {0, 0};
+  int active = 0;   // 書き込み中のバッファ
+  int flushing = -1; // I/Oスレッドが書き出すバッファ（負ならなし）
+  bool rotate_before[2] = {false, false}; // 書き出す前にファイルを切り替える
+  uint64_t queued_bytes = 0; // 現在のファイルに書き込む予定のバイト数
+  std::chrono::steady_clock::time_point t_swap;
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::thread io_thread;
+  bool running = false;
+
+  // 出力中のファイル
+  int fd = -1;
+  int n_files = 0;
+  uint64_t file_bytes = 0;
+  std::chrono::steady_clock::time_point t_open;
+#ifdef HAVE_LIBURING
+  struct io_uring ring;
+  bool use_uring = false;
+#endif
+
+  // 集計
+  std::atomic<uint64_t> n_records{0};
+  std::atomic<uint64_t> n_dropped{0};
+  std::atomic<uint64_t> n_bytes{0};
+  std::atomic<uint64_t> n_errors{0};
+
+  void io_loop();
+
+  // ファイルのオープン（ローテーションごと）
+  bool open_next();
+  void close_file();
+
+  // バッファ全体の書き出し
+  bool write_all(const uint8_t *data, size_t len);
+
+public:
+  /*
+   * コンストラクタ
+   * input: prefix (ファイル名，ローテーションする場合は "_000" などが付く)
+   *        ext (拡張子，".pcap" など)
+   *        rotate_bytes, rotate_sec (0ならローテーションしない)
+   */
+  Csi_file_writer(std::string prefix, std::string ext,
+                  uint64_t rotate_bytes = 0, int rotate_sec = 0);
+  ~Csi_file_writer();
+
+  /*
+   * ファイルごとの先頭のデータ（pcapのグローバルヘッダなど）
+   */
+  void set_file_header(std::vector<uint8_t> header) {
+    this->file_header = header;
+  }
+
+  /*
+   * 最初のファイルのオープンとI/Oスレッドの開始
+   */
+  bool start();
+
+  /*
+   * 残りのバッファを書き出してI/Oスレッドを停止
+   */
+  void stop();
+
+  /*
+   * 1つのレコードの書き込み（任意のスレッドから呼び出してよい）
+   * バッファにコピーするだけで，ディスクへの書き込みは待たない
+   * return: バッファに空きがなく破棄した場合false
+   */
+  bool write(const struct iovec *iov, int iovcnt);
+
+  void print_summary(std::ostream &os);
+};
+
+/*
+ * ライブキャプチャの記録
+ * 生のCSIパケットをpcapに，デコード済みのフレームをバイナリ形式
+ * （csi_record.hpp）に，それぞれ別のI/Oスレッドで書き出す
+ * pcapはUDPペイロードにIPv4/UDPヘッダを付けたLINKTYPE_RAWで，
+ * nexdecodeでそのまま読み込める
+ */
+class Csi_recorder {
+private:
+  Csi_file_writer raw;
+  Csi_file_writer frames;
+  bool record_raw;
+  bool record_frames;
+
+  int port = RECORD_UDP_PORT; // pcapに書くUDPポート
+  uint16_t ip_id = 0;
+
+public:
+  /*
+   * コンストラクタ
+   * input: prefix (出力先，"<prefix>.pcap" と "<prefix>.csi" に書き出す)
+   *        rotate_bytes, rotate_sec (0ならローテーションしない)
+   *        record_raw, record_frames (それぞれの記録の有無)
+   */
+  Csi_recorder(std::string prefix, uint64_t rotate_bytes = 0,
+               int rotate_sec = 0, bool record_raw = true,
+               bool record_frames = true);
+
+  /*
+   * pcapに書くUDPポート（キャプチャのポートと合わせる）
+   */
+  void set_port(int port) { this->port = port; }
+
+  bool start();
+  void stop();
+
+  /*
+   * 生のパケットの記録（処理スレッドから呼び出す）
+   */
+  void write_packet(const uint8_t *payload, int data_len, int64_t timestamp_ns);
+
+  /*
+   * デコード済みフレームの記録
+   */
+  void write_frame(const Csi_frame &frame);
+
+  void print_summary(std::ostream &os);
+};
+
+/*
+ * デコード済みフレームを記録する段（後段にはそのまま渡す）
+ * 段の指定: "record"
+ */
+class Record_stage : public Csi_stage {
+private:
+  Csi_recorder *recorder;
+
+public:
+  Record_stage(Csi_recorder *recorder) { this->recorder = recorder; }
+  std::string get_name() override { return "record"; }
+  bool process(Csi_frame_ref &frame) override {
+    this->recorder->write_frame(*frame);
+    return true;
+  }
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
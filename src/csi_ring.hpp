@@ -0,0 +1,168 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <atomic>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+#ifndef CSI_RING
+#define CSI_RING
+
+#define CSI_MAX_PAYLOAD 2048 // リングに保存するUDPペイロードの最大長
+#define CACHE_LINE_SIZE 64
+
+namespace csirdr {
+
+/*
+ * リングに保存する受信パケット
+ * UDPペイロードと受信時刻のみをコピーする
+ */
+typedef struct {
+  int64_t timestamp_ns; // 受信時刻（UNIX時間のナノ秒）
+  int data_len;
+  uint8_t payload[CSI_MAX_PAYLOAD];
+} csi_packet;
+
+/*
+ * 1プロデューサ・1コンシューマのロックフリーリングバッファ
+ * 要素はコンストラクタで確保し，以降はメモリ確保を行わない
+ * 書き込み: slot = begin_push(); (slotに書き込む) commit_push();
+ * 読み出し: slot = front(); (slotを読む) pop();
+ */
+template <typename T> class Spsc_ring {
+private:
+  std::vector<T> buf;
+  size_t mask;
+
+  // 書き込み位置（プロデューサのみ更新）
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> head{0};
+  size_t cached_tail = 0; // プロデューサが最後に読んだtail
+
+  // 読み出し位置（コンシューマのみ更新）
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail{0};
+  size_t cached_head = 0; // コンシューマが最後に読んだhead
+
+  // 統計
+  // high_waterはプロデューサ側で概算するので実際の値以上になることがある
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> n_overflow{0};
+  std::atomic<size_t> high_water{0};
+
+public:
+  /*
+   * capacityは2のべき乗に切り上げる
+   */
+  explicit Spsc_ring(size_t capacity) {
+    size_t cap = 1;
+    while (cap < capacity) {
+      cap <<= 1;
+    }
+    this->buf.resize(cap);
+    this->mask = cap - 1;
+  }
+
+  /*
+   * 書き込み先の要素を取得
+   * 満杯ならnullptrを返してオーバーフローを数える
+   */
+  T *begin_push() {
+    size_t h = this->head.load(std::memory_order_relaxed);
+    if (h - this->cached_tail > this->mask) {
+      this->cached_tail = this->tail.load(std::memory_order_acquire);
+      if (h - this->cached_tail > this->mask) {
+        this->n_overflow.store(
+            this->n_overflow.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+        return nullptr;
+      }
+    }
+    return &this->buf[h & this->mask];
+  }
+
+  /*
+   * begin_push()で取得した要素の書き込み完了
+   */
+  void commit_push() {
+    size_t h = this->head.load(std::memory_order_relaxed) + 1;
+    this->head.store(h, std::memory_order_release);
+
+    size_t occupancy = h - this->cached_tail;
+    if (occupancy > this->high_water.load(std::memory_order_relaxed)) {
+      this->high_water.store(occupancy, std::memory_order_relaxed);
+    }
+  }
+
+  /*
+   * 先頭の要素を取得，空ならnullptr
+   */
+  T *front() {
+    size_t t = this->tail.load(std::memory_order_relaxed);
+    if (t == this->cached_head) {
+      this->cached_head = this->head.load(std::memory_order_acquire);
+      if (t == this->cached_head) {
+        return nullptr;
+      }
+    }
+    return &this->buf[t & this->mask];
+  }
+
+  /*
+   * 先頭の要素の読み出し完了
+   */
+  void pop() {
+    this->tail.store(this->tail.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_release);
+  }
+
+  /*
+   * 現在の要素数（他スレッドから呼び出してよい）
+   */
+  size_t size() const {
+    return this->head.load(std::memory_order_acquire) -
+           this->tail.load(std::memory_order_acquire);
+  }
+
+  size_t capacity() const { return this->mask + 1; }
+
+  /*
+   * 満杯で書き込めなかった回数
+   */
+  uint64_t get_overflow() const {
+    return this->n_overflow.load(std::memory_order_relaxed);
+  }
+
+  /*
+   * 要素数の最大値
+   */
+  size_t get_high_water() const {
+    return this->high_water.load(std::memory_order_relaxed);
+  }
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
@@ -0,0 +1,112 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cmath>
+#include <complex>
+#include <iostream>
+#include <memory>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "csi_frame.hpp"
+#include "csi_math.hpp"
+#include "csi_sanitize.hpp"
+
+namespace csirdr {
+
+Phase_sanitizer::Phase_sanitizer() {
+  this->power.resize(FRAME_MAX_SUB);
+  this->phase.resize(FRAME_MAX_SUB);
+  this->x.resize(FRAME_MAX_SUB);
+  this->y.resize(FRAME_MAX_SUB);
+}
+
+bool Phase_sanitizer::process(Csi_frame_ref &frame) {
+  if (!this->pool) {
+    this->pool = std::make_unique<Csi_frame_pool>(frame->get_n_elements());
+  }
+  Csi_frame_ref out = this->pool->clone(*frame, true, false);
+  Csi_frame *dst = out.get_mutable();
+  if (dst == nullptr) {
+    this->n_exhausted++;
+    return false;
+  }
+
+  int n_sub = frame->get_n_sub();
+  int n_elements = std::min(frame->get_n_elements(), dst->get_n_elements());
+  float slope, offset;
+  for (int e = 0; e < n_elements; e++) {
+    this->sanitize(frame->get_csi(e), n_sub, dst->get_csi_buffer(e),
+                   dst->get_phase_buffer(e), slope, offset);
+  }
+  dst->set_phase_ready();
+
+  // 後段には補正したフレームを渡す
+  frame = std::move(out);
+  return true;
+}
+
+void Phase_sanitizer::sanitize(const std::complex<float> *csi, int n,
+                               std::complex<float> *out_csi, float *out_phase,
+                               float &slope, float &offset) {
+  n = std::min(n, FRAME_MAX_SUB);
+  csi_power(csi, this->power.data(), n);
+  csi_phase_fast(csi, this->phase.data(), n);
+
+  // 0にしたサブキャリアを除いて詰める（分岐せずに書き込み，有効なら進める）
+  float *x = this->x.data();
+  float *y = this->y.data();
+  int m = 0;
+  for (int k = 0; k < n; k++) {
+    x[m] = (float)k;
+    y[m] = this->phase[k];
+    m += this->power[k] > 0;
+  }
+
+  // アンラップと，サブキャリア番号に対する傾き・切片
+  csi_unwrap(y, m);
+  csi_linear_fit(x, y, m, slope, offset);
+
+  // 補正した位相（0のサブキャリアは0）
+  std::fill(out_phase, out_phase + n, 0.0f);
+  for (int j = 0; j < m; j++) {
+    out_phase[(int)x[j]] = y[j] - slope * x[j] - offset;
+  }
+
+  // CSIの回転 e^{-i(slope k + offset)}
+  csi_rotate(csi, out_csi, n, slope, offset);
+}
+
+void Phase_sanitizer::flush() {
+  if (this->n_exhausted > 0) {
+    std::cerr << "sanitize: " << this->n_exhausted
+              << " frames dropped (pool exhausted)" << std::endl;
+  }
+}
+
+} // namespace csirdr
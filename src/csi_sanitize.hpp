@@ -0,0 +1,79 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <memory>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "csi_frame.hpp"
+#include "csi_graph.hpp"
+
+#ifndef CSI_SANITIZE
+#define CSI_SANITIZE
+
+namespace csirdr {
+
+/*
+ * 位相の補正（アンラップと線形成分の除去）
+ * 0にしたサブキャリア（ガード，パイロット，DC）を除いて位相をアンラップし，
+ * サブキャリア番号に対する傾き（STO）と切片（CFO）を最小二乗法で求めて引く
+ * 出力は複製したフレームで，CSIは e^{-i(ak+b)} で回転し，位相には
+ * アンラップしたまま補正した値を設定する（0のサブキャリアは0）
+ * 段の指定: "sanitize"
+ */
+class Phase_sanitizer : public Csi_stage {
+private:
+  std::unique_ptr<Csi_frame_pool> pool; // 最初のフレームの要素数で確保
+  uint64_t n_exhausted = 0;             // プールが空で破棄したフレーム数
+
+  // 1要素分の作業領域（FRAME_MAX_SUB個ずつ確保済み）
+  std::vector<float> power;
+  std::vector<float> phase;
+  std::vector<float> x;       // 有効なサブキャリアの番号
+  std::vector<float> y;       // 有効なサブキャリアの位相
+
+public:
+  Phase_sanitizer();
+  std::string get_name() override { return "sanitize"; }
+  bool process(Csi_frame_ref &frame) override;
+  void flush() override;
+
+  /*
+   * 1要素の補正
+   * input: csi (n個), n
+   * output: out_csi (n個，回転したCSI), out_phase (n個，補正した位相)
+   *         slope, offset (除去した傾きと切片)
+   */
+  void sanitize(const std::complex<float> *csi, int n,
+                std::complex<float> *out_csi, float *out_phase, float &slope,
+                float &offset);
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
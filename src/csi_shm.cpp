@@ -0,0 +1,148 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <atomic>
+#include <cerrno>
+#include <complex>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdlib.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "csi_frame.hpp"
+#include "csi_record.hpp"
+#include "csi_shm.hpp"
+
+namespace csirdr {
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "shared memory needs lock-free 64-bit atomics");
+
+Csi_shm_ring::Csi_shm_ring(std::string name, int n_elements, int n_slots) {
+  this->name = name;
+  this->n_elements = n_elements;
+  this->n_slots = n_slots;
+
+  // 最大のフレームが入る大きさをキャッシュラインの単位に切り上げる
+  size_t n_data =
+      (size_t)n_elements * FRAME_MAX_SUB * sizeof(std::complex<float>);
+  size_t size = CSI_SHM_SLOT_HEADER + sizeof(csi_record_header) + n_data;
+  this->slot_size =
+      (size + CSI_SHM_SLOT_ALIGN - 1) / CSI_SHM_SLOT_ALIGN * CSI_SHM_SLOT_ALIGN;
+  this->map_size = CSI_SHM_HEADER_SIZE + this->slot_size * n_slots;
+}
+
+Csi_shm_ring::~Csi_shm_ring() { this->close(); }
+
+bool Csi_shm_ring::open() {
+  int fd = shm_open(this->name.c_str(), O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    std::cerr << "Failed to open shared memory " << this->name << ": "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+  if (ftruncate(fd, this->map_size) < 0) {
+    std::cerr << "Failed to resize shared memory " << this->name << ": "
+              << strerror(errno) << std::endl;
+    ::close(fd);
+    return false;
+  }
+  void *p = mmap(nullptr, this->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    std::cerr << "Failed to map shared memory " << this->name << ": "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+  this->base = (uint8_t *)p;
+  this->header = (csi_shm_header *)p;
+
+  // 前回の内容が残っていても読まれないようにseqを消してからヘッダを書く
+  std::memset(this->base, 0, this->map_size);
+  this->header->version = CSI_SHM_VERSION;
+  this->header->header_len = CSI_SHM_HEADER_SIZE;
+  this->header->n_slots = this->n_slots;
+  this->header->slot_size = this->slot_size;
+  this->header->n_elements = this->n_elements;
+  this->header->max_sub = FRAME_MAX_SUB;
+  at(&this->header->write_index)->store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  this->header->magic = CSI_SHM_MAGIC;
+
+  std::cout << "Shared memory ring: " << this->name << " (" << this->n_slots
+            << " slots x " << this->slot_size << " bytes)" << std::endl;
+  return true;
+}
+
+void Csi_shm_ring::close() {
+  if (this->base == nullptr) {
+    return;
+  }
+  munmap(this->base, this->map_size);
+  shm_unlink(this->name.c_str());
+  this->base = nullptr;
+  this->header = nullptr;
+}
+
+void Csi_shm_ring::publish(const Csi_frame &frame) {
+  if (this->base == nullptr) {
+    return;
+  }
+  this->n_frames++;
+  if (frame.get_n_elements() > this->n_elements) {
+    this->n_too_large++;
+    return;
+  }
+
+  uint64_t index = this->next_index++;
+  uint8_t *slot = this->base + CSI_SHM_HEADER_SIZE +
+                  (index % this->n_slots) * this->slot_size;
+
+  // seqlock: 書き込み中は奇数にして，読み出し側に読み直させる
+  at(slot)->store(2 * index + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  at(slot + 8)->store(index, std::memory_order_relaxed);
+  encode_frame_record(frame, slot + CSI_SHM_SLOT_HEADER);
+  at(slot)->store(2 * index + 2, std::memory_order_release);
+
+  at(&this->header->write_index)->store(index + 1, std::memory_order_release);
+}
+
+void Csi_shm_ring::print_summary(std::ostream &os) {
+  os << "Shared memory " << this->name << ": " << this->n_frames
+     << " frames";
+  if (this->n_too_large > 0) {
+    os << ", " << this->n_too_large << " too large for slots";
+  }
+  os << std::endl;
+}
+
+} // namespace csirdr
@@ -0,0 +1,152 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <atomic>
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <stdlib.h>
+#include <string>
+
+#include "csi_frame.hpp"
+#include "csi_graph.hpp"
+#include "csi_record.hpp"
+
+#ifndef CSI_SHM
+#define CSI_SHM
+
+#define CSI_SHM_MAGIC 0x4d495343 // "CSIM"（リトルエンディアン）
+#define CSI_SHM_VERSION 1
+#define CSI_SHM_HEADER_SIZE 4096 // 共有メモリの先頭のヘッダ領域
+#define CSI_SHM_SLOT_HEADER 16   // スロットの先頭（seq，index）
+#define CSI_SHM_SLOT_ALIGN 64    // スロットの大きさの単位（キャッシュライン）
+#define SHM_SLOTS 1024           // 既定のスロット数
+
+namespace csirdr {
+
+/*
+ * 共有メモリのリングのヘッダ（先頭CSI_SHM_HEADER_SIZEバイトに置く）
+ *
+ * 配置（値はすべてリトルエンディアン）
+ *   [0, 4096)                     csi_shm_header
+ *   [4096 + i * slot_size, ...)   スロットi（i = 0 .. n_slots - 1）
+ * スロット
+ *   +0   uint64_t seq    書き込み中は奇数，書き込み後は 2 * index + 2
+ *   +8   uint64_t index  フレームの通し番号
+ *   +16  csi_record_header と CSI（csi_record.hpp）
+ *
+ * 書き込みは1プロセスのみ（seqlock）
+ * 通し番号indexのフレームはスロット index % n_slots に書き込み，
+ * 書き込み後にwrite_indexを index + 1 にする
+ * 読み出し側は write_index から最新のN個のindexを求め，
+ * スロットのseqが 2 * index + 2 であることを読む前後で確認する
+ * （読んでいる間に上書きされたらseqが変わるので読み直すか捨てる）
+ * 後の確認は読み終えた後に行う，つまりコピーしてから確認する
+ * コピーせずにスロットをその場で使う場合は，使い終わってから確認し，
+ * seqが変わっていたらその結果を捨てる
+ */
+typedef struct {
+  uint32_t magic;       // CSI_SHM_MAGIC
+  uint16_t version;     // CSI_SHM_VERSION
+  uint16_t header_len;  // スロット領域の開始位置（CSI_SHM_HEADER_SIZE）
+  uint32_t n_slots;     // スロット数
+  uint32_t slot_size;   // スロットのバイト数
+  uint32_t n_elements;  // CSI行列の要素数
+  uint32_t max_sub;     // 要素ごとのサブキャリア数の上限
+  uint64_t write_index; // 次に書き込む通し番号（書き込み済みのフレーム数）
+} csi_shm_header;
+
+static_assert(offsetof(csi_shm_header, write_index) == 24,
+              "csi_shm_header layout");
+
+/*
+ * POSIX共有メモリのリングへのフレームの書き出し
+ * 他のプロセスは共有メモリをmmapするだけで，コピーなしに最新のフレームを読める
+ */
+class Csi_shm_ring {
+private:
+  std::string name; // shm_open()の名前（"/nexmon_csi" など）
+  int n_slots;
+  int n_elements;
+  size_t slot_size;
+  size_t map_size;
+
+  uint8_t *base = nullptr;
+  csi_shm_header *header = nullptr;
+  uint64_t next_index = 0;
+
+  uint64_t n_frames = 0;
+  uint64_t n_too_large = 0; // スロットに入らないフレーム
+
+  // 共有メモリ上の64ビット値（プロセス間で使えるロックフリーのatomic）
+  static std::atomic<uint64_t> *at(void *p) {
+    return reinterpret_cast<std::atomic<uint64_t> *>(p);
+  }
+
+public:
+  Csi_shm_ring(std::string name, int n_elements, int n_slots = SHM_SLOTS);
+  ~Csi_shm_ring();
+
+  /*
+   * 共有メモリの作成とヘッダの初期化
+   */
+  bool open();
+
+  /*
+   * 共有メモリの削除
+   */
+  void close();
+
+  /*
+   * フレームの書き込み（1つのスレッドから呼び出す）
+   */
+  void publish(const Csi_frame &frame);
+
+  void print_summary(std::ostream &os);
+};
+
+/*
+ * デコード済みフレームを共有メモリに書き出す段（後段にはそのまま渡す）
+ * 段の指定: "shm:/nexmon_csi" または "shm:/nexmon_csi:スロット数"
+ */
+class Shm_stage : public Csi_stage {
+private:
+  std::unique_ptr<Csi_shm_ring> ring;
+
+public:
+  Shm_stage(std::unique_ptr<Csi_shm_ring> ring) : ring(std::move(ring)) {}
+  std::string get_name() override { return "shm"; }
+  bool process(Csi_frame_ref &frame) override {
+    this->ring->publish(*frame);
+    return true;
+  }
+  void flush() override { this->ring->print_summary(std::cout); }
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
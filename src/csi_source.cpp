@@ -0,0 +1,238 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <PcapLiveDeviceList.h>
+
+#include "csi_packet_mmap.hpp"
+#include "csi_reader_func.hpp"
+#include "csi_source.hpp"
+#include "csi_stats.hpp"
+
+namespace csirdr {
+
+Csi_source::Csi_source(int index, std::string interface, std::string backend,
+                       int ring_size, int fanout_group, int cpu)
+    : ring(ring_size) {
+  this->index = index;
+  this->interface = interface;
+  this->backend = backend;
+  this->fanout_group = fanout_group;
+  this->cpu = cpu;
+
+  this->dev = pcpp::PcapLiveDeviceList::getInstance().getPcapLiveDeviceByName(
+      this->interface);
+  if (this->dev == NULL) {
+    std::cerr << "Cannot find interface: " << this->interface << std::endl;
+  }
+}
+
+Csi_source::~Csi_source() {
+  this->stop();
+  if (this->dev != NULL) {
+    this->dev->close();
+  }
+}
+
+bool Csi_source::open(std::string filter) {
+  if (this->backend == "mmap") {
+    this->mm = std::make_unique<Csi_packet_mmap>(this->interface,
+                                                 this->fanout_group);
+    this->mm->set_hw_timestamp(this->hw_timestamp);
+    return this->mm->open(filter);
+  }
+
+  if (this->dev == NULL) {
+    return false;
+  }
+  if (this->hw_timestamp) {
+    std::cerr << "Hardware timestamps are only available with mmap backend"
+              << std::endl;
+  }
+
+  // パケットがなくても定期的に戻るようにタイムアウトを設定
+  pcpp::PcapLiveDevice::DeviceConfiguration config;
+  config.packetBufferTimeoutMs = PCAP_BUFFER_TIMEOUT_MS;
+  if (!this->dev->open(config)) {
+    std::cerr << "Cannot open devie: " << this->interface << std::endl;
+    return false;
+  }
+  if (!this->dev->setFilter(filter)) {
+    std::cerr << "Cannot set BPF filter: " << filter << std::endl;
+  }
+  return true;
+}
+
+void Csi_source::print_info(std::ostream &os) {
+  if (this->dev == NULL) {
+    return;
+  }
+  os << "Interface info [" << this->index << "]:" << std::endl
+     << "   Interface name:        " << this->dev->getName()
+     << std::endl // get interface name
+     << "   Interface description: " << this->dev->getDesc()
+     << std::endl // get interface description
+     << "   MAC address:           " << this->dev->getMacAddress()
+     << std::endl // get interface MAC address
+     << "   Default gateway:       " << this->dev->getDefaultGateway()
+     << std::endl // get default gateway
+     << "   Interface MTU:         " << this->dev->getMtu()
+     << std::endl; // get interface MTU
+}
+
+void Csi_source::start(uint32_t time_sec) {
+  this->running = true;
+  this->th = std::thread(&Csi_source::capture_loop, this, time_sec);
+}
+
+void Csi_source::stop() {
+  this->running = false;
+  if (this->th.joinable()) {
+    this->th.join();
+  }
+}
+
+void Csi_source::capture_loop(uint32_t time_sec) {
+  // コアへの固定
+  if (this->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(this->cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+      std::cerr << "Cannot pin " << this->interface << " to cpu " << this->cpu
+                << std::endl;
+    }
+  }
+  if (stats_enabled) {
+    Csi_stats::set_thread_name("capture " + this->interface);
+  }
+
+  if (this->backend != "mmap") {
+    // 測定時間が過ぎるか，stop()のあとにパケットが届くまで戻らない
+    this->dev->startCaptureBlockingMode(this->on_packet_arrives, this,
+                                        time_sec);
+    return;
+  }
+
+  // mmapはブロックごとにリングへコピー
+  std::vector<csi_packet_view> views;
+  views.reserve(MMAP_BLOCK_SIZE /
+                (CSI_HEADER_OFFSET + 64 * BYTE_OF_CSI_DATA_UNIT));
+  while (this->running.load(std::memory_order_relaxed)) {
+    if (!this->mm->next_block(MMAP_BLOCK_TIMEOUT_MS, views)) {
+      continue;
+    }
+    for (auto &v : views) {
+      csi_packet *slot = this->ring.begin_push();
+      if (slot == nullptr) {
+        continue;
+      }
+      slot->timestamp_ns = v.timestamp_ns;
+      slot->data_len = std::min(v.data_len, CSI_MAX_PAYLOAD);
+      std::memcpy(slot->payload, v.payload, slot->data_len);
+      this->ring.commit_push();
+    }
+    this->n_packets.fetch_add(views.size(), std::memory_order_relaxed);
+    this->mm->release_block();
+  }
+}
+
+bool Csi_source::on_packet_arrives(pcpp::RawPacket *raw_packet,
+                                   pcpp::PcapLiveDevice *dev, void *cookie) {
+  Csi_source *src = (Csi_source *)cookie;
+  src->push_packet(raw_packet->getRawData(), raw_packet->getRawDataLen(),
+                   raw_packet->getLinkLayerType(),
+                   timespec_to_ns(raw_packet->getPacketTimeStamp()));
+  return !src->running.load(std::memory_order_relaxed);
+}
+
+void Csi_source::push_packet(const uint8_t *frame, int frame_len,
+                             int link_type, int64_t timestamp_ns) {
+  Stage_timer timer(STAGE_RECEIVE);
+
+  // UDPペイロードの位置の取得
+  // CSIの最小サイズ（64サブキャリア）に満たないものは破棄
+  Stage_timer timer_udp(STAGE_UDP_PARSE);
+  int offset, payload_len;
+  if (!get_udp_payload(frame, frame_len, link_type, offset, payload_len) or
+      payload_len < CSI_HEADER_OFFSET + 64 * BYTE_OF_CSI_DATA_UNIT) {
+    return;
+  }
+  timer_udp.stop();
+  this->n_packets.store(this->n_packets.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+
+  // リングにコピー（満杯なら破棄）
+  csi_packet *slot = this->ring.begin_push();
+  if (slot == nullptr) {
+    return;
+  }
+  slot->timestamp_ns = timestamp_ns;
+  slot->data_len = std::min(payload_len, CSI_MAX_PAYLOAD);
+  std::memcpy(slot->payload, frame + offset, slot->data_len);
+  this->ring.commit_push();
+}
+
+void Csi_source::update_statistics() {
+  if (this->mm) {
+    uint64_t packets, drops;
+    this->mm->get_statistics(packets, drops);
+    this->kernel_recv.store(packets, std::memory_order_relaxed);
+    this->kernel_drop.store(drops, std::memory_order_relaxed);
+  } else if (this->dev != NULL) {
+    pcpp::IPcapDevice::PcapStats stats;
+    this->dev->getStatistics(stats);
+    this->kernel_recv.store(stats.packetsRecv, std::memory_order_relaxed);
+    this->kernel_drop.store(stats.packetsDrop, std::memory_order_relaxed);
+    this->kernel_ifdrop.store(stats.packetsDropByInterface,
+                              std::memory_order_relaxed);
+  }
+}
+
+void Csi_source::print_summary(std::ostream &os) {
+  os << "   [" << this->index << "] " << this->interface << " ("
+     << this->backend << "): packets " << this->get_n_packets()
+     << ", kernel recv " << this->get_kernel_recv() << ", kernel drop "
+     << this->get_kernel_drop() << ", if drop " << this->get_kernel_ifdrop()
+     << ", ring high water " << this->ring.get_high_water() << "/"
+     << this->ring.capacity() << ", overflow " << this->ring.get_overflow();
+  if (this->hw_timestamp and this->mm) {
+    os << ", hw timestamps " << this->mm->get_n_hw_timestamps();
+  }
+  os << std::endl;
+}
+
+} // namespace csirdr
@@ -0,0 +1,158 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+
+#include <PcapLiveDeviceList.h>
+
+#include "csi_packet_mmap.hpp"
+#include "csi_ring.hpp"
+
+#ifndef CSI_SOURCE
+#define CSI_SOURCE
+
+#define PCAP_BUFFER_TIMEOUT_MS 10 // libpcapがバッファを返すまでの最大時間
+
+namespace csirdr {
+
+/*
+ * 1つのインターフェイスからのキャプチャ
+ * 専用のスレッド（指定したコアに固定）で受信し，
+ * UDPペイロードと受信時刻をインターフェイスごとのリングにコピーする
+ */
+class Csi_source {
+private:
+  int index;             // インターフェイス番号（フレームのタグ）
+  std::string interface; // インターフェイス名
+  std::string backend;   // "pcap" または "mmap"
+  int fanout_group;      // mmapのPACKET_FANOUTのグループID
+  int cpu;               // キャプチャスレッドを固定するコア（負なら固定しない）
+  bool hw_timestamp = false; // アダプタのタイムスタンプ（mmapのみ）
+
+  pcpp::PcapLiveDevice *dev = nullptr;
+  std::unique_ptr<csirdr::Csi_packet_mmap> mm;
+
+  csirdr::Spsc_ring<csirdr::csi_packet> ring;
+
+  std::thread th;
+  std::atomic<bool> running{false};
+
+  // インターフェイスごとの統計
+  std::atomic<uint64_t> n_packets{0};
+  std::atomic<uint64_t> kernel_recv{0};
+  std::atomic<uint64_t> kernel_drop{0};
+  std::atomic<uint64_t> kernel_ifdrop{0};
+
+  void capture_loop(uint32_t time_sec);
+
+  /*
+   * 受信フレームからUDPペイロードを取り出してリングにコピー
+   */
+  void push_packet(const uint8_t *frame, int frame_len, int link_type,
+                   int64_t timestamp_ns);
+
+  /*
+   * libpcapのコールバック
+   * 終了が指示されていればtrueを返してキャプチャを止める
+   */
+  static bool on_packet_arrives(pcpp::RawPacket *raw_packet,
+                                pcpp::PcapLiveDevice *dev, void *cookie);
+
+public:
+  Csi_source(int index, std::string interface, std::string backend,
+             int ring_size, int fanout_group = -1, int cpu = -1);
+  ~Csi_source();
+
+  /*
+   * アダプタのタイムスタンプの使用（open()の前に呼び出す，mmapのみ）
+   */
+  void set_hw_timestamp(bool on) { this->hw_timestamp = on; }
+
+  /*
+   * デバイスのオープンとフィルタの設定
+   */
+  bool open(std::string filter);
+
+  /*
+   * インターフェイスの情報の出力
+   */
+  void print_info(std::ostream &os);
+
+  /*
+   * キャプチャスレッドの開始と停止
+   */
+  void start(uint32_t time_sec);
+  void stop();
+
+  /*
+   * カーネルの統計を取得して保存（処理スレッドから定期的に呼び出す）
+   */
+  void update_statistics();
+
+  /*
+   * インターフェイスごとの集計を出力
+   */
+  void print_summary(std::ostream &os);
+
+  /*
+   * 受信パケット数の加算（リングを経由せずに直接処理する場合）
+   */
+  void add_packets(uint64_t n) {
+    this->n_packets.store(this->n_packets.load(std::memory_order_relaxed) + n,
+                          std::memory_order_relaxed);
+  }
+
+  int get_index() { return this->index; }
+  std::string get_interface() { return this->interface; }
+  csirdr::Spsc_ring<csirdr::csi_packet> &get_ring() { return this->ring; }
+  uint64_t get_n_packets() {
+    return this->n_packets.load(std::memory_order_relaxed);
+  }
+  uint64_t get_kernel_recv() {
+    return this->kernel_recv.load(std::memory_order_relaxed);
+  }
+  uint64_t get_kernel_drop() {
+    return this->kernel_drop.load(std::memory_order_relaxed);
+  }
+  uint64_t get_kernel_ifdrop() {
+    return this->kernel_ifdrop.load(std::memory_order_relaxed);
+  }
+
+  /*
+   * mmapのリング（単一インターフェイスでブロックを直接処理する場合）
+   */
+  csirdr::Csi_packet_mmap *get_mmap() { return this->mm.get(); }
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
@@ -0,0 +1,229 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "csi_doppler.hpp"
+#include "csi_frame.hpp"
+#include "csi_graph.hpp"
+#include "csi_hampel.hpp"
+#include "csi_motion.hpp"
+#include "csi_sanitize.hpp"
+#include "csi_stages.hpp"
+
+namespace csirdr {
+
+bool Skip_filter::process(Csi_frame_ref &) {
+  if (this->skip == 0) {
+    return true;
+  }
+
+  this->counter = (this->counter + 1) % (this->skip + 1);
+  return this->counter == 1;
+}
+
+bool Beacon_filter::process(Csi_frame_ref &frame) {
+  int n_sub = frame->get_n_sub();
+  if (n_sub == 0) {
+    return true;
+  }
+
+  int cnt = 0;
+  const float *amplitude = frame->get_amplitude(0);
+  for (int i = 0; i < n_sub; i++) {
+    if (amplitude[i] < this->th) {
+      cnt++;
+    }
+  }
+
+  return cnt <= (n_sub / 2);
+}
+
+Csv_writer::Csv_writer(std::string path) {
+  this->ofs.open(path);
+  if (!this->ofs.is_open()) {
+    std::cerr << "Failed to open " << path << std::endl;
+  }
+}
+
+bool Csv_writer::process(Csi_frame_ref &frame) {
+  int n_sub = frame->get_n_sub();
+  for (int e = 0; e < frame->get_n_elements(); e++) {
+    this->ofs << std::hex << std::setw(4) << std::setfill('0')
+              << frame->get_mac_tail() << std::dec << ',' << frame->seq << ','
+              << frame->timestamp_ns << ',' << e;
+    const float *amplitude = frame->get_amplitude(e);
+    for (int sub = 0; sub < n_sub; sub++) {
+      this->ofs << ',' << amplitude[sub];
+    }
+    const float *phase = frame->get_phase(e);
+    for (int sub = 0; sub < n_sub; sub++) {
+      this->ofs << ',' << phase[sub];
+    }
+    this->ofs << '\n';
+  }
+  return true;
+}
+
+void register_builtin_stages(Csi_graph &graph) {
+  graph.register_stage("mac", [](std::string arg) {
+    std::unique_ptr<Csi_stage> stage;
+    if (arg.size() != 4 or
+        arg.find_first_not_of("0123456789abcdef") != std::string::npos) {
+      return stage;
+    }
+    stage =
+        std::make_unique<Mac_filter>((uint16_t)std::stoul(arg, nullptr, 16));
+    return stage;
+  });
+  graph.register_stage("skip", [](std::string arg) {
+    std::unique_ptr<Csi_stage> stage;
+    int skip = 0;
+    if (arg != "" and (!parse_int(arg, skip) or skip < 0)) {
+      return stage;
+    }
+    stage = std::make_unique<Skip_filter>(skip);
+    return stage;
+  });
+  graph.register_stage("beacon", [](std::string arg) {
+    std::unique_ptr<Csi_stage> stage;
+    float th = BEACON_AMPLITUDE_TH;
+    if (arg != "" and (!parse_float(arg, th) or th < 0)) {
+      return stage;
+    }
+    stage = std::make_unique<Beacon_filter>(th);
+    return stage;
+  });
+  graph.register_stage("sanitize", [](std::string) {
+    std::unique_ptr<Csi_stage> stage = std::make_unique<Phase_sanitizer>();
+    return stage;
+  });
+  graph.register_stage("hampel", [](std::string arg) {
+    std::unique_ptr<Csi_stage> stage;
+    int window = HAMPEL_WINDOW;
+    float threshold = HAMPEL_THRESHOLD;
+    size_t pos = arg.find(':');
+    if (arg != "" and !parse_int(arg.substr(0, pos), window)) {
+      return stage;
+    }
+    if (pos != std::string::npos and
+        !parse_float(arg.substr(pos + 1), threshold)) {
+      return stage;
+    }
+
+    // 中央値とMADには3つ以上の値が必要
+    if (window < 3 or threshold <= 0) {
+      std::cerr << "hampel: window must be 3 or more and threshold positive"
+                << std::endl;
+      return stage;
+    }
+    stage = std::make_unique<Hampel_filter>(window, threshold);
+    return stage;
+  });
+  graph.register_stage("motion", [](std::string arg) {
+    std::unique_ptr<Csi_stage> stage;
+    double window_sec = MOTION_WINDOW_SEC;
+
+    // 最初の':'までが数値として読める場合だけ秒数とみなす
+    // （それ以外は':'を含むパス）
+    size_t pos = arg.find(':');
+    if (pos != std::string::npos and
+        parse_double(arg.substr(0, pos), window_sec)) {
+      arg = arg.substr(pos + 1);
+    }
+    if (window_sec <= 0) {
+      std::cerr << "motion: window must be positive" << std::endl;
+      return stage;
+    }
+    if (arg == "") {
+      return stage;
+    }
+    auto motion = std::make_unique<Motion_stats>(arg, window_sec);
+    if (motion->is_open()) {
+      stage = std::move(motion);
+    }
+    return stage;
+  });
+  graph.register_stage("doppler", [](std::string arg) {
+    std::unique_ptr<Csi_stage> stage;
+    std::vector<std::string> args;
+    size_t pos;
+    while ((pos = arg.find(':')) != std::string::npos) {
+      args.push_back(arg.substr(0, pos));
+      arg = arg.substr(pos + 1);
+    }
+    args.push_back(arg);
+
+    int window = DOPPLER_WINDOW, hop = DOPPLER_HOP, first = 0, last = -1;
+    if (args.size() > 3 or (args[0] != "" and !parse_int(args[0], window)) or
+        (args.size() > 1 and !parse_int(args[1], hop))) {
+      return stage;
+    }
+    if (args.size() > 2) {
+      pos = args[2].find('-');
+      if (!parse_int(args[2].substr(0, pos), first)) {
+        return stage;
+      }
+      last = first;
+      if (pos != std::string::npos and
+          !parse_int(args[2].substr(pos + 1), last)) {
+        return stage;
+      }
+    }
+    if (!is_power_of_two(window) or window < 2 or window > FRAME_MAX_SUB) {
+      std::cerr << "doppler: window must be a power of two up to "
+                << FRAME_MAX_SUB << std::endl;
+      return stage;
+    }
+    if (hop <= 0) {
+      std::cerr << "doppler: hop must be positive" << std::endl;
+      return stage;
+    }
+    if (args.size() > 2 and (first < 0 or last < first)) {
+      std::cerr << "doppler: invalid subcarrier range " << args[2]
+                << std::endl;
+      return stage;
+    }
+    stage = std::make_unique<Doppler_stage>(window, hop, first, last);
+    return stage;
+  });
+  graph.register_stage("csv", [](std::string arg) {
+    std::unique_ptr<Csi_stage> stage;
+    auto writer = std::make_unique<Csv_writer>(arg);
+    if (arg != "" and writer->is_open()) {
+      stage = std::move(writer);
+    }
+    return stage;
+  });
+}
+
+} // namespace csirdr
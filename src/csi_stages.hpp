@@ -0,0 +1,113 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <fstream>
+#include <stdlib.h>
+#include <string>
+
+#include "csi_frame.hpp"
+#include "csi_graph.hpp"
+
+#ifndef CSI_STAGES
+#define CSI_STAGES
+
+#define BEACON_AMPLITUDE_TH 150 // ビーコンと判定する振幅の閾値
+
+namespace csirdr {
+
+/*
+ * 送信元MACアドレス（末尾4桁）によるフィルタ
+ * 段の指定: "mac:1234"
+ */
+class Mac_filter : public Csi_stage {
+private:
+  uint16_t mac_tail;
+
+public:
+  Mac_filter(uint16_t mac_tail) { this->mac_tail = mac_tail; }
+  std::string get_name() override { return "mac"; }
+  bool process(Csi_frame_ref &frame) override {
+    return frame->get_mac_tail() == this->mac_tail;
+  }
+};
+
+/*
+ * n個おきにフレームを間引くフィルタ
+ * 段の指定: "skip:n"
+ */
+class Skip_filter : public Csi_stage {
+private:
+  int skip;
+  int counter = 0;
+
+public:
+  Skip_filter(int skip) { this->skip = skip; }
+  std::string get_name() override { return "skip"; }
+  bool process(Csi_frame_ref &frame) override;
+};
+
+/*
+ * ビーコンフレームの除去
+ * 半数以上のサブキャリアの振幅が閾値未満ならビーコンとみなす
+ * 段の指定: "beacon" または "beacon:閾値"
+ */
+class Beacon_filter : public Csi_stage {
+private:
+  float th;
+
+public:
+  Beacon_filter(float th = BEACON_AMPLITUDE_TH) { this->th = th; }
+  std::string get_name() override { return "beacon"; }
+  bool process(Csi_frame_ref &frame) override;
+};
+
+/*
+ * フレームの振幅と位相のCSVへの書き出し（nexdecodeでの変換の出力など）
+ * 1行は1フレームの1要素で，
+ * "mac,seq,timestamp_ns,element,振幅（n_sub個）,位相（n_sub個）"
+ * 段の指定: "csv:出力ファイルのパス"
+ */
+class Csv_writer : public Csi_stage {
+private:
+  std::ofstream ofs;
+
+public:
+  Csv_writer(std::string path);
+  bool is_open() { return this->ofs.is_open(); }
+  std::string get_name() override { return "csv"; }
+  bool process(Csi_frame_ref &frame) override;
+  void flush() override { this->ofs.flush(); }
+};
+
+/*
+ * 組み込みの段をグラフに登録
+ */
+void register_builtin_stages(Csi_graph &graph);
+
+} // namespace csirdr
+
+#endif /* end of include guard */
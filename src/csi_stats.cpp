@@ -0,0 +1,228 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "csi_stats.hpp"
+
+namespace csirdr {
+
+bool stats_enabled = false;
+
+// 表示用の処理段の名前
+static const char *stage_names[N_STAGES] = {
+    "receive",      "udp parse",      "header parse", "csi decode",
+    "post process", "frame assembly", "app",          "graph stage",
+    "output write", "receive to app"};
+
+// 登録済みの計測ブロック
+// スレッド終了後も集計できるよう，プログラム終了まで解放しない
+static std::mutex registry_mtx;
+static std::vector<std::unique_ptr<Stats_block>> registry;
+static thread_local Stats_block *local_block = nullptr;
+
+Stats_block::Stats_block() {
+  for (int s = 0; s < N_STAGES; s++) {
+    this->count[s].store(0, std::memory_order_relaxed);
+    this->sum_ns[s].store(0, std::memory_order_relaxed);
+    this->max_ns[s].store(0, std::memory_order_relaxed);
+    for (int i = 0; i < STATS_N_BUCKETS; i++) {
+      this->hist[s][i].store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+Stats_block *stats_local_block() {
+  if (local_block == nullptr) {
+    std::lock_guard<std::mutex> lock(registry_mtx);
+    registry.push_back(std::make_unique<Stats_block>());
+    local_block = registry.back().get();
+    local_block->thread_name =
+        "thread " + std::to_string(registry.size() - 1);
+  }
+  return local_block;
+}
+
+void Csi_stats::set_thread_name(std::string name) {
+  stats_local_block()->thread_name = name;
+}
+
+Csi_stats::Csi_stats() {
+  this->interval_sec = 0;
+  this->prev_hist.assign(N_STAGES * STATS_N_BUCKETS, 0);
+  this->prev_count.assign(N_STAGES, 0);
+  this->prev_sum.assign(N_STAGES, 0);
+}
+
+Csi_stats::~Csi_stats() {
+  if (this->running) {
+    this->stop();
+  }
+}
+
+void Csi_stats::start(double interval_sec) {
+  stats_enabled = true;
+  this->interval_sec = interval_sec;
+  this->t_start = std::chrono::steady_clock::now();
+  this->t_prev = this->t_start;
+  this->running = true;
+
+  if (this->interval_sec > 0) {
+    this->th = std::thread(&Csi_stats::report_loop, this);
+  }
+}
+
+void Csi_stats::stop() {
+  {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    this->running = false;
+  }
+  this->cv.notify_all();
+  if (this->th.joinable()) {
+    this->th.join();
+  }
+
+  this->print_summary(std::cout, true);
+}
+
+void Csi_stats::report_loop() {
+  std::unique_lock<std::mutex> lock(this->mtx);
+  auto period = std::chrono::duration<double>(this->interval_sec);
+
+  while (!this->cv.wait_for(lock, period, [this] { return !this->running; })) {
+    this->print_summary(std::cout, false);
+  }
+}
+
+void Csi_stats::print_summary(std::ostream &os, bool final_report) {
+  // 全スレッドの値を集計
+  std::vector<uint64_t> hist(N_STAGES * STATS_N_BUCKETS, 0);
+  std::vector<uint64_t> count(N_STAGES, 0);
+  std::vector<uint64_t> sum_ns(N_STAGES, 0);
+  std::vector<uint64_t> max_ns(N_STAGES, 0);
+  {
+    std::lock_guard<std::mutex> lock(registry_mtx);
+    for (auto &b : registry) {
+      for (int s = 0; s < N_STAGES; s++) {
+        count[s] += b->count[s].load(std::memory_order_relaxed);
+        sum_ns[s] += b->sum_ns[s].load(std::memory_order_relaxed);
+        max_ns[s] =
+            std::max(max_ns[s], b->max_ns[s].load(std::memory_order_relaxed));
+        for (int i = 0; i < STATS_N_BUCKETS; i++) {
+          hist[s * STATS_N_BUCKETS + i] +=
+              b->hist[s][i].load(std::memory_order_relaxed);
+        }
+      }
+    }
+  }
+
+  // 経過時間
+  auto now = std::chrono::steady_clock::now();
+  double elapsed = std::chrono::duration<double>(
+                       now - (final_report ? this->t_start : this->t_prev))
+                       .count();
+
+  // 定期出力では前回との差分を出す
+  std::vector<uint64_t> d_hist = hist;
+  std::vector<uint64_t> d_count = count;
+  std::vector<uint64_t> d_sum = sum_ns;
+  if (!final_report) {
+    for (int i = 0; i < (int)hist.size(); i++) {
+      d_hist[i] -= this->prev_hist[i];
+    }
+    for (int s = 0; s < N_STAGES; s++) {
+      d_count[s] -= this->prev_count[s];
+      d_sum[s] -= this->prev_sum[s];
+    }
+    this->prev_hist = hist;
+    this->prev_count = count;
+    this->prev_sum = sum_ns;
+    this->t_prev = now;
+  }
+
+  // パーセンタイル（ビンの上限値を返す）
+  auto percentile = [&](int s, double q) -> double {
+    uint64_t total = d_count[s];
+    uint64_t target = (uint64_t)(q * total);
+    uint64_t cum = 0;
+    for (int i = 0; i < STATS_N_BUCKETS; i++) {
+      cum += d_hist[s * STATS_N_BUCKETS + i];
+      if (cum > target) {
+        return stats_bucket_lower(i + 1) / 1000.0;
+      }
+    }
+    return stats_bucket_lower(STATS_N_BUCKETS - 1) / 1000.0;
+  };
+
+  os << std::endl
+     << "[stats] " << (final_report ? "total " : "interval ") << std::fixed
+     << std::setprecision(2) << elapsed << " s" << std::endl;
+  os << std::left << std::setw(16) << "stage" << std::right << std::setw(12)
+     << "count" << std::setw(12) << "rate/s" << std::setw(11) << "mean(us)"
+     << std::setw(11) << "p50(us)" << std::setw(11) << "p99(us)"
+     << std::setw(11) << "p99.9(us)" << std::setw(11) << "max(us)"
+     << std::endl;
+
+  for (int s = 0; s < N_STAGES; s++) {
+    if (count[s] == 0) {
+      continue;
+    }
+    double mean = d_count[s] > 0 ? d_sum[s] / 1000.0 / d_count[s] : 0.0;
+    os << std::left << std::setw(16) << stage_names[s] << std::right
+       << std::setw(12) << d_count[s] << std::setw(12)
+       << (elapsed > 0 ? d_count[s] / elapsed : 0.0) << std::setw(11) << mean
+       << std::setw(11) << percentile(s, 0.5) << std::setw(11)
+       << percentile(s, 0.99) << std::setw(11) << percentile(s, 0.999)
+       << std::setw(11) << max_ns[s] / 1000.0 << std::endl;
+  }
+
+  // 最終結果ではスレッドごとの件数も出力
+  if (final_report) {
+    std::lock_guard<std::mutex> lock(registry_mtx);
+    for (auto &b : registry) {
+      os << "  " << b->thread_name << ":";
+      for (int s = 0; s < N_STAGES; s++) {
+        uint64_t c = b->count[s].load(std::memory_order_relaxed);
+        if (c > 0) {
+          os << " " << stage_names[s] << "=" << c;
+        }
+      }
+      os << std::endl;
+    }
+  }
+  os << std::defaultfloat;
+}
+
+} // namespace csirdr
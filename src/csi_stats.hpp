@@ -0,0 +1,226 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef CSI_STATS
+#define CSI_STATS
+
+/*
+ * ヒストグラムの分解能
+ * 2のべき乗ごとの区間を2^STATS_SUB_BUCKET_BITS個に線形分割する（HDR形式）
+ * 相対誤差は 1/16 = 6.25% 以下
+ */
+#define STATS_SUB_BUCKET_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+#define STATS_MAX_BITS 40 // 2^40 ns (約18分) までを記録
+#define STATS_N_BUCKETS                                                        \
+  ((STATS_MAX_BITS - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS)
+
+namespace csirdr {
+
+/*
+ * 計測対象の処理段
+ */
+enum csi_stage {
+  STAGE_RECEIVE = 0,     // パケット受信（コールバック全体）
+  STAGE_UDP_PARSE,       // UDPレイヤの解析
+  STAGE_HEADER_PARSE,    // CSIヘッダの解析
+  STAGE_CSI_DECODE,      // CSIのデコード
+  STAGE_POST_PROCESS,    // サブキャリアの並べ替えとゼロ埋め
+  STAGE_FRAME_ASSEMBLY,  // コア・ストリームごとのCSIの組み立て
+  STAGE_APP,             // アプリケーション（処理グラフへの受け渡し全体）
+  STAGE_GRAPH_NODE,      // 処理グラフの各段の処理（段ごとに1件）
+  STAGE_OUTPUT_WRITE,    // ファイルやgnuplotへの書き出し
+  STAGE_RECEIVE_TO_APP,  // 受信時刻から最後の段の処理開始まで（ライブのみ）
+  N_STAGES
+};
+
+/*
+ * 計測の有効・無効
+ * スレッド開始前に設定し，以降は読み出しのみ
+ * 無効ならStage_timerは時刻取得もしない
+ */
+extern bool stats_enabled;
+
+/*
+ * スレッドごとの計測値
+ * 書き込みは所有スレッドのみ，読み出しはレポートスレッド
+ * そのためatomicだがロック命令は使わない
+ */
+struct Stats_block {
+  std::string thread_name;
+  std::atomic<uint64_t> count[N_STAGES];
+  std::atomic<uint64_t> sum_ns[N_STAGES];
+  std::atomic<uint64_t> max_ns[N_STAGES];
+  std::atomic<uint64_t> hist[N_STAGES][STATS_N_BUCKETS];
+
+  Stats_block();
+};
+
+/*
+ * 値からヒストグラムのビン番号を計算
+ */
+inline int stats_bucket_index(uint64_t v) {
+  if (v < STATS_SUB_BUCKETS) {
+    return (int)v;
+  }
+  int msb = 63 - __builtin_clzll(v);
+  if (msb >= STATS_MAX_BITS) {
+    return STATS_N_BUCKETS - 1;
+  }
+  int sub = (int)(v >> (msb - STATS_SUB_BUCKET_BITS)) & (STATS_SUB_BUCKETS - 1);
+  return (msb - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+/*
+ * ビン番号からそのビンの下限値を計算
+ */
+inline uint64_t stats_bucket_lower(int idx) {
+  if (idx < STATS_SUB_BUCKETS) {
+    return (uint64_t)idx;
+  }
+  int msb = idx / STATS_SUB_BUCKETS + STATS_SUB_BUCKET_BITS - 1;
+  uint64_t sub = (uint64_t)(idx % STATS_SUB_BUCKETS);
+  return (STATS_SUB_BUCKETS + sub) << (msb - STATS_SUB_BUCKET_BITS);
+}
+
+/*
+ * 呼び出しスレッドの計測ブロックを取得
+ * 初回呼び出し時に登録される
+ */
+Stats_block *stats_local_block();
+
+/*
+ * 計測値の記録
+ */
+inline void stats_record(csi_stage stage, uint64_t ns) {
+  Stats_block *b = stats_local_block();
+  auto inc = [](std::atomic<uint64_t> &a, uint64_t d) {
+    a.store(a.load(std::memory_order_relaxed) + d, std::memory_order_relaxed);
+  };
+  inc(b->count[stage], 1);
+  inc(b->sum_ns[stage], ns);
+  inc(b->hist[stage][stats_bucket_index(ns)], 1);
+  if (ns > b->max_ns[stage].load(std::memory_order_relaxed)) {
+    b->max_ns[stage].store(ns, std::memory_order_relaxed);
+  }
+}
+
+/*
+ * スコープの実行時間を計測するクラス
+ * Stage_timer t(STAGE_CSI_DECODE); のように使う
+ */
+class Stage_timer {
+private:
+  csi_stage stage;
+  bool on;
+  std::chrono::steady_clock::time_point t0;
+
+public:
+  explicit Stage_timer(csi_stage stage) : stage(stage), on(stats_enabled) {
+    if (this->on) {
+      this->t0 = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~Stage_timer() { this->stop(); }
+
+  /*
+   * スコープの終了前に計測を終える場合に呼び出す
+   */
+  void stop() {
+    if (this->on) {
+      stats_record(this->stage,
+                   std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - this->t0)
+                       .count());
+      this->on = false;
+    }
+  }
+};
+
+/*
+ * 全スレッドの計測値を集計して出力するクラス
+ * start()で定期出力スレッドを開始，stop()で停止して最終結果を出力
+ */
+class Csi_stats {
+private:
+  double interval_sec;
+  bool running = false;
+  std::thread th;
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::chrono::steady_clock::time_point t_start;
+
+  // 前回出力時の集計値（区間ごとの値を出すため）
+  std::vector<uint64_t> prev_hist;
+  std::vector<uint64_t> prev_count;
+  std::vector<uint64_t> prev_sum;
+  std::chrono::steady_clock::time_point t_prev;
+
+  void report_loop();
+
+public:
+  Csi_stats();
+  ~Csi_stats();
+
+  /*
+   * 計測を有効化し，interval_sec秒ごとの定期出力を開始
+   * interval_sec <= 0なら定期出力は行わない
+   */
+  void start(double interval_sec = 1.0);
+
+  /*
+   * 定期出力を停止して最終結果を出力
+   */
+  void stop();
+
+  /*
+   * 集計結果の出力
+   * final_report: 開始時からの累積値を出力する場合はtrue
+   */
+  void print_summary(std::ostream &os, bool final_report);
+
+  /*
+   * スレッドの名前を設定（最終結果の表示用）
+   */
+  static void set_thread_name(std::string name);
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
@@ -0,0 +1,182 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "csi_capture.hpp"
+#include "csi_status.hpp"
+
+namespace csirdr {
+
+Mac_counter::Mac_counter() {
+  for (int i = 0; i < MAX_STATUS_MACS; i++) {
+    this->macs[i].store(0, std::memory_order_relaxed);
+    this->counts[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void Mac_counter::add(uint64_t mac) {
+  uint64_t key = mac | used_bit;
+  for (int i = 0; i < MAX_STATUS_MACS; i++) {
+    uint64_t m = this->macs[i].load(std::memory_order_relaxed);
+    if (m == key) {
+      this->counts[i].store(this->counts[i].load(std::memory_order_relaxed) +
+                                1,
+                            std::memory_order_relaxed);
+      return;
+    }
+    if (m == 0) {
+      // 新しい送信機
+      this->counts[i].store(1, std::memory_order_relaxed);
+      this->macs[i].store(key, std::memory_order_release);
+      return;
+    }
+  }
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> Mac_counter::snapshot() const {
+  std::vector<std::pair<uint64_t, uint64_t>> ret;
+  for (int i = 0; i < MAX_STATUS_MACS; i++) {
+    uint64_t m = this->macs[i].load(std::memory_order_acquire);
+    if (m == 0) {
+      break;
+    }
+    ret.push_back(std::make_pair(
+        m & ~used_bit, this->counts[i].load(std::memory_order_relaxed)));
+  }
+  return ret;
+}
+
+Csi_status::Csi_status(Csi_capture *cap, double hz) {
+  this->cap = cap;
+  this->hz = hz;
+}
+
+Csi_status::~Csi_status() {
+  if (this->running) {
+    this->stop();
+  }
+}
+
+void Csi_status::start() {
+  if (this->hz <= 0) {
+    return;
+  }
+  this->running = true;
+  this->t_prev = std::chrono::steady_clock::now();
+  this->th = std::thread(&Csi_status::loop, this);
+}
+
+void Csi_status::stop() {
+  {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    this->running = false;
+  }
+  this->cv.notify_all();
+  if (this->th.joinable()) {
+    this->th.join();
+    std::cout << std::endl;
+  }
+}
+
+void Csi_status::loop() {
+  std::unique_lock<std::mutex> lock(this->mtx);
+  auto period = std::chrono::duration<double>(1.0 / this->hz);
+
+  while (!this->cv.wait_for(lock, period, [this] { return !this->running; })) {
+    this->print_line();
+  }
+}
+
+void Csi_status::print_line() {
+  const loss_totals &t = this->cap->get_loss().get_totals();
+  uint64_t packets = t.packets.load(std::memory_order_relaxed);
+  uint64_t frames = t.frames_complete.load(std::memory_order_relaxed);
+
+  // 毎秒の値
+  auto now = std::chrono::steady_clock::now();
+  double dt = std::chrono::duration<double>(now - this->t_prev).count();
+  double pps = (packets - this->prev_packets) / dt;
+  double fps = (frames - this->prev_frames) / dt;
+  this->prev_packets = packets;
+  this->prev_frames = frames;
+  this->t_prev = now;
+
+  // リングはインターフェイスの合計
+  size_t ring_used = 0;
+  uint64_t ring_ovf = 0;
+  for (auto &src : this->cap->get_sources()) {
+    ring_used += src->get_ring().size();
+    ring_ovf += src->get_ring().get_overflow();
+  }
+
+  // 1行にまとめてから出力
+  std::stringstream ss;
+  std::string target = this->cap->get_target_mac_add();
+  ss << std::fixed << std::setprecision(0) << "\rtarget "
+     << (target == "" ? "any" : target) << " | " << pps << " pkt/s, " << fps
+     << " frame/s | ring " << ring_used << " ovf " << ring_ovf;
+  if (this->cap->get_sources().size() > 1) {
+    ss << " |";
+    for (auto &src : this->cap->get_sources()) {
+      ss << " " << src->get_interface() << ":" << src->get_n_packets();
+    }
+  }
+  if (t.has_pcap_stats.load(std::memory_order_acquire)) {
+    ss << " | kdrop " << t.pcap_drop.load(std::memory_order_relaxed)
+       << " ifdrop " << t.pcap_ifdrop.load(std::memory_order_relaxed);
+  }
+  ss << " | gaps " << t.seq_gaps.load(std::memory_order_relaxed)
+     << " partial " << t.frames_partial.load(std::memory_order_relaxed)
+     << " |";
+
+  // パケット数の多い送信機から表示
+  std::vector<std::pair<uint64_t, uint64_t>> macs =
+      this->cap->get_mac_counter().snapshot();
+  std::sort(macs.begin(), macs.end(),
+            [](const std::pair<uint64_t, uint64_t> &a,
+               const std::pair<uint64_t, uint64_t> &b) {
+              return a.second > b.second;
+            });
+  for (int i = 0; i < (int)macs.size() and i < STATUS_SHOWN_MACS; i++) {
+    ss << " " << std::hex << std::setw(4) << std::setfill('0')
+       << (macs[i].first & 0x0000FFFF) << std::dec << ":" << macs[i].second;
+  }
+  ss << "\033[K"; // 行末まで消去
+
+  std::cout << ss.str() << std::flush;
+}
+
+} // namespace csirdr
@@ -0,0 +1,113 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <stdlib.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef CSI_STATUS
+#define CSI_STATUS
+
+#define MAX_STATUS_MACS 64     // 状態表示で数える送信機の最大数
+#define STATUS_SHOWN_MACS 4    // 1行に表示する送信機の数
+#define DEFAULT_STATUS_HZ 4.0  // 状態表示の更新頻度
+
+namespace csirdr {
+
+class Csi_capture;
+
+/*
+ * 送信機ごとのパケット数
+ * 書き込みは処理スレッドのみ，読み出しは状態表示スレッド
+ * 固定長の配列を線形探索するのでメモリ確保もロックもしない
+ */
+class Mac_counter {
+private:
+  // 上位ビットを使用中の印にする（MACアドレスは48ビット）
+  static constexpr uint64_t used_bit = 1ULL << 63;
+
+  std::atomic<uint64_t> macs[MAX_STATUS_MACS];
+  std::atomic<uint64_t> counts[MAX_STATUS_MACS];
+
+public:
+  Mac_counter();
+
+  /*
+   * MACアドレスのパケット数を1増やす
+   * 表が満杯なら数えない
+   */
+  void add(uint64_t mac);
+
+  /*
+   * (MACアドレス, パケット数)の一覧を出力
+   */
+  std::vector<std::pair<uint64_t, uint64_t>> snapshot() const;
+};
+
+/*
+ * キャプチャの状態を一定の頻度で1行に表示するクラス
+ * パケット数，フレーム数，送信機ごとのパケット数，ドロップ数を
+ * 共有のatomic変数から読み出す
+ */
+class Csi_status {
+private:
+  Csi_capture *cap;
+  double hz;
+
+  bool running = false;
+  std::thread th;
+  std::mutex mtx;
+  std::condition_variable cv;
+
+  // 前回表示時の値（毎秒の値の計算用）
+  uint64_t prev_packets = 0;
+  uint64_t prev_frames = 0;
+  std::chrono::steady_clock::time_point t_prev;
+
+  void loop();
+  void print_line();
+
+public:
+  Csi_status(Csi_capture *cap, double hz = DEFAULT_STATUS_HZ);
+  ~Csi_status();
+
+  /*
+   * 表示スレッドの開始と停止
+   */
+  void start();
+  void stop();
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
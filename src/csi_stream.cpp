@@ -0,0 +1,446 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "csi_frame.hpp"
+#include "csi_record.hpp"
+#include "csi_stream.hpp"
+
+namespace csirdr {
+
+Csi_streamer::Csi_streamer(std::string spec) { this->spec = spec; }
+
+Csi_streamer::~Csi_streamer() { this->stop(); }
+
+bool Csi_streamer::start() {
+  // 配信先の解析
+  size_t pos = this->spec.find(':');
+  if (pos == std::string::npos) {
+    std::cerr << "Invalid stream: " << this->spec << std::endl;
+    return false;
+  }
+  this->proto = this->spec.substr(0, pos);
+  std::string rest = this->spec.substr(pos + 1);
+
+  if (this->proto == "tcp" or this->proto == "udp") {
+    std::string addr = "127.0.0.1";
+    pos = rest.rfind(':');
+    if (pos != std::string::npos) {
+      addr = rest.substr(0, pos);
+      rest = rest.substr(pos + 1);
+    }
+    sockaddr_in sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(std::atoi(rest.c_str()));
+    if (inet_pton(AF_INET, addr.c_str(), &sa.sin_addr) != 1 or
+        sa.sin_port == 0) {
+      std::cerr << "Invalid stream address: " << this->spec << std::endl;
+      return false;
+    }
+
+    bool tcp = this->proto == "tcp";
+    this->listen_fd = socket(AF_INET, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    int on = 1;
+    setsockopt(this->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(this->listen_fd, (sockaddr *)&sa, sizeof(sa)) < 0 or
+        (tcp and listen(this->listen_fd, 16) < 0)) {
+      std::cerr << "Failed to bind " << this->spec << ": " << strerror(errno)
+                << std::endl;
+      return false;
+    }
+  } else if (this->proto == "unix") {
+    sockaddr_un sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (rest == "" or rest.size() >= sizeof(sa.sun_path)) {
+      std::cerr << "Invalid stream path: " << this->spec << std::endl;
+      return false;
+    }
+    std::strcpy(sa.sun_path, rest.c_str());
+    this->path = rest;
+    unlink(this->path.c_str());
+
+    this->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (bind(this->listen_fd, (sockaddr *)&sa, sizeof(sa)) < 0 or
+        listen(this->listen_fd, 16) < 0) {
+      std::cerr << "Failed to bind " << this->spec << ": " << strerror(errno)
+                << std::endl;
+      return false;
+    }
+  } else {
+    std::cerr << "Unknown stream protocol: " << this->proto << std::endl;
+    return false;
+  }
+  fcntl(this->listen_fd, F_SETFL, O_NONBLOCK);
+
+  if (pipe(this->wake_fd) < 0) {
+    return false;
+  }
+  fcntl(this->wake_fd[0], F_SETFL, O_NONBLOCK);
+  fcntl(this->wake_fd[1], F_SETFL, O_NONBLOCK);
+
+  this->running = true;
+  this->io_thread = std::thread(&Csi_streamer::io_loop, this);
+  std::cout << "Streaming frames on " << this->spec << std::endl;
+  return true;
+}
+
+void Csi_streamer::stop() {
+  bool was_running;
+  {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    was_running = this->running;
+    this->running = false;
+  }
+  if (was_running) {
+    if (write(this->wake_fd[1], "x", 1) < 0) {
+      // パイプが満杯でもI/Oスレッドはpoll()のタイムアウトで終了する
+    }
+    this->io_thread.join();
+  }
+
+  // 開始に失敗した場合もソケットを閉じる
+  while (this->clients.size() > 0) {
+    this->close_client(this->clients.size() - 1);
+  }
+  for (int *fd : {&this->listen_fd, &this->wake_fd[0], &this->wake_fd[1]}) {
+    if (*fd >= 0) {
+      close(*fd);
+      *fd = -1;
+    }
+  }
+  if (this->path != "") {
+    unlink(this->path.c_str());
+    this->path = "";
+  }
+}
+
+void Csi_streamer::publish(const Csi_frame &frame) {
+  size_t size = get_record_size(frame);
+  bool queued = false;
+  {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    this->n_frames++;
+    if (this->proto == "udp" and size > STREAM_UDP_MAX_RECORD) {
+      this->n_too_large++;
+      return;
+    }
+
+    // レコードへの変換は購読者がいるときだけ，1回だけ行う
+    stream_buffer buf;
+    uint16_t mac_tail = frame.get_mac_tail();
+    for (auto &c : this->clients) {
+      if (!this->match(*c, mac_tail)) {
+        continue;
+      }
+      if (c->queue.size() >= STREAM_QUEUE_SIZE) {
+        c->n_dropped++;
+        this->n_dropped_slow++;
+        continue;
+      }
+      if (!buf) {
+        buf = this->get_buffer(size);
+        encode_frame_record(frame, buf->data());
+      }
+      c->queue.push_back(buf);
+      queued = true;
+    }
+  }
+
+  if (queued and write(this->wake_fd[1], "x", 1) < 0) {
+    // パイプが満杯ならI/Oスレッドは既に起きている
+  }
+}
+
+Csi_streamer::stream_buffer Csi_streamer::get_buffer(size_t size) {
+  // 全クライアントへの送信が終わったバッファを使い回す
+  int n = (int)this->buffers.size();
+  for (int i = 0; i < n; i++) {
+    int idx = (this->next_buffer + i) % n;
+    if (this->buffers[idx].use_count() == 1) {
+      this->next_buffer = (idx + 1) % n;
+      this->buffers[idx]->resize(size);
+      return this->buffers[idx];
+    }
+  }
+  stream_buffer buf = std::make_shared<std::vector<uint8_t>>(size);
+  if (n < STREAM_BUFFERS) {
+    this->buffers.push_back(buf);
+  }
+  return buf;
+}
+
+bool Csi_streamer::match(const client &c, uint16_t mac_tail) {
+  return c.macs.size() == 0 or
+         std::find(c.macs.begin(), c.macs.end(), mac_tail) != c.macs.end();
+}
+
+void Csi_streamer::io_loop() {
+  std::vector<pollfd> fds;
+  bool udp = this->proto == "udp";
+
+  while (true) {
+    // 監視するソケット（送信待ちのあるクライアントは書き込み可能も待つ）
+    fds.clear();
+    {
+      std::lock_guard<std::mutex> lock(this->mtx);
+      if (!this->running) {
+        break;
+      }
+      fds.push_back({this->listen_fd, POLLIN, 0});
+      fds.push_back({this->wake_fd[0], POLLIN, 0});
+      for (auto &c : this->clients) {
+        if (udp) {
+          if (c->queue.size() > 0) {
+            fds[0].events |= POLLOUT;
+          }
+        } else {
+          short events = POLLIN | (c->queue.size() > 0 ? POLLOUT : 0);
+          fds.push_back({c->fd, events, 0});
+        }
+      }
+    }
+
+    if (poll(fds.data(), fds.size(), 1000) < 0 and errno != EINTR) {
+      std::cerr << "poll() failed: " << strerror(errno) << std::endl;
+      break;
+    }
+    char drain[64];
+    while (read(this->wake_fd[0], drain, sizeof(drain)) > 0) {
+    }
+
+    std::lock_guard<std::mutex> lock(this->mtx);
+    if (udp) {
+      if (fds[0].revents & POLLIN) {
+        this->recv_udp();
+      }
+
+      // 期限切れの購読の削除と送信
+      auto now = std::chrono::steady_clock::now();
+      for (size_t i = this->clients.size(); i-- > 0;) {
+        client &c = *this->clients[i];
+        if (now - c.t_seen > std::chrono::seconds(STREAM_UDP_TIMEOUT_SEC) or
+            !this->flush_client(c)) {
+          this->close_client(i);
+        }
+      }
+      continue;
+    }
+
+    // クライアントは監視を始めた時点のものだけを見る（追加は末尾）
+    for (size_t i = fds.size() - 2; i-- > 0;) {
+      client &c = *this->clients[i];
+      short revents = fds[2 + i].revents;
+      bool alive = !(revents & (POLLERR | POLLHUP | POLLNVAL));
+
+      // 購読要求の受信
+      if (alive and (revents & POLLIN)) {
+        char buf[256];
+        ssize_t n = recv(c.fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n == 0 or (n < 0 and errno != EAGAIN and errno != EINTR)) {
+          alive = false;
+        } else if (n > 0) {
+          c.line.append(buf, n);
+          size_t pos;
+          while ((pos = c.line.find('\n')) != std::string::npos) {
+            this->parse_request(c, c.line.substr(0, pos));
+            c.line.erase(0, pos + 1);
+          }
+          if (c.line.size() > sizeof(buf)) {
+            c.line.clear();
+          }
+        }
+      }
+
+      if (!alive or !this->flush_client(c)) {
+        this->close_client(i);
+      }
+    }
+    if (fds[0].revents & POLLIN) {
+      this->accept_client();
+    }
+  }
+}
+
+bool Csi_streamer::flush_client(client &c) {
+  while (c.queue.size() > 0) {
+    const std::vector<uint8_t> &buf = *c.queue.front();
+    ssize_t n;
+    if (this->proto == "udp") {
+      // 1レコードを1データグラムで送る
+      n = sendto(this->listen_fd, buf.data(), buf.size(), MSG_DONTWAIT,
+                 (sockaddr *)&c.addr, c.addr_len);
+    } else {
+      n = send(c.fd, buf.data() + c.offset, buf.size() - c.offset,
+               MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    if (n < 0) {
+      return errno == EAGAIN or errno == EWOULDBLOCK or errno == EINTR;
+    }
+    c.offset += n;
+    if (this->proto == "udp" or c.offset >= buf.size()) {
+      c.queue.pop_front();
+      c.offset = 0;
+      c.n_sent++;
+    }
+  }
+  return true;
+}
+
+void Csi_streamer::accept_client() {
+  while (true) {
+    int fd = accept(this->listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      return;
+    }
+    if (this->clients.size() >= STREAM_MAX_CLIENTS) {
+      std::cerr << "Too many stream clients" << std::endl;
+      close(fd);
+      continue;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    auto c = std::make_unique<client>();
+    c->fd = fd;
+    this->clients.push_back(std::move(c));
+    this->n_clients_total++;
+  }
+}
+
+void Csi_streamer::recv_udp() {
+  while (true) {
+    char buf[256];
+    sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    ssize_t n = recvfrom(this->listen_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT,
+                         (sockaddr *)&addr, &addr_len);
+    if (n < 0) {
+      return;
+    }
+    std::string msg(buf, n);
+    while (msg.size() > 0 and (msg.back() == '\n' or msg.back() == '\r')) {
+      msg.pop_back();
+    }
+
+    // 送信元アドレスでクライアントを識別
+    size_t i = 0;
+    for (; i < this->clients.size(); i++) {
+      client &c = *this->clients[i];
+      if (c.addr_len == addr_len and
+          std::memcmp(&c.addr, &addr, addr_len) == 0) {
+        break;
+      }
+    }
+
+    if (msg == "unsub") {
+      if (i < this->clients.size()) {
+        this->close_client(i);
+      }
+      continue;
+    }
+    if (msg.compare(0, 3, "sub") != 0) {
+      continue;
+    }
+    if (i == this->clients.size()) {
+      if (this->clients.size() >= STREAM_MAX_CLIENTS) {
+        continue;
+      }
+      auto c = std::make_unique<client>();
+      std::memcpy(&c->addr, &addr, addr_len);
+      c->addr_len = addr_len;
+      this->clients.push_back(std::move(c));
+      this->n_clients_total++;
+    }
+    this->clients[i]->t_seen = std::chrono::steady_clock::now();
+    this->parse_request(*this->clients[i], msg);
+  }
+}
+
+void Csi_streamer::parse_request(client &c, const std::string &line) {
+  std::stringstream ss(line);
+  std::string cmd, mac;
+  ss >> cmd;
+  if (cmd != "mac" and cmd != "sub") {
+    return;
+  }
+  c.macs.clear();
+  while (ss >> mac) {
+    std::transform(mac.begin(), mac.end(), mac.begin(), tolower);
+    if (mac.size() != 4 or
+        mac.find_first_not_of("0123456789abcdef") != std::string::npos) {
+      std::cerr << "Invalid MAC address in subscription: " << mac
+                << std::endl;
+      continue;
+    }
+    c.macs.push_back((uint16_t)std::stoul(mac, nullptr, 16));
+  }
+}
+
+void Csi_streamer::close_client(size_t i) {
+  client &c = *this->clients[i];
+  this->n_dropped_closed += c.queue.size();
+  if (c.fd >= 0) {
+    close(c.fd);
+  }
+  this->clients.erase(this->clients.begin() + i);
+}
+
+void Csi_streamer::print_summary(std::ostream &os) {
+  std::lock_guard<std::mutex> lock(this->mtx);
+  os << "Stream " << this->spec << ": " << this->n_frames << " frames, "
+     << this->n_clients_total << " clients, " << this->n_dropped_slow
+     << " dropped (queue full), " << this->n_dropped_closed
+     << " dropped on disconnect";
+  if (this->n_too_large > 0) {
+    os << ", " << this->n_too_large << " too large for UDP";
+  }
+  os << std::endl;
+  for (size_t i = 0; i < this->clients.size(); i++) {
+    os << "  client " << i << ": " << this->clients[i]->n_sent << " sent, "
+       << this->clients[i]->n_dropped << " dropped (queue full)" << std::endl;
+  }
+}
+
+} // namespace csirdr
@@ -0,0 +1,173 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdlib.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+#include "csi_frame.hpp"
+#include "csi_graph.hpp"
+#include "csi_record.hpp"
+
+#ifndef CSI_STREAM
+#define CSI_STREAM
+
+#define STREAM_QUEUE_SIZE 256     // クライアントごとの送信キューのフレーム数
+#define STREAM_MAX_CLIENTS 64     // 同時に接続できるクライアント数
+#define STREAM_UDP_TIMEOUT_SEC 10 // UDPの購読の有効期間
+#define STREAM_UDP_MAX_RECORD 65507 // UDPで送れるレコードの最大バイト数
+#define STREAM_BUFFERS 64         // 使い回すレコードのバッファ数
+
+namespace csirdr {
+
+/*
+ * デコード済みフレームのネットワーク配信
+ * フレームはcsi_record.hppのレコード（ヘッダのrecord_lenで区切る）で送る
+ * 専用のI/Oスレッドがノンブロッキングのソケットで送信し，
+ * クライアントごとに有界の送信キューを持つ
+ * 遅いクライアントのキューが満杯になると，そのクライアント宛てのみ破棄する
+ *
+ * 配信先の指定
+ *   "tcp:[アドレス:]ポート" (既定のアドレスは127.0.0.1)
+ *   "udp:[アドレス:]ポート"
+ *   "unix:パス"
+ * 購読の要求（クライアントから送る1行のテキスト）
+ *   "mac 4e50 1234" 送信元MACアドレス（末尾4桁）で絞り込む
+ *   "mac"           絞り込みを解除
+ * UDPでは "sub [MAC...]" のデータグラムで購読し（有効期間内に再送して更新），
+ * "unsub" で解除する
+ */
+class Csi_streamer {
+private:
+  typedef std::shared_ptr<std::vector<uint8_t>> stream_buffer;
+
+  // 購読しているクライアント
+  struct client {
+    int fd = -1;                  // TCP，Unix
+    sockaddr_storage addr;        // UDP
+    socklen_t addr_len = 0;
+    std::vector<uint16_t> macs;   // 空なら全送信機
+    std::deque<stream_buffer> queue;
+    size_t offset = 0;            // キューの先頭の送信済みバイト数
+    std::string line;             // 受信中の購読要求
+    std::chrono::steady_clock::time_point t_seen; // UDPの最後の購読
+    uint64_t n_sent = 0;
+    uint64_t n_dropped = 0;
+  };
+
+  std::string spec;
+  std::string proto; // "tcp", "udp", "unix"
+  std::string path;  // Unixドメインソケットのパス
+  int listen_fd = -1; // TCP，Unixの待ち受け，UDPの送受信
+  int wake_fd[2] = {-1, -1}; // I/Oスレッドを起こすパイプ
+
+  std::mutex mtx;
+  std::vector<std::unique_ptr<client>> clients;
+  uint64_t n_frames = 0;
+  uint64_t n_too_large = 0; // UDPで送れない大きさのレコード
+  uint64_t n_clients_total = 0;
+  uint64_t n_dropped_slow = 0;   // 送信キューが満杯で破棄した数
+  uint64_t n_dropped_closed = 0; // 切断したクライアントの破棄数
+
+  // レコードのバッファ（送信が終わったものを使い回す）
+  std::vector<stream_buffer> buffers;
+  int next_buffer = 0;
+
+  std::thread io_thread;
+  bool running = false;
+
+  void io_loop();
+
+  // 購読要求の解析
+  void parse_request(client &c, const std::string &line);
+
+  // キューの送信（ノンブロッキング），切断したらfalse
+  bool flush_client(client &c);
+
+  void accept_client();
+  void recv_udp();
+  void close_client(size_t i);
+
+  bool match(const client &c, uint16_t mac_tail);
+  stream_buffer get_buffer(size_t size);
+
+public:
+  Csi_streamer(std::string spec);
+  ~Csi_streamer();
+
+  /*
+   * ソケットの準備とI/Oスレッドの開始
+   * return: 配信先の指定が不正またはソケットの準備に失敗したらfalse
+   */
+  bool start();
+
+  /*
+   * I/Oスレッドの停止とソケットのクローズ（キューに残ったフレームは破棄）
+   */
+  void stop();
+
+  /*
+   * フレームの配信（処理グラフのワーカーから呼び出す）
+   * レコードへの変換は1回で，購読しているクライアントのキューで共有する
+   */
+  void publish(const Csi_frame &frame);
+
+  void print_summary(std::ostream &os);
+};
+
+/*
+ * デコード済みフレームを配信する段（後段にはそのまま渡す）
+ * 段の指定: "stream:tcp:5600" など
+ */
+class Stream_stage : public Csi_stage {
+private:
+  std::unique_ptr<Csi_streamer> streamer;
+
+public:
+  Stream_stage(std::unique_ptr<Csi_streamer> streamer)
+      : streamer(std::move(streamer)) {}
+  std::string get_name() override { return "stream"; }
+  bool process(Csi_frame_ref &frame) override {
+    this->streamer->publish(*frame);
+    return true;
+  }
+  void flush() override {
+    this->streamer->print_summary(std::cout);
+    this->streamer->stop();
+  }
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
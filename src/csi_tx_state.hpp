@@ -0,0 +1,98 @@
+/*
+Copyright (c) 2022, Sota Kondo
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+* Neither the name of the copyright holder nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <memory>
+#include <stdlib.h>
+#include <unordered_map>
+
+#include "csi_frame.hpp"
+
+#ifndef CSI_TX_STATE
+#define CSI_TX_STATE
+
+#define TX_STATE_MAX 16 // 段が状態を持つ送信機の最大数
+
+namespace csirdr {
+
+/*
+ * 送信機（MACアドレスと受信インターフェイス）ごとの段の状態
+ * 時間方向の処理をする段で，複数の送信機のフレームが混ざらないようにする
+ * キーはCsi_assemblyと同じ MAC | iface << 48
+ * 送信機がcapacityを超えたら最も長く使われていない状態を破棄する
+ * 段の処理（1スレッド）からのみ呼び出す
+ */
+template <typename T> class Tx_state_map {
+private:
+  struct entry {
+    std::unique_ptr<T> state;
+    uint64_t last_used;
+  };
+  std::unordered_map<uint64_t, entry> states;
+  size_t capacity;
+  uint64_t clock = 0;
+  uint64_t n_evicted = 0;
+
+public:
+  explicit Tx_state_map(size_t capacity = TX_STATE_MAX) {
+    this->capacity = capacity;
+  }
+
+  static uint64_t get_key(const Csi_frame &frame) {
+    return (frame.header.tx_mac_add & 0xFFFFFFFFFFFFULL) |
+           ((uint64_t)frame.iface << 48);
+  }
+
+  /*
+   * フレームの送信機の状態（なければ新しく作る）
+   */
+  T &get(const Csi_frame &frame) {
+    uint64_t key = get_key(frame);
+    auto it = this->states.find(key);
+    if (it == this->states.end()) {
+      if (this->states.size() >= this->capacity) {
+        auto oldest = this->states.begin();
+        for (auto i = this->states.begin(); i != this->states.end(); ++i) {
+          if (i->second.last_used < oldest->second.last_used) {
+            oldest = i;
+          }
+        }
+        this->states.erase(oldest);
+        this->n_evicted++;
+      }
+      it = this->states.emplace(key, entry{std::make_unique<T>(), 0}).first;
+    }
+    it->second.last_used = ++this->clock;
+    return *it->second.state;
+  }
+
+  size_t size() const { return this->states.size(); }
+  uint64_t get_n_evicted() const { return this->n_evicted; }
+};
+
+} // namespace csirdr
+
+#endif /* end of include guard */
@@ -0,0 +1,31 @@
+#!/bin/sh
+# nexliveのキャプチャバックエンド（libpcap, TPACKET_V3）の比較
+# vethペアを作成し，CSIのpcapファイルをtcpreplayで最大速度で流して
+# 両方のバックエンドの--statsと損失の集計を出力する
+# gnuplotのウィンドウを開くのでX11の環境で実行する
+#
+# usage: sudo ./tools/bench_backends.sh <pcap file> [seconds]
+set -eu
+
+PCAP=$1
+SEC=${2:-10}
+NEXLIVE=${NEXLIVE:-nexlive}
+
+ip link add csibench0 type veth peer name csibench1
+trap 'ip link del csibench0' EXIT
+ip link set csibench0 up
+ip link set csibench1 up
+
+for backend in pcap mmap; do
+  echo "========================================="
+  echo "backend: $backend"
+  "$NEXLIVE" -i csibench1 -t "$SEC" --backend "$backend" \
+    --stats --stats-interval 0 --status-hz 0 &
+  pid=$!
+
+  sleep 1
+  timeout $((SEC - 2)) tcpreplay -q -i csibench0 --topspeed --loop 0 \
+    "$PCAP" || true
+
+  wait $pid
+done
@@ -0,0 +1,40 @@
+#!/bin/sh
+# gnuplotへのデータの送り方（binary, text）の描画速度の比較
+# vethペアを作成し，CSIのpcapファイルをtcpreplayで最大速度で流して
+# 両方の送り方で描画できたフレームレートを出力し，最後に並べて表示する
+# gnuplotのウィンドウを開くのでX11の環境で実行する
+#
+# usage: sudo ./tools/bench_plot.sh <pcap file> [seconds]
+set -eu
+
+PCAP=$1
+SEC=${2:-10}
+NEXLIVE=${NEXLIVE:-nexlive}
+LOG=$(mktemp)
+
+ip link add csibench0 type veth peer name csibench1
+trap 'ip link del csibench0; rm -f "$LOG"' EXIT
+ip link set csibench0 up
+ip link set csibench1 up
+
+for transfer in binary text; do
+  echo "========================================="
+  echo "transfer: $transfer"
+  opt=""
+  if [ "$transfer" = "text" ]; then
+    opt="--plot-text"
+  fi
+  # 描画が追いつかない分は捨て，gnuplotの速度だけを測る
+  "$NEXLIVE" -i csibench1 -t "$SEC" --status-hz 0 $opt | tee -a "$LOG" &
+  pid=$!
+
+  sleep 1
+  timeout $((SEC - 2)) tcpreplay -q -i csibench0 --topspeed --loop 0 \
+    "$PCAP" || true
+
+  wait $pid
+done
+
+# 終了時の "Plot (binary, ...): ... fps, write ... us/frame (max ... fps)"
+echo "========================================="
+grep '^Plot (' "$LOG" || echo "no plot summary found"